@@ -0,0 +1,119 @@
+#ifndef SPLAY_ARENA_H
+#define SPLAY_ARENA_H
+
+#include <algorithm>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace splay {
+
+// Bump allocator for data that's built once and freed as a whole. Memory comes
+// from one block sized up front; more blocks are only added if that was too
+// small. Nothing is freed (or destroyed) individually, so only trivially
+// destructible types can be allocated.
+class arena {
+public:
+    explicit arena(size_t initial_size = 0) {
+        if (initial_size) add_block(initial_size);
+    }
+
+    arena(arena&& other) noexcept {
+        swap(other);
+    }
+
+    arena& operator=(arena&& other) noexcept {
+        arena tmp{std::move(other)};
+        swap(tmp);
+        return *this;
+    }
+
+    ~arena() {
+        while (head_) {
+            block* next = head_->next;
+            ::operator delete(head_);
+            head_ = next;
+        }
+    }
+
+    arena(const arena&) = delete;
+    arena& operator=(const arena&) = delete;
+
+    // Uninitialized storage for count objects of type T
+    template<typename T>
+    T* allocate(size_t count) {
+        static_assert(std::is_trivially_destructible<T>::value, "arena objects are never destroyed");
+        return static_cast<T*>(allocate_bytes(count * sizeof(T), alignof(T)));
+    }
+
+    // Bytes handed out
+    size_t used() const {
+        return used_;
+    }
+
+    // Bytes of all blocks
+    size_t reserved() const {
+        return reserved_;
+    }
+
+    size_t block_count() const {
+        return blocks_;
+    }
+
+    // Space needed for count objects of type T, including worst case alignment
+    template<typename T>
+    static constexpr size_t size_for(size_t count) {
+        return count * sizeof(T) + alignof(T) - 1;
+    }
+
+private:
+    struct block {
+        block* next;
+        // Data follows
+    };
+
+    block*                 head_ = nullptr;
+    char*                  pos_ = nullptr;
+    char*                  end_ = nullptr;
+    size_t                 used_ = 0;
+    size_t                 reserved_ = 0;
+    size_t                 blocks_ = 0;
+
+    void swap(arena& other) noexcept {
+        std::swap(head_, other.head_);
+        std::swap(pos_, other.pos_);
+        std::swap(end_, other.end_);
+        std::swap(used_, other.used_);
+        std::swap(reserved_, other.reserved_);
+        std::swap(blocks_, other.blocks_);
+    }
+
+    void add_block(size_t size) {
+        constexpr size_t header = (sizeof(block) + alignof(max_align_t) - 1) / alignof(max_align_t) * alignof(max_align_t);
+        char* mem = static_cast<char*>(::operator new(header + size));
+        head_ = new (mem) block{head_};
+        pos_ = mem + header;
+        end_ = pos_ + size;
+        reserved_ += size;
+        ++blocks_;
+    }
+
+    void* allocate_bytes(size_t size, size_t align) {
+        auto p = reinterpret_cast<uintptr_t>(pos_);
+        p = (p + align - 1) & ~(align - 1);
+        if (!pos_ || p + size > reinterpret_cast<uintptr_t>(end_)) {
+            // Estimate was too small, grow geometrically
+            add_block(std::max(size + align, reserved_));
+            p = (reinterpret_cast<uintptr_t>(pos_) + align - 1) & ~(align - 1);
+        }
+        pos_ = reinterpret_cast<char*>(p + size);
+        used_ += size;
+        return reinterpret_cast<void*>(p);
+    }
+};
+
+} // namespace splay
+
+#endif
@@ -0,0 +1,671 @@
+#include "async_io.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <queue>
+#include <stdexcept>
+#include <thread>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#include <sys/stat.h>
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define ASYNC_IO_URING 1
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+namespace {
+
+constexpr size_t max_request_size = 1 << 20;
+
+struct io_request {
+    enum class op_type { read, write };
+
+    op_type  op;
+    int      fd;
+    char*    buf;
+    size_t   size;
+    uint64_t offset;
+    std::function<void(long long)> done; // Called with the number of bytes transferred or -errno
+#ifdef ASYNC_IO_URING
+    iovec    iov{};
+#endif
+};
+
+int open_for_read(const std::string& filename)
+{
+#ifdef _WIN32
+    return _open(filename.c_str(), _O_RDONLY | _O_BINARY);
+#else
+    return open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+#endif
+}
+
+int open_for_write(const std::string& filename)
+{
+#ifdef _WIN32
+    return _open(filename.c_str(), _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+    return open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+#endif
+}
+
+long long file_size(int fd)
+{
+#ifdef _WIN32
+    struct _stati64 st;
+    return _fstati64(fd, &st) == 0 ? st.st_size : -1;
+#else
+    struct stat st;
+    return fstat(fd, &st) == 0 ? st.st_size : -1;
+#endif
+}
+
+void close_file(int fd)
+{
+#ifdef _WIN32
+    _close(fd);
+#else
+    close(fd);
+#endif
+}
+
+// Synchronous positional read/write of the whole request
+long long positional_io(const io_request& r)
+{
+#ifdef _WIN32
+    // The offset goes with each call (like pread/pwrite), so requests don't share a file position
+    const HANDLE handle = reinterpret_cast<HANDLE>(_get_osfhandle(r.fd));
+    if (handle == INVALID_HANDLE_VALUE) return -EBADF;
+#endif
+    size_t done = 0;
+    while (done < r.size) {
+        const unsigned chunk = static_cast<unsigned>(std::min<size_t>(r.size - done, max_request_size));
+#ifdef _WIN32
+        const uint64_t pos = r.offset + done;
+        OVERLAPPED overlapped{};
+        overlapped.Offset     = static_cast<DWORD>(pos);
+        overlapped.OffsetHigh = static_cast<DWORD>(pos >> 32);
+        DWORD transferred = 0;
+        const BOOL ok = r.op == io_request::op_type::read ? ReadFile(handle, r.buf + done, chunk, &transferred, &overlapped) : WriteFile(handle, r.buf + done, chunk, &transferred, &overlapped);
+        if (!ok && GetLastError() != ERROR_HANDLE_EOF) return -EIO;
+        const long long res = ok ? static_cast<long long>(transferred) : 0;
+#else
+        const ssize_t res = r.op == io_request::op_type::read ? pread(r.fd, r.buf + done, chunk, static_cast<off_t>(r.offset + done)) : pwrite(r.fd, r.buf + done, chunk, static_cast<off_t>(r.offset + done));
+        if (res < 0 && errno == EINTR) continue;
+#endif
+        if (res < 0) return -errno;
+        if (res == 0) break;
+        done += static_cast<size_t>(res);
+    }
+    return static_cast<long long>(done);
+}
+
+class io_backend {
+public:
+    virtual ~io_backend() {}
+    virtual const char* name() const = 0;
+    // Takes ownership of the requests, completes each exactly once (possibly on another thread)
+    virtual void submit(io_request* const* requests, size_t count) = 0;
+};
+
+class thread_backend : public io_backend {
+public:
+    explicit thread_backend(int num_threads) {
+        for (int i = 0; i < num_threads; ++i) {
+            threads_.emplace_back(&thread_backend::worker, this);
+        }
+    }
+
+    ~thread_backend() override {
+        {
+            std::lock_guard<std::mutex> lock{mutex_};
+            exiting_ = true;
+        }
+        cv_.notify_all();
+        for (auto& t : threads_) {
+            t.join();
+        }
+    }
+
+    const char* name() const override {
+        return "threads";
+    }
+
+    void submit(io_request* const* requests, size_t count) override {
+        {
+            std::lock_guard<std::mutex> lock{mutex_};
+            for (size_t i = 0; i < count; ++i) {
+                queue_.push(requests[i]);
+            }
+        }
+        cv_.notify_all();
+    }
+
+private:
+    std::vector<std::thread> threads_;
+    std::mutex               mutex_;
+    std::condition_variable  cv_;
+    std::queue<io_request*>  queue_;
+    bool                     exiting_ = false;
+
+    void worker() {
+        for (;;) {
+            io_request* r;
+            {
+                std::unique_lock<std::mutex> lock{mutex_};
+                cv_.wait(lock, [this] { return exiting_ || !queue_.empty(); });
+                if (queue_.empty()) return;
+                r = queue_.front();
+                queue_.pop();
+            }
+            r->done(positional_io(*r));
+            delete r;
+        }
+    }
+};
+
+#ifdef ASYNC_IO_URING
+// Minimal io_uring driver using the raw system calls (no liburing dependency).
+// Submissions are serialized by the caller, completions are reaped by a dedicated thread.
+class uring_backend : public io_backend {
+public:
+    explicit uring_backend(unsigned entries) {
+        io_uring_params params{};
+        fd_ = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+        if (fd_ < 0) {
+            throw std::runtime_error(std::string("io_uring_setup failed: ") + strerror(errno));
+        }
+        entries_ = params.sq_entries;
+
+        sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        const bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (single_mmap) {
+            sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+        }
+        sq_ring_ = map(sq_ring_size_, IORING_OFF_SQ_RING);
+        cq_ring_ = single_mmap ? sq_ring_ : map(cq_ring_size_, IORING_OFF_CQ_RING);
+        sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+        sqes_ = static_cast<io_uring_sqe*>(map(sqes_size_, IORING_OFF_SQES));
+
+        auto sq = static_cast<char*>(sq_ring_);
+        sq_tail_  = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sq_local_tail_ = *sq_tail_;
+        sq_mask_  = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sq_array_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        auto cq = static_cast<char*>(cq_ring_);
+        cq_head_  = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cq_tail_  = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cq_mask_  = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes_     = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+        reaper_ = std::thread{&uring_backend::reap, this};
+    }
+
+    ~uring_backend() override {
+        // A NOP without a request tells the reaper to stop, everything else has completed by now
+        {
+            std::lock_guard<std::mutex> lock{mutex_};
+            auto& sqe = next_sqe();
+            sqe.opcode = IORING_OP_NOP;
+            enter(1);
+        }
+        reaper_.join();
+        munmap(sqes_, sqes_size_);
+        if (cq_ring_ != sq_ring_) munmap(cq_ring_, cq_ring_size_);
+        munmap(sq_ring_, sq_ring_size_);
+        close(fd_);
+    }
+
+    const char* name() const override {
+        return "io_uring";
+    }
+
+    // The caller keeps at most entries_ requests in flight, so the rings can't overflow
+    void submit(io_request* const* requests, size_t count) override {
+        assert(count <= entries_);
+        std::lock_guard<std::mutex> lock{mutex_};
+        for (size_t i = 0; i < count; ++i) {
+            auto& r = *requests[i];
+            r.iov.iov_base = r.buf;
+            r.iov.iov_len  = r.size;
+            auto& sqe = next_sqe();
+            sqe.opcode    = r.op == io_request::op_type::read ? IORING_OP_READV : IORING_OP_WRITEV;
+            sqe.fd        = r.fd;
+            sqe.addr      = reinterpret_cast<uint64_t>(&r.iov);
+            sqe.len       = 1;
+            sqe.off       = r.offset;
+            sqe.user_data = reinterpret_cast<uint64_t>(&r);
+        }
+        enter(static_cast<unsigned>(count));
+    }
+
+private:
+    int           fd_ = -1;
+    unsigned      entries_ = 0;
+    void*         sq_ring_ = nullptr;
+    void*         cq_ring_ = nullptr;
+    size_t        sq_ring_size_ = 0;
+    size_t        cq_ring_size_ = 0;
+    io_uring_sqe* sqes_ = nullptr;
+    size_t        sqes_size_ = 0;
+    unsigned*     sq_tail_;
+    unsigned      sq_local_tail_;
+    unsigned      sq_mask_;
+    unsigned*     sq_array_;
+    unsigned*     cq_head_;
+    unsigned*     cq_tail_;
+    unsigned      cq_mask_;
+    io_uring_cqe* cqes_;
+    std::mutex    mutex_;
+    std::thread   reaper_;
+
+    void* map(size_t size, off_t offset) {
+        void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, offset);
+        if (p == MAP_FAILED) {
+            const int err = errno;
+            close(fd_);
+            throw std::runtime_error(std::string("Mapping io_uring failed: ") + strerror(err));
+        }
+        return p;
+    }
+
+    // Entries become visible to the kernel in enter()
+    io_uring_sqe& next_sqe() {
+        const unsigned index = sq_local_tail_++ & sq_mask_;
+        auto& sqe = sqes_[index];
+        memset(&sqe, 0, sizeof(sqe));
+        sq_array_[index] = index;
+        return sqe;
+    }
+
+    void enter(unsigned to_submit) {
+        __atomic_store_n(sq_tail_, sq_local_tail_, __ATOMIC_RELEASE);
+        while (to_submit) {
+            const long res = syscall(__NR_io_uring_enter, fd_, to_submit, 0, 0, nullptr, 0);
+            if (res < 0) {
+                if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+                    std::this_thread::yield();
+                    continue;
+                }
+                throw std::runtime_error(std::string("io_uring_enter failed: ") + strerror(errno));
+            }
+            to_submit -= static_cast<unsigned>(res);
+        }
+    }
+
+    void reap() {
+        for (;;) {
+            const long res = syscall(__NR_io_uring_enter, fd_, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+            if (res < 0 && errno != EINTR) {
+                assert(false);
+                return;
+            }
+            unsigned head = *cq_head_;
+            const unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+            bool exiting = false;
+            for (; head != tail; ++head) {
+                const auto& cqe = cqes_[head & cq_mask_];
+                auto r = reinterpret_cast<io_request*>(cqe.user_data);
+                if (!r) {
+                    exiting = true;
+                    continue;
+                }
+                r->done(cqe.res);
+                delete r;
+            }
+            __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+            if (exiting) return;
+        }
+    }
+};
+#endif
+
+} // unnamed namespace
+
+class async_io::impl {
+public:
+    explicit impl(int queue_depth, bool allow_io_uring) : queue_depth_(queue_depth), start_(std::chrono::steady_clock::now()) {
+        assert(queue_depth > 0);
+#ifdef ASYNC_IO_URING
+        if (allow_io_uring) {
+            try {
+                backend_.reset(new uring_backend{static_cast<unsigned>(queue_depth)});
+            } catch (const std::exception& e) {
+                std::cout << "Falling back to threaded I/O: " << e.what() << std::endl;
+            }
+        }
+#else
+        (void)allow_io_uring;
+#endif
+        if (!backend_) {
+            backend_.reset(new thread_backend{4});
+        }
+    }
+
+    ~impl() {
+        {
+            std::unique_lock<std::mutex> lock{mutex_};
+            cv_.wait(lock, [this] { return in_flight_ == 0; });
+        }
+        backend_.reset();
+    }
+
+    const char* backend() const {
+        return backend_->name();
+    }
+
+    // Submits the requests, waiting whenever queue_depth requests are in flight
+    void submit(std::vector<io_request*>& requests) {
+        for (auto& r : requests) {
+            auto done = std::move(r->done);
+            const bool is_read = r->op == io_request::op_type::read;
+            r->done = [this, is_read, done = std::move(done)](long long res) {
+                done(res);
+                std::lock_guard<std::mutex> lock{mutex_};
+                --in_flight_;
+                if (res > 0) {
+                    (is_read ? stats_.bytes_read : stats_.bytes_written) += static_cast<uint64_t>(res);
+                }
+                ++(is_read ? stats_.reads : stats_.writes);
+                cv_.notify_all();
+            };
+        }
+        for (size_t pos = 0; pos < requests.size(); ) {
+            size_t count;
+            {
+                std::unique_lock<std::mutex> lock{mutex_};
+                cv_.wait(lock, [this] { return in_flight_ < queue_depth_; });
+                count = std::min(requests.size() - pos, static_cast<size_t>(queue_depth_ - in_flight_));
+                in_flight_ += static_cast<int>(count);
+                stats_.max_queue_depth = std::max(stats_.max_queue_depth, in_flight_);
+            }
+            backend_->submit(&requests[pos], count);
+            pos += count;
+        }
+        requests.clear();
+    }
+
+    void read_file(const std::string& filename, std::promise<std::vector<char>> promise, std::vector<io_request*>& batch) {
+        struct read_state {
+            std::promise<std::vector<char>> promise;
+            std::vector<char>               data;
+            std::string                     filename;
+            int                             fd;
+            std::atomic<int>                remaining;
+            std::atomic<bool>               failed{false};
+        };
+
+        const int fd = open_for_read(filename);
+        if (fd < 0) {
+            promise.set_exception(std::make_exception_ptr(std::runtime_error("File not found: " + filename)));
+            return;
+        }
+        const long long size = file_size(fd);
+        if (size <= 0) {
+            close_file(fd);
+            if (size < 0) {
+                promise.set_exception(std::make_exception_ptr(std::runtime_error("Could not get size of " + filename)));
+            } else {
+                promise.set_value({});
+            }
+            return;
+        }
+
+        auto state = std::make_shared<read_state>();
+        state->promise  = std::move(promise);
+        state->filename = filename;
+        state->fd       = fd;
+        state->data.resize(static_cast<size_t>(size));
+        const size_t num_requests = (state->data.size() + max_request_size - 1) / max_request_size;
+        state->remaining = static_cast<int>(num_requests);
+        for (size_t i = 0; i < num_requests; ++i) {
+            const size_t offset = i * max_request_size;
+            const size_t len    = std::min(max_request_size, state->data.size() - offset);
+            batch.push_back(new io_request{io_request::op_type::read, fd, state->data.data() + offset, len, offset, [state, len](long long res) {
+                if (res != static_cast<long long>(len)) state->failed = true;
+                if (--state->remaining) return;
+                close_file(state->fd);
+                if (state->failed) {
+                    state->promise.set_exception(std::make_exception_ptr(std::runtime_error("Error reading " + state->filename)));
+                } else {
+                    state->promise.set_value(std::move(state->data));
+                }
+            }});
+        }
+    }
+
+    async_io_stats stats() const {
+        std::lock_guard<std::mutex> lock{mutex_};
+        auto s = stats_;
+        s.queue_depth = in_flight_;
+        s.seconds     = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_).count();
+        return s;
+    }
+
+private:
+    std::unique_ptr<io_backend>           backend_;
+    const int                             queue_depth_;
+    const std::chrono::steady_clock::time_point start_;
+    mutable std::mutex                    mutex_;
+    std::condition_variable               cv_;
+    int                                   in_flight_ = 0;
+    async_io_stats                        stats_;
+};
+
+async_io::async_io(int queue_depth, bool allow_io_uring) : impl_(new impl(queue_depth, allow_io_uring))
+{
+}
+
+async_io::~async_io() = default;
+
+const char* async_io::backend() const
+{
+    return impl_->backend();
+}
+
+std::future<std::vector<char>> async_io::read_file(const std::string& filename)
+{
+    return std::move(read_files({filename})[0]);
+}
+
+std::vector<std::future<std::vector<char>>> async_io::read_files(const std::vector<std::string>& filenames)
+{
+    std::vector<std::future<std::vector<char>>> res;
+    std::vector<io_request*> batch;
+    for (const auto& filename : filenames) {
+        std::promise<std::vector<char>> promise;
+        res.push_back(promise.get_future());
+        impl_->read_file(filename, std::move(promise), batch);
+    }
+    impl_->submit(batch);
+    return res;
+}
+
+async_io_stats async_io::stats() const
+{
+    return impl_->stats();
+}
+
+void async_io::report(std::ostream& os) const
+{
+    const auto s = stats();
+    const double mb = 1.0 / (1 << 20);
+    const auto flags = os.flags();
+    const auto precision = os.precision();
+    os << std::fixed << std::setprecision(1);
+    os << "I/O (" << backend() << "): " << s.reads << " reads " << s.bytes_read * mb << " MB, " << s.writes << " writes " << s.bytes_written * mb << " MB, ";
+    os << (s.seconds > 0 ? (s.bytes_read + s.bytes_written) * mb / s.seconds : 0.0) << " MB/s, max queue depth " << s.max_queue_depth << std::endl;
+    os.flags(flags);
+    os.precision(precision);
+}
+
+class async_file_writer::impl {
+public:
+    explicit impl(async_io::impl& io, const std::string& filename, size_t block_size, int max_blocks_in_flight)
+        : io_(io), filename_(filename), block_size_(block_size), max_blocks_in_flight_(max_blocks_in_flight) {
+        assert(block_size > 0 && max_blocks_in_flight > 0);
+        fd_ = open_for_write(filename);
+        if (fd_ < 0) throw std::runtime_error("Could not create " + filename);
+        current_.reserve(block_size_);
+    }
+
+    ~impl() {
+        if (fd_ >= 0) {
+            wait_all();
+            close_file(fd_);
+        }
+    }
+
+    void write(const char* data, size_t size) {
+        assert(fd_ >= 0);
+        while (size) {
+            const size_t n = std::min(size, block_size_ - current_.size());
+            current_.insert(current_.end(), data, data + n);
+            data += n;
+            size -= n;
+            size_ += n;
+            if (current_.size() == block_size_) {
+                flush();
+            }
+        }
+    }
+
+    void write_at(uint64_t offset, const char* data, size_t size) {
+        assert(offset + size <= size_);
+        const uint64_t current_offset = size_ - current_.size();
+        if (offset >= current_offset) {
+            // Still buffered
+            memcpy(current_.data() + (offset - current_offset), data, size);
+            return;
+        }
+        const size_t buffered = static_cast<size_t>(std::max<uint64_t>(offset + size, current_offset) - current_offset);
+        if (buffered) {
+            memcpy(current_.data(), data + (size - buffered), buffered);
+            size -= buffered;
+        }
+        // The region may still be in flight, so wait before overwriting it
+        wait_all();
+        auto patch = std::make_shared<std::vector<char>>(data, data + size);
+        submit(patch, offset);
+    }
+
+    uint64_t size() const {
+        return size_;
+    }
+
+    void close() {
+        if (fd_ < 0) return;
+        flush();
+        wait_all();
+        close_file(fd_);
+        fd_ = -1;
+        if (failed_) throw std::runtime_error("Error writing " + filename_);
+    }
+
+private:
+    async_io::impl&   io_;
+    std::string       filename_;
+    int               fd_ = -1;
+    const size_t      block_size_;
+    const int         max_blocks_in_flight_;
+    std::vector<char> current_;
+    uint64_t          size_ = 0;
+
+    std::mutex              mutex_;
+    std::condition_variable cv_;
+    int                     in_flight_ = 0;
+    bool                    failed_    = false;
+
+    void flush() {
+        if (current_.empty()) return;
+        {
+            // Keep the producer at most max_blocks_in_flight_ blocks ahead of the disk
+            std::unique_lock<std::mutex> lock{mutex_};
+            cv_.wait(lock, [this] { return in_flight_ < max_blocks_in_flight_; });
+        }
+        auto block = std::make_shared<std::vector<char>>();
+        block->reserve(block_size_);
+        block->swap(current_);
+        const uint64_t offset = size_ - block->size();
+        submit(block, offset);
+    }
+
+    void submit(const std::shared_ptr<std::vector<char>>& buffer, uint64_t offset) {
+        {
+            std::lock_guard<std::mutex> lock{mutex_};
+            ++in_flight_;
+        }
+        const size_t num_requests = (buffer->size() + max_request_size - 1) / max_request_size;
+        auto remaining = std::make_shared<size_t>(num_requests); // Guarded by mutex_
+        std::vector<io_request*> batch;
+        for (size_t i = 0; i < num_requests; ++i) {
+            const size_t pos = i * max_request_size;
+            const size_t len = std::min(max_request_size, buffer->size() - pos);
+            batch.push_back(new io_request{io_request::op_type::write, fd_, buffer->data() + pos, len, offset + pos, [this, buffer, remaining, len](long long res) {
+                std::lock_guard<std::mutex> lock{mutex_};
+                if (res != static_cast<long long>(len)) failed_ = true;
+                if (!--*remaining) {
+                    --in_flight_;
+                    cv_.notify_all();
+                }
+            }});
+        }
+        io_.submit(batch);
+    }
+
+    void wait_all() {
+        std::unique_lock<std::mutex> lock{mutex_};
+        cv_.wait(lock, [this] { return in_flight_ == 0; });
+    }
+};
+
+async_file_writer::async_file_writer(async_io& io, const std::string& filename, size_t block_size, int max_blocks_in_flight)
+    : impl_(new impl(*io.impl_, filename, block_size, max_blocks_in_flight))
+{
+}
+
+async_file_writer::~async_file_writer() = default;
+
+void async_file_writer::write(const void* data, size_t size)
+{
+    impl_->write(static_cast<const char*>(data), size);
+}
+
+void async_file_writer::write_at(uint64_t offset, const void* data, size_t size)
+{
+    impl_->write_at(offset, static_cast<const char*>(data), size);
+}
+
+uint64_t async_file_writer::size() const
+{
+    return impl_->size();
+}
+
+void async_file_writer::close()
+{
+    impl_->close();
+}
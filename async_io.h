@@ -0,0 +1,81 @@
+#ifndef ASYNC_IO_H_INCLUDED
+#define ASYNC_IO_H_INCLUDED
+
+#include <future>
+#include <iosfwd>
+#include <memory>
+#include <string>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+struct async_io_stats {
+    uint64_t reads           = 0;   // Completed read requests
+    uint64_t writes          = 0;   // Completed write requests
+    uint64_t bytes_read      = 0;
+    uint64_t bytes_written   = 0;
+    int      queue_depth     = 0;   // Requests currently in flight
+    int      max_queue_depth = 0;
+    double   seconds         = 0.0; // Since the async_io was created
+};
+
+// Asynchronous file I/O. Uses io_uring on Linux when the kernel allows it,
+// otherwise a small pool of threads doing positional reads and writes.
+// Requests are submitted in batches, at most queue_depth are in flight.
+class async_io {
+public:
+    explicit async_io(int queue_depth = 64, bool allow_io_uring = true);
+    ~async_io();
+
+    async_io(const async_io&) = delete;
+    async_io& operator=(const async_io&) = delete;
+
+    // "io_uring" or "threads"
+    const char* backend() const;
+
+    // Reads a whole file, errors are reported through the future
+    std::future<std::vector<char>> read_file(const std::string& filename);
+
+    // Reads several files, all requests are submitted together
+    std::vector<std::future<std::vector<char>>> read_files(const std::vector<std::string>& filenames);
+
+    async_io_stats stats() const;
+
+    // Prints the backend, request counts, throughput and queue depth
+    void report(std::ostream& os) const;
+
+private:
+    class impl;
+    std::unique_ptr<impl> impl_;
+
+    friend class async_file_writer;
+};
+
+// Writes a file sequentially in blocks of block_size bytes (at block aligned
+// offsets), keeping up to max_blocks_in_flight blocks queued so the caller
+// can continue producing data while the previous blocks are written.
+class async_file_writer {
+public:
+    explicit async_file_writer(async_io& io, const std::string& filename, size_t block_size = 1 << 20, int max_blocks_in_flight = 4);
+    ~async_file_writer();
+
+    async_file_writer(const async_file_writer&) = delete;
+    async_file_writer& operator=(const async_file_writer&) = delete;
+
+    void write(const void* data, size_t size);
+
+    // Overwrites already written bytes, e.g. to fill in a header
+    void write_at(uint64_t offset, const void* data, size_t size);
+
+    // Bytes written so far
+    uint64_t size() const;
+
+    // Writes the last partial block and waits for all writes, throws if any failed
+    void close();
+
+private:
+    class impl;
+    std::unique_ptr<impl> impl_;
+};
+
+#endif
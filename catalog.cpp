@@ -0,0 +1,109 @@
+#include "catalog.h"
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <ostream>
+#include <thread>
+
+namespace splay {
+
+namespace {
+
+bool is_midi_file(const std::filesystem::path& p)
+{
+    auto ext = p.extension().string();
+    std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c) { return static_cast<char>(tolower(c)); });
+    return ext == ".mid" || ext == ".midi";
+}
+
+void scan_entry(catalog_entry& entry, std::vector<char>& buffer)
+{
+    std::ifstream in(entry.path, std::ifstream::binary | std::ifstream::ate);
+    if (!in) {
+        entry.error = "Could not open";
+        return;
+    }
+    const auto size = static_cast<size_t>(in.tellg());
+    buffer.resize(size);
+    in.seekg(0);
+    if (!in.read(buffer.data(), size)) {
+        entry.error = "Read error";
+        return;
+    }
+    try {
+        entry.info = midi::scan(buffer.data(), size);
+        entry.ok   = true;
+    } catch (const std::exception& e) {
+        entry.error = e.what();
+    }
+}
+
+int count_channels(uint16_t mask)
+{
+    int n = 0;
+    for (; mask; mask &= mask - 1) ++n;
+    return n;
+}
+
+} // unnamed namespace
+
+std::vector<catalog_entry> scan_catalog(const std::string& root, unsigned num_threads)
+{
+    std::vector<catalog_entry> entries;
+    for (const auto& de : std::filesystem::recursive_directory_iterator(root, std::filesystem::directory_options::skip_permission_denied)) {
+        if (de.is_regular_file() && is_midi_file(de.path())) {
+            entries.emplace_back();
+            entries.back().path = de.path().string();
+        }
+    }
+
+    std::sort(entries.begin(), entries.end(), [](const catalog_entry& l, const catalog_entry& r) { return l.path < r.path; });
+
+    if (!num_threads) num_threads = std::max(1U, std::thread::hardware_concurrency());
+    num_threads = std::min<unsigned>(num_threads, static_cast<unsigned>(std::max<size_t>(1, entries.size())));
+
+    // Workers take the next file until there are none left, each reusing its own read buffer
+    std::atomic<size_t> next{0};
+    auto worker = [&entries, &next] {
+        std::vector<char> buffer;
+        for (size_t i; (i = next++) < entries.size(); ) {
+            scan_entry(entries[i], buffer);
+        }
+    };
+    std::vector<std::thread> threads;
+    for (unsigned i = 1; i < num_threads; ++i) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto& t : threads) {
+        t.join();
+    }
+    return entries;
+}
+
+void print_catalog(std::ostream& out, const std::vector<catalog_entry>& entries)
+{
+    size_t   failed = 0;
+    uint64_t notes  = 0;
+    double   duration = 0.0;
+    out << "path\tformat\ttracks\tduration\tnotes\ttempo_changes\tchannels\n";
+    for (const auto& e : entries) {
+        if (!e.ok) {
+            out << e.path << "\terror: " << e.error << "\n";
+            ++failed;
+            continue;
+        }
+        const auto& i = e.info;
+        out << e.path << '\t' << i.format << '\t' << i.tracks << '\t' << std::fixed << std::setprecision(2) << i.duration << '\t' << i.notes << '\t' << i.tempo_changes << '\t';
+        out << std::hex << std::setw(4) << std::setfill('0') << i.channel_mask << std::dec << std::setfill(' ') << " (" << count_channels(i.channel_mask) << ")\n";
+        notes    += i.notes;
+        duration += i.duration;
+    }
+    out << entries.size() << " files, " << failed << " failed, " << notes << " notes, " << std::fixed << std::setprecision(1) << duration / 3600.0 << " hours" << std::endl;
+}
+
+} // namespace splay
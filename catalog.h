@@ -0,0 +1,27 @@
+#ifndef SPLAY_CATALOG_H
+#define SPLAY_CATALOG_H
+
+#include "midi.h"
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+namespace splay {
+
+struct catalog_entry {
+    std::string     path;
+    bool            ok = false;
+    std::string     error;
+    midi::file_info info;
+};
+
+// Scans the metadata of all MIDI files (.mid/.midi) below root, in parallel
+// on num_threads threads (0 means one per hardware thread).
+std::vector<catalog_entry> scan_catalog(const std::string& root, unsigned num_threads = 0);
+
+// Writes one tab separated line per entry followed by a summary
+void print_catalog(std::ostream& out, const std::vector<catalog_entry>& entries);
+
+} // namespace splay
+
+#endif
@@ -7,6 +7,9 @@ constexpr unsigned samplerate = 44100;
 constexpr float pi = 3.1415926535897932385f;
 constexpr auto sqrt2 = 1.414213562f;
 
+// Number of samples rendered in one go by the synthesis kernels
+constexpr int block_size = 32;
+
 } // namespace splay
 
 #endif
@@ -9,7 +9,7 @@ namespace splay {
 
 enum class filter_type { lowpass, bandpass, highpass };
 constexpr int filter_type_count = static_cast<int>(filter_type::highpass) + 1;
-static const char* filter_type_names[filter_type_count] ={"lowpass", "bandpass", "highpass"};
+constexpr const char* filter_type_names[filter_type_count] = {"lowpass", "bandpass", "highpass"};
 
 class simple_lowpass_filter {
 public:
@@ -107,6 +107,36 @@ public:
         return 0.5f*out;
     }
 
+    // Filters count samples in place. Ft must match the current filter type,
+    // it's used to exploit the structure of the feed forward coefficients.
+    template<filter_type Ft>
+    void process(float* buf, int count) {
+        assert(Ft == type_);
+        float in_1  = old_in_1;
+        float in_2  = old_in_2;
+        float out_1 = old_out_1;
+        float out_2 = old_out_2;
+        for (int i = 0; i < count; ++i) {
+            const float in = buf[i];
+            float ff = 0.0f;
+            switch (Ft) {
+            case filter_type::lowpass:  ff = amp_in_0 * (in + 2.0f * in_1 + in_2); break;
+            case filter_type::bandpass: ff = amp_in_0 * (in - in_2);               break;
+            case filter_type::highpass: ff = amp_in_0 * (in - 2.0f * in_1 + in_2); break;
+            }
+            const float out = ff - (amp_out_1 * out_1) - (amp_out_2 * out_2);
+            out_2 = out_1;
+            out_1 = out;
+            in_2  = in_1;
+            in_1  = in;
+            buf[i] = 0.5f*out;
+        }
+        old_in_1  = in_1;
+        old_in_2  = in_2;
+        old_out_1 = out_1;
+        old_out_2 = out_2;
+    }
+
 private:
     filter_type type_ = filter_type::lowpass;
     float freq_ = 0;
@@ -141,9 +171,20 @@ public:
     }
 
     float operator()(const float in) {
+        switch (type_) {
+        case filter_type::lowpass:  return process<filter_type::lowpass>(in);
+        case filter_type::bandpass: return process<filter_type::bandpass>(in);
+        case filter_type::highpass: return process<filter_type::highpass>(in);
+        }
+        assert(false);
+        return 0.0f;
+    }
+
+    template<filter_type Ft>
+    float process(const float in) {
         buf0_ += f * (in - buf0_ + feedback * (buf0_ - buf1_));
         buf1_ += f * (buf0_ - buf1_);
-        switch (type_) {
+        switch (Ft) {
         case filter_type::lowpass:  return buf1_;
         case filter_type::bandpass: return buf0_ - buf1_;
         case filter_type::highpass: return in - buf0_;
@@ -152,6 +193,13 @@ public:
         return 0.0f;
     }
 
+    template<filter_type Ft>
+    void process(float* buf, int count) {
+        for (int i = 0; i < count; ++i) {
+            buf[i] = process<Ft>(buf[i]);
+        }
+    }
+
 public:
     // Parameters
     filter_type type_ = filter_type::lowpass;
@@ -0,0 +1,324 @@
+#include "graph.h"
+#include "realtime.h"
+#include "worker_pool.h"
+#include <algorithm>
+#include <stdexcept>
+#include <stdint.h>
+#include <assert.h>
+
+namespace splay {
+
+namespace {
+
+// Buffers are placed on separate cache lines, so nodes running on different threads don't share any
+constexpr int floats_per_cache_line = 64 / sizeof(float);
+
+int slot_size(port_type t) {
+    return (port_buffer_size(t) + floats_per_cache_line - 1) / floats_per_cache_line * floats_per_cache_line;
+}
+
+struct port_ref {
+    int node = -1;
+    int port = -1;
+};
+
+struct node {
+    std::string             name;
+    std::vector<port_type>  input_types;
+    std::vector<port_type>  output_types;
+    node_function           process;
+    std::vector<port_ref>   sources;        // By input
+    int                     level = -1;
+
+    // Set up by compile
+    std::vector<int>        output_slots;
+    std::vector<const float*> input_ptrs;
+    std::vector<float*>     output_ptrs;
+    std::vector<const bool*> input_flags;
+    std::vector<bool*>      output_flags;
+};
+
+} // unnamed namespace
+
+class processing_graph::impl {
+public:
+    node_id add_node(const std::string& name, const std::vector<port_type>& inputs, const std::vector<port_type>& outputs, node_function process) {
+        assert(process);
+        compiled_ = false;
+        nodes_.push_back({name, inputs, outputs, std::move(process), std::vector<port_ref>(inputs.size()), -1, {}, {}, {}, {}, {}});
+        return static_cast<node_id>(nodes_.size() - 1);
+    }
+
+    void connect(node_id from, int output, node_id to, int input) {
+        check_port(from, output, false);
+        check_port(to, input, true);
+        if (nodes_[from].output_types[output] != nodes_[to].input_types[input]) {
+            throw std::runtime_error("Port type mismatch connecting " + nodes_[from].name + " to " + nodes_[to].name);
+        }
+        if (nodes_[to].sources[input].node >= 0) {
+            throw std::runtime_error("Input of " + nodes_[to].name + " is already connected");
+        }
+        compiled_ = false;
+        nodes_[to].sources[input] = {from, output};
+    }
+
+    void output(node_id node, int port) {
+        check_port(node, port, false);
+        if (nodes_[node].output_types[port] != port_type::audio) {
+            throw std::runtime_error("Graph output " + nodes_[node].name + " isn't an audio port");
+        }
+        compiled_ = false;
+        output_ = {node, port};
+    }
+
+    void compile() {
+        if (output_.node < 0) {
+            throw std::runtime_error("Processing graph has no output");
+        }
+        assign_levels();
+        plan_buffers();
+        compiled_ = true;
+    }
+
+    bool process(float* out, int count, worker_pool* workers) {
+        assert(compiled_);
+        assert(count > 0 && count <= block_size);
+        for (const auto& level : levels_) {
+            if (workers && level.size() > 1) {
+                level_ = &level;
+                count_ = count;
+                workers->run(static_cast<int>(level.size()), run_level_node_);
+            } else {
+                for (const auto n : level) {
+                    run_node(n, count);
+                }
+            }
+        }
+        const auto& nd = nodes_[output_.node];
+        if (*nd.output_flags[output_.port]) {
+            std::fill(out, out + 2 * count, 0.0f);
+            return true;
+        }
+        const float* result = nd.output_ptrs[output_.port];
+        std::copy(result, result + 2 * count, out);
+        return false;
+    }
+
+    int level_count() const {
+        return static_cast<int>(levels_.size());
+    }
+
+    int buffer_count() const {
+        return static_cast<int>(slot_types_.size());
+    }
+
+    size_t buffer_memory() const {
+        return arena_.capacity() * sizeof(float) + (compiled_ ? slot_types_.size() + 1 : 0) * sizeof(bool);
+    }
+
+    bool prefault_buffers() {
+        assert(compiled_);
+        const bool arena_locked = prefault_memory(arena_.data(), arena_.size() * sizeof(float));
+        return prefault_memory(silent_.get(), (slot_types_.size() + 1) * sizeof(bool)) && arena_locked;
+    }
+
+private:
+    std::vector<node>               nodes_;
+    port_ref                        output_;
+    bool                            compiled_ = false;
+    std::vector<std::vector<int>>   levels_;
+    std::vector<port_type>          slot_types_;
+    std::vector<float>              arena_;
+    std::unique_ptr<bool[]>         silent_;        // By slot, the last one is for unconnected inputs
+
+    // Job for the workers, made once so process doesn't allocate
+    const std::vector<int>*         level_ = nullptr;
+    int                             count_ = 0;
+    const std::function<void(int)>  run_level_node_ = [this](int i) { run_node((*level_)[i], count_); };
+
+    void check_port(node_id n, int port, bool input) const {
+        if (n < 0 || n >= static_cast<int>(nodes_.size())) {
+            throw std::runtime_error("Invalid processing graph node");
+        }
+        const auto& types = input ? nodes_[n].input_types : nodes_[n].output_types;
+        if (port < 0 || port >= static_cast<int>(types.size())) {
+            throw std::runtime_error("Invalid port of " + nodes_[n].name);
+        }
+    }
+
+    void run_node(int n, int count) {
+        auto& nd = nodes_[n];
+        for (auto f : nd.output_flags) {
+            *f = false;
+        }
+        nd.process({nd.input_ptrs.data(), nd.output_ptrs.data(), nd.input_flags.data(), nd.output_flags.data(), count});
+    }
+
+    // Topological sort (Kahn) by level: a node's level is one past the deepest node it reads from
+    void assign_levels() {
+        const int num_nodes = static_cast<int>(nodes_.size());
+        std::vector<int> pending(num_nodes);
+        std::vector<std::vector<int>> consumers(num_nodes);
+        for (int n = 0; n < num_nodes; ++n) {
+            nodes_[n].level = 0;
+            for (const auto& src : nodes_[n].sources) {
+                if (src.node < 0) continue;
+                consumers[src.node].push_back(n);
+                ++pending[n];
+            }
+        }
+        std::vector<int> ready;
+        for (int n = 0; n < num_nodes; ++n) {
+            if (!pending[n]) ready.push_back(n);
+        }
+        levels_.clear();
+        int scheduled = 0;
+        while (!ready.empty()) {
+            std::vector<int> next;
+            for (const auto n : ready) {
+                for (const auto c : consumers[n]) {
+                    nodes_[c].level = std::max(nodes_[c].level, nodes_[n].level + 1);
+                    if (!--pending[c]) next.push_back(c);
+                }
+            }
+            scheduled += static_cast<int>(ready.size());
+            levels_.push_back(std::move(ready));
+            ready = std::move(next);
+        }
+        if (scheduled != num_nodes) {
+            throw std::runtime_error("Processing graph has a cycle");
+        }
+    }
+
+    // Linear scan over the levels: outputs take a free buffer of the same type when their
+    // level starts, and give it back after the last level reading from it
+    void plan_buffers() {
+        std::vector<std::vector<int>> last_use(nodes_.size()); // Level of the last reader, by node and output
+        for (auto& nd : nodes_) {
+            last_use[&nd - &nodes_[0]].assign(nd.output_types.size(), nd.level);
+        }
+        for (const auto& nd : nodes_) {
+            for (const auto& src : nd.sources) {
+                if (src.node < 0) continue;
+                auto& last = last_use[src.node][src.port];
+                last = std::max(last, nd.level);
+            }
+        }
+        last_use[output_.node][output_.port] = static_cast<int>(levels_.size()); // Read after the last level
+
+        slot_types_.clear();
+        std::vector<int> free_slots;
+        std::vector<std::vector<int>> releases(levels_.size());
+        for (size_t l = 0; l < levels_.size(); ++l) {
+            for (const auto n : levels_[l]) {
+                auto& nd = nodes_[n];
+                nd.output_slots.clear();
+                for (size_t p = 0; p < nd.output_types.size(); ++p) {
+                    const auto type = nd.output_types[p];
+                    auto it = std::find_if(free_slots.begin(), free_slots.end(), [&](int s) { return slot_types_[s] == type; });
+                    int slot;
+                    if (it != free_slots.end()) {
+                        slot = *it;
+                        free_slots.erase(it);
+                    } else {
+                        slot = static_cast<int>(slot_types_.size());
+                        slot_types_.push_back(type);
+                    }
+                    nd.output_slots.push_back(slot);
+                    const auto last = last_use[n][p];
+                    if (last < static_cast<int>(levels_.size())) releases[last].push_back(slot);
+                }
+            }
+            free_slots.insert(free_slots.end(), releases[l].begin(), releases[l].end());
+        }
+
+        // One arena for all buffers, the last slot stays zero and is read by unconnected inputs
+        std::vector<size_t> offsets;
+        size_t size = 0;
+        for (const auto t : slot_types_) {
+            offsets.push_back(size);
+            size += slot_size(t);
+        }
+        const size_t silence = size;
+        size += slot_size(port_type::audio);
+        arena_.assign(size + floats_per_cache_line, 0.0f);
+        float* base = arena_.data();
+        while (reinterpret_cast<uintptr_t>(base) % (floats_per_cache_line * sizeof(float))) {
+            ++base;
+        }
+
+        const size_t silence_slot = slot_types_.size();
+        silent_.reset(new bool[silence_slot + 1]());
+        silent_[silence_slot] = true;
+
+        for (auto& nd : nodes_) {
+            nd.output_ptrs.clear();
+            nd.output_flags.clear();
+            for (const auto s : nd.output_slots) {
+                nd.output_ptrs.push_back(base + offsets[s]);
+                nd.output_flags.push_back(&silent_[s]);
+            }
+        }
+        for (auto& nd : nodes_) {
+            nd.input_ptrs.clear();
+            nd.input_flags.clear();
+            for (const auto& src : nd.sources) {
+                nd.input_ptrs.push_back(src.node < 0 ? base + silence : nodes_[src.node].output_ptrs[src.port]);
+                nd.input_flags.push_back(src.node < 0 ? &silent_[silence_slot] : nodes_[src.node].output_flags[src.port]);
+            }
+        }
+    }
+};
+
+processing_graph::processing_graph() : impl_(new impl{})
+{
+}
+
+processing_graph::~processing_graph() = default;
+
+processing_graph::node_id processing_graph::add_node(const std::string& name, const std::vector<port_type>& inputs, const std::vector<port_type>& outputs, node_function process)
+{
+    return impl_->add_node(name, inputs, outputs, std::move(process));
+}
+
+void processing_graph::connect(node_id from, int output, node_id to, int input)
+{
+    impl_->connect(from, output, to, input);
+}
+
+void processing_graph::output(node_id node, int port)
+{
+    impl_->output(node, port);
+}
+
+void processing_graph::compile()
+{
+    impl_->compile();
+}
+
+bool processing_graph::process(float* out, int count, worker_pool* workers)
+{
+    return impl_->process(out, count, workers);
+}
+
+int processing_graph::level_count() const
+{
+    return impl_->level_count();
+}
+
+int processing_graph::buffer_count() const
+{
+    return impl_->buffer_count();
+}
+
+size_t processing_graph::buffer_memory() const
+{
+    return impl_->buffer_memory();
+}
+
+bool processing_graph::prefault_buffers()
+{
+    return impl_->prefault_buffers();
+}
+
+} // namespace splay
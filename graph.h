@@ -0,0 +1,98 @@
+#ifndef SPLAY_GRAPH_H
+#define SPLAY_GRAPH_H
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include <stddef.h>
+#include "constants.h"
+
+class worker_pool;
+
+namespace splay {
+
+// Audio ports carry a block of interleaved stereo samples, control ports one value per block
+enum class port_type { audio, control };
+
+// Number of floats in a buffer of the port type
+constexpr int port_buffer_size(port_type t) {
+    return t == port_type::audio ? 2 * block_size : 1;
+}
+
+// Buffers of one node for one block of count (at most block_size) samples.
+// Unconnected inputs read silence, outputs must be overwritten (not added to).
+//
+// Every buffer carries a silent flag. A node that knows its output is silent
+// sets the flag instead of writing the samples, and nodes reading a silent
+// input skip it without looking at its (undefined) samples. Nodes with a tail
+// (e.g. a filter or delay) keep producing output after their inputs turn
+// silent until the tail has died away.
+struct node_buffers {
+    const float* const* inputs;
+    float* const*       outputs;
+    const bool* const*  input_flags;
+    bool* const*        output_flags;
+    int                 count;
+
+    bool input_silent(int input) const {
+        return *input_flags[input];
+    }
+
+    void output_silent(int output, bool silent) const {
+        *output_flags[output] = silent;
+    }
+};
+
+using node_function = std::function<void(const node_buffers&)>;
+
+// Signal chain of nodes with typed ports. Once built it's compiled into a
+// schedule of levels: each node runs after everything it reads from, and the
+// nodes of one level are independent so they can run in parallel. Intermediate
+// buffers are only live from their producer's level to their last consumer's,
+// and are then reused, so the working set stays small however many nodes
+// there are.
+class processing_graph {
+public:
+    using node_id = int;
+
+    processing_graph();
+    ~processing_graph();
+
+    processing_graph(const processing_graph&) = delete;
+    processing_graph& operator=(const processing_graph&) = delete;
+
+    node_id add_node(const std::string& name, const std::vector<port_type>& inputs, const std::vector<port_type>& outputs, node_function process);
+
+    // An output can feed any number of inputs, an input reads from at most one output
+    void connect(node_id from, int output, node_id to, int input);
+
+    // Audio output of the graph
+    void output(node_id node, int port);
+
+    // Must be called after the last change and before process
+    void compile();
+
+    // Runs all nodes for one block and writes the graph output (count interleaved stereo samples) to out,
+    // returns true if it's silent (out is then zero). Levels with more than one node are spread over workers if given.
+    bool process(float* out, int count, worker_pool* workers = nullptr);
+
+    int level_count() const;
+
+    // Number of intermediate buffers after reuse
+    int buffer_count() const;
+
+    // Bytes of buffer memory (including the silence flags) after compile
+    size_t buffer_memory() const;
+
+    // Touches and locks the buffers (see prefault_memory) after compile, returns false if they couldn't be locked
+    bool prefault_buffers();
+
+private:
+    class impl;
+    std::unique_ptr<impl> impl_;
+};
+
+} // namespace splay
+
+#endif
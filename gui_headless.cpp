@@ -0,0 +1,386 @@
+#include "gui.h"
+#include "gui_headless.h"
+#include "job_queue.h"
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+std::ostream debug_output_stream{std::clog.rdbuf()};
+
+namespace {
+
+constexpr int vk_escape = 0x1B;
+
+headless::options g_options;
+
+using clock_type = std::chrono::steady_clock;
+
+double seconds_since(clock_type::time_point start)
+{
+    return std::chrono::duration<double>(clock_type::now() - start).count();
+}
+
+class headless_knob : public knob {
+private:
+    double value_ = 0.0;
+    std::vector<observer_type> observers_;
+
+    virtual double do_value() const override {
+        return value_;
+    }
+
+    virtual void do_value(double x) override {
+        assert(x >= 0 && x <= 1.0);
+        value_ = x;
+        for (const auto& obs : observers_) {
+            obs(value_);
+        }
+    }
+
+    virtual void do_add_observer(observer_type o) override {
+        observers_.push_back(o);
+    }
+};
+
+class headless_label : public text_window {
+public:
+    explicit headless_label(const std::string& text) : text_(text) {
+    }
+
+private:
+    std::string text_;
+
+    virtual std::string do_text() const override {
+        return text_;
+    }
+
+    virtual void do_text(const std::string& val) override {
+        text_ = val;
+    }
+};
+
+class headless_bitmap_window : public bitmap_window {
+public:
+    headless_bitmap_window(int width, int height) : width_(width), height_(height) {
+        assert(width > 0 && height > 0);
+    }
+
+    const unsigned* pixels() const {
+        return updates_ ? pixels_.data() : nullptr;
+    }
+
+    // Returns true (once) if the pixels have been updated since the last call
+    bool take_dirty() {
+        const bool d = dirty_;
+        dirty_ = false;
+        return d;
+    }
+
+    uint64_t updates() const {
+        return updates_;
+    }
+
+    // 32-bit BMP, rows bottom-up like the pixels
+    void save_bmp(const std::string& filename) const {
+        std::ofstream out(filename, std::ofstream::binary);
+        if (!out) throw std::runtime_error("Could not create " + filename);
+        const uint32_t image_size = static_cast<uint32_t>(pixels_.size() * sizeof(unsigned));
+        auto put16 = [&out](unsigned v) { out.put(char(v & 0xff)); out.put(char((v >> 8) & 0xff)); };
+        auto put32 = [&put16](unsigned v) { put16(v & 0xffff); put16(v >> 16); };
+        out.write("BM", 2);
+        put32(14 + 40 + image_size);
+        put32(0);
+        put32(14 + 40);
+        put32(40);        // BITMAPINFOHEADER
+        put32(width_);
+        put32(height_);
+        put16(1);
+        put16(32);
+        put32(0);         // BI_RGB
+        put32(image_size);
+        put32(2835);      // 72 DPI
+        put32(2835);
+        put32(0);
+        put32(0);
+        for (const auto p : pixels_) {
+            put32(p);
+        }
+        if (!out) throw std::runtime_error("Error writing " + filename);
+    }
+
+private:
+    int                   width_;
+    int                   height_;
+    std::vector<unsigned> pixels_;
+    uint64_t              updates_ = 0;
+    bool                  dirty_ = false;
+
+    virtual int do_width() const override {
+        return width_;
+    }
+
+    virtual int do_height() const override {
+        return height_;
+    }
+
+    virtual void do_update_pixels(const unsigned* pixels) override {
+        pixels_.assign(pixels, pixels + width_ * height_);
+        ++updates_;
+        dirty_ = true;
+    }
+};
+
+struct scheduled_action {
+    double                    time;
+    uint64_t                  order;    // Actions due at the same time run in the order they were scheduled
+    std::function<void(void)> action;
+};
+
+class headless_gui;
+headless_gui* g_current = nullptr;
+
+class headless_gui {
+public:
+    using job_type          = gui::job_type;
+    using key_listener_type = gui::key_listener_type;
+
+    headless_gui() : options_(g_options) {
+        if (g_current) throw std::logic_error("Only one headless gui can exist at a time");
+        if (options_.frame_interval <= 0.0) throw std::runtime_error("Invalid headless frame interval");
+        g_current = this;
+    }
+
+    ~headless_gui() {
+        g_current = nullptr;
+    }
+
+    headless_gui(const headless_gui&) = delete;
+    headless_gui& operator=(const headless_gui&) = delete;
+
+    void add_job(job_type job) {
+        job_queue_.push(job);
+    }
+
+    void main_loop() {
+        quit_ = false;
+        for (; !quit_ && now_ < options_.duration; ++frame_, now_ = frame_ * options_.frame_interval) {
+            run_due_actions();
+            job_queue_.execute_all();
+            render_audio();
+            if (on_idle_) {
+                const auto start = clock_type::now();
+                on_idle_();
+                idle_seconds_ += seconds_since(start);
+            }
+            if (!options_.dump_prefix.empty()) {
+                dump_bitmaps();
+            }
+        }
+    }
+
+    void set_on_idle(const std::function<void(void)>& on_idle) {
+        on_idle_ = on_idle;
+    }
+
+    knob& make_knob(int, int, int, int) {
+        knobs_.emplace_back(new headless_knob{});
+        return *knobs_.back();
+    }
+
+    text_window& make_label(const std::string& text, int, int, int, int) {
+        labels_.emplace_back(new headless_label{text});
+        return *labels_.back();
+    }
+
+    bitmap_window& make_bitmap_window(int, int, int width, int height) {
+        bitmaps_.emplace_back(new headless_bitmap_window{width, height});
+        return *bitmaps_.back();
+    }
+
+    void add_key_listener(key_listener_type key_listener) {
+        key_listeners_.push_back(std::move(key_listener));
+    }
+
+    double now() const {
+        return now_;
+    }
+
+    void schedule(double time, std::function<void(void)> action) {
+        actions_.push_back({time, next_order_++, std::move(action)});
+        std::stable_sort(actions_.begin(), actions_.end(), [](const scheduled_action& l, const scheduled_action& r) { return l.time < r.time; });
+    }
+
+    void schedule_key(double time, bool pressed, int vk) {
+        schedule(time, [this, pressed, vk] {
+            for (auto& l : key_listeners_) {
+                l(pressed, vk);
+            }
+            if (!pressed && vk == vk_escape) quit_ = true;
+        });
+    }
+
+    void set_audio_renderer(unsigned sample_rate, std::function<void(size_t)> render) {
+        audio_rate_   = sample_rate;
+        audio_render_ = std::move(render);
+        // Starts in step with the clock
+        audio_samples_ = static_cast<uint64_t>(now_ * audio_rate_ + 0.5);
+    }
+
+    void report(std::ostream& out) const {
+        uint64_t updates = 0;
+        for (const auto& b : bitmaps_) {
+            updates += b->updates();
+        }
+        out << "Headless gui: " << frame_ << " frames (" << now_ << " virtual seconds), " << audio_samples_ << " audio samples, idle handler " << std::fixed << std::setprecision(3)
+            << (frame_ ? 1000.0 * idle_seconds_ / frame_ : 0.0) << " ms/frame, " << updates << " bitmap updates" << std::defaultfloat << std::endl;
+    }
+
+private:
+    headless::options             options_;
+    std::function<void(void)>     on_idle_;
+    job_queue                     job_queue_;
+    std::vector<key_listener_type> key_listeners_;
+    std::vector<std::unique_ptr<headless_knob>>          knobs_;
+    std::vector<std::unique_ptr<headless_label>>         labels_;
+    std::vector<std::unique_ptr<headless_bitmap_window>> bitmaps_;
+    std::vector<scheduled_action> actions_;     // Ordered by time
+    uint64_t                      next_order_ = 0;
+    uint64_t                      frame_ = 0;
+    double                        now_ = 0.0;
+    double                        idle_seconds_ = 0.0;
+    bool                          quit_ = false;
+    unsigned                      audio_rate_ = 0;
+    std::function<void(size_t)>   audio_render_;
+    uint64_t                      audio_samples_ = 0;  // Rendered, up to the end of the current frame
+
+    // Renders the audio up to the end of the frame, so the idle handler sees it
+    void render_audio() {
+        if (!audio_render_) return;
+        const auto end = static_cast<uint64_t>((frame_ + 1) * options_.frame_interval * audio_rate_ + 0.5);
+        if (end > audio_samples_) {
+            audio_render_(static_cast<size_t>(end - audio_samples_));
+            audio_samples_ = end;
+        }
+    }
+
+    void run_due_actions() {
+        // Actions may schedule new actions, so take the due ones out first
+        const auto end = std::find_if(actions_.begin(), actions_.end(), [this](const scheduled_action& a) { return a.time > now_; });
+        std::vector<scheduled_action> due(std::make_move_iterator(actions_.begin()), std::make_move_iterator(end));
+        actions_.erase(actions_.begin(), end);
+        for (auto& a : due) {
+            a.action();
+        }
+    }
+
+    void dump_bitmaps() {
+        for (size_t i = 0; i < bitmaps_.size(); ++i) {
+            if (!bitmaps_[i]->take_dirty()) continue;
+            std::ostringstream name;
+            name << options_.dump_prefix << i << "_" << std::setw(6) << std::setfill('0') << frame_ << ".bmp";
+            bitmaps_[i]->save_bmp(name.str());
+        }
+    }
+};
+
+headless_gui& current_gui()
+{
+    if (!g_current) throw std::logic_error("No headless gui exists");
+    return *g_current;
+}
+
+} // unnamed namespace
+
+class gui::impl : public headless_gui {
+};
+
+gui::gui(int width, int height)
+    : impl_(new impl())
+{
+    (void)width; (void)height;
+}
+
+gui::~gui() = default;
+
+void gui::add_job(job_type job)
+{
+    impl_->add_job(job);
+}
+
+void gui::main_loop()
+{
+    impl_->main_loop();
+}
+
+void gui::add_key_listener(key_listener_type key_listener)
+{
+    impl_->add_key_listener(key_listener);
+}
+
+void gui::set_on_idle(const std::function<void(void)>& on_idle)
+{
+    impl_->set_on_idle(on_idle);
+}
+
+knob& gui::make_knob(int x, int y, int width, int height)
+{
+    return impl_->make_knob(x, y, width, height);
+}
+
+text_window& gui::make_label(const std::string& text, int x, int y, int width, int height)
+{
+    return impl_->make_label(text, x, y, width, height);
+}
+
+bitmap_window& gui::make_bitmap_window(int x, int y, int width, int height)
+{
+    return impl_->make_bitmap_window(x, y, width, height);
+}
+
+namespace headless {
+
+void configure(const options& opt)
+{
+    g_options = opt;
+}
+
+double now()
+{
+    return current_gui().now();
+}
+
+void schedule(double time, std::function<void(void)> action)
+{
+    current_gui().schedule(time, std::move(action));
+}
+
+void schedule_key(double time, bool pressed, int vk)
+{
+    current_gui().schedule_key(time, pressed, vk);
+}
+
+void set_audio_renderer(unsigned sample_rate, std::function<void(size_t)> render)
+{
+    if (!render && !g_current) return; // The gui is gone already
+    current_gui().set_audio_renderer(sample_rate, std::move(render));
+}
+
+const unsigned* pixels(const bitmap_window& bw)
+{
+    const auto w = dynamic_cast<const headless_bitmap_window*>(&bw);
+    assert(w);
+    return w->pixels();
+}
+
+void report(std::ostream& out)
+{
+    current_gui().report(out);
+}
+
+} // namespace headless
@@ -0,0 +1,50 @@
+#ifndef GUI_HEADLESS_H_INCLUDED
+#define GUI_HEADLESS_H_INCLUDED
+
+#include <functional>
+#include <iosfwd>
+#include <string>
+
+class bitmap_window;
+
+// Control of the off-screen gui backend (gui_headless.cpp, built instead of
+// gui.cpp with SPLAY_HEADLESS_GUI). Widgets only keep their state in memory
+// and main_loop runs on a virtual clock: each frame advances the clock by
+// frame_interval, performs the scripted actions that are due, runs queued
+// jobs, renders the frame's audio, runs the idle handler, and writes the
+// bitmaps updated in that frame to image files if requested. Everything runs
+// on the gui thread, so a run is the same every time.
+namespace headless {
+
+struct options {
+    double      frame_interval = 1.0 / 60.0;   // Virtual seconds per frame
+    double      duration       = 10.0;         // main_loop returns once the clock reaches this
+    std::string dump_prefix;                   // If set, updated bitmaps are written to <prefix><window>_<frame>.bmp
+};
+
+// Applies to gui objects created afterwards
+void configure(const options& opt);
+
+// Virtual time of the current frame (of the existing gui object)
+double now();
+
+// Runs action on the gui thread in the first frame at or after time
+void schedule(double time, std::function<void(void)> action);
+
+// Delivers a key event to the key listeners at time. Releasing escape ends main_loop, as in the Win32 backend.
+void schedule_key(double time, bool pressed, int vk);
+
+// Used by the headless sound output (wavedev_headless.cpp) in place of a device: each frame,
+// before the idle handler, render is called with the number of stereo samples the virtual
+// clock advanced by at sample_rate. nullptr removes it.
+void set_audio_renderer(unsigned sample_rate, std::function<void(size_t)> render);
+
+// Last pixels passed to update_pixels (width * height, bottom-up rows), nullptr if never updated
+const unsigned* pixels(const bitmap_window& bw);
+
+// Frames run, audio rendered and time spent in the idle handler and updating bitmaps
+void report(std::ostream& out);
+
+} // namespace headless
+
+#endif
@@ -0,0 +1,135 @@
+#include "input_recording.h"
+#include "midi.h"
+#include <cmath>
+#include <istream>
+#include <limits>
+#include <ostream>
+#include <sstream>
+#include <stdexcept>
+
+namespace splay {
+
+namespace {
+
+const char* const header    = "splay-input-recording 2";
+const char* const header_v1 = "splay-input-recording 1"; // Without the player settings
+
+const char* const event_type_names[] = { "note_on", "note_off", "toggle_edit_mode" };
+
+input_event_type parse_event_type(const std::string& name)
+{
+    for (int i = 0; i < static_cast<int>(sizeof(event_type_names) / sizeof(*event_type_names)); ++i) {
+        if (name == event_type_names[i]) return static_cast<input_event_type>(i);
+    }
+    throw std::runtime_error("Unknown input event " + name);
+}
+
+} // unnamed namespace
+
+bool valid_voice_quota(int channel, int voices)
+{
+    return channel >= 0 && channel < midi::max_channels && channel != midi::drum_channel && voices >= 1;
+}
+
+void input_recording::save(std::ostream& out) const
+{
+    out << header << '\n';
+    for (const auto& f : files) {
+        out << "file " << f << '\n';
+    }
+    if (has_player_settings) {
+        for (const auto& l : layers) {
+            out << "layer " << l << '\n';
+        }
+        out << "audibility ";
+        if (std::isinf(audibility_threshold)) {
+            out << "off\n";
+        } else {
+            const auto precision = out.precision(std::numeric_limits<float>::max_digits10);
+            out << audibility_threshold << '\n';
+            out.precision(precision);
+        }
+        out << "voices " << voice_pool_size << '\n';
+        for (const auto& q : voice_quotas) {
+            out << "quota " << q.first << ' ' << q.second << '\n';
+        }
+        if (start > 0.0) {
+            const auto precision = out.precision(std::numeric_limits<double>::max_digits10);
+            out << "start " << start << '\n';
+            out.precision(precision);
+        }
+    }
+    for (const auto& e : events) {
+        out << "event " << e.position << ' ' << event_type_names[static_cast<int>(e.type)];
+        if (e.type != input_event_type::toggle_edit_mode) {
+            out << ' ' << static_cast<int>(e.key) << ' ' << static_cast<int>(e.velocity);
+        }
+        out << '\n';
+    }
+    out << "length " << length << '\n';
+}
+
+input_recording input_recording::load(std::istream& in)
+{
+    std::string line;
+    if (!std::getline(in, line) || (line != header && line != header_v1)) {
+        throw std::runtime_error("Not an input recording");
+    }
+    input_recording res;
+    res.has_player_settings = line == header;
+    while (std::getline(in, line)) {
+        if (line.empty()) continue;
+        std::istringstream iss{line};
+        std::string kind;
+        iss >> kind;
+        if (kind == "file") {
+            std::getline(iss >> std::ws, line);
+            res.files.push_back(line);
+        } else if (kind == "layer" && res.has_player_settings) {
+            std::getline(iss >> std::ws, line);
+            res.layers.push_back(line);
+        } else if (kind == "audibility" && res.has_player_settings) {
+            std::string value;
+            iss >> value;
+            res.audibility_threshold = value == "off" ? -std::numeric_limits<float>::infinity() : std::stof(value);
+        } else if (kind == "voices" && res.has_player_settings) {
+            if (!(iss >> res.voice_pool_size) || res.voice_pool_size < 1) {
+                throw std::runtime_error("Invalid voice pool size: " + line);
+            }
+        } else if (kind == "quota" && res.has_player_settings) {
+            int channel = 0, quota = 0;
+            if (!(iss >> channel >> quota) || !valid_voice_quota(channel, quota)) {
+                throw std::runtime_error("Invalid voice quota: " + line);
+            }
+            res.voice_quotas.emplace_back(channel, quota);
+        } else if (kind == "start" && res.has_player_settings) {
+            if (!(iss >> res.start) || res.start < 0.0) {
+                throw std::runtime_error("Invalid start position: " + line);
+            }
+        } else if (kind == "event") {
+            input_event e{};
+            std::string type;
+            iss >> e.position >> type;
+            e.type = parse_event_type(type);
+            e.key  = piano_key::OFF;
+            if (e.type != input_event_type::toggle_edit_mode) {
+                int key = 0, velocity = 0;
+                iss >> key >> velocity;
+                e.key      = static_cast<piano_key>(key);
+                e.velocity = static_cast<uint8_t>(velocity);
+                if (!piano_key_valid(e.key) || velocity < 0 || velocity > 127) iss.setstate(std::ios::failbit);
+            }
+            if (!iss || (!res.events.empty() && e.position < res.events.back().position)) {
+                throw std::runtime_error("Invalid input event: " + line);
+            }
+            res.events.push_back(e);
+        } else if (kind == "length") {
+            iss >> res.length;
+        } else {
+            throw std::runtime_error("Invalid input recording line: " + line);
+        }
+    }
+    return res;
+}
+
+} // namespace splay
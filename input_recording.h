@@ -0,0 +1,47 @@
+#ifndef SPLAY_INPUT_RECORDING_H
+#define SPLAY_INPUT_RECORDING_H
+
+#include <iosfwd>
+#include <string>
+#include <utility>
+#include <vector>
+#include <stdint.h>
+#include "note.h"
+
+namespace splay {
+
+enum class input_event_type { note_on, note_off, toggle_edit_mode };
+
+struct input_event {
+    uint64_t         position;      // Render position (in samples) where the event took effect
+    input_event_type type;
+    piano_key        key;
+    uint8_t          velocity;
+};
+
+// Live input of a session together with what was being played and how, so the
+// session can be rendered again offline with every event at the same sample
+// position and the same result. Stored as text, one line per file/setting/event.
+struct input_recording {
+    std::vector<std::string> files;     // Playlist
+    // Player setup of the session (see player_options), missing from version 1 recordings
+    bool                     has_player_settings = false;
+    std::vector<std::string> layers;
+    float                    audibility_threshold = 0.0f;   // dB, -infinity if voices weren't retired
+    int                      voice_pool_size = 0;
+    std::vector<std::pair<int, int>> voice_quotas;          // (channel, voices)
+    double                   start = 0.0;                   // Seconds into the first song
+    std::vector<input_event> events;    // Ordered by position
+    uint64_t                 length = 0; // Samples rendered in the session
+
+    void save(std::ostream& out) const;
+    static input_recording load(std::istream& in);
+};
+
+// True if a melodic channel (0-15 but not the drums, they have their own voices) may be
+// limited to this many voices, for voice_quotas and --quota
+bool valid_voice_quota(int channel, int voices);
+
+} // namespace splay
+
+#endif
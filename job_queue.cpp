@@ -1,4 +1,5 @@
 #include "job_queue.h"
+#include "realtime_guard.h"
 #include <mutex>
 #include <queue>
 
@@ -10,6 +11,7 @@ public:
     }
 
     void push(job_type j) {
+        realtime_check_lock("job_queue mutex");
         std::lock_guard<std::mutex> lock_(mutex_);
         queue_.push(j);
     }
@@ -18,6 +20,7 @@ public:
         for (;;) {
             job_type j;
             {
+                realtime_check_lock("job_queue mutex");
                 std::lock_guard<std::mutex> lock_(mutex_);
                 if (queue_.empty()) {
                     return;
@@ -3,13 +3,35 @@
 #include "midi.h"
 #include "note.h"
 #include "filter.h"
+#include "modulation.h"
+#include "percussion.h"
+#include "overview.h"
+#include "wavfile.h"
+#include "async_io.h"
+#include "vis.h"
+#include "catalog.h"
+#include "workload.h"
+#include "input_recording.h"
+#include "graph.h"
+#include "worker_pool.h"
+#include "pcm_ring.h"
+#include "realtime_guard.h"
+#include "triple_buffer.h"
 #include <vector>
 #include <algorithm>
 #include <limits>
+#include <cmath>
 #include <memory>
 #include <string>
 #include <cassert>
+#include <cstring>
 #include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <atomic>
+#include <thread>
+#include <chrono>
 
 namespace splay {
 
@@ -17,6 +39,7 @@ struct stereo_sample {
     float l;
     float r;
 };
+static_assert(sizeof(stereo_sample) == 2 * sizeof(float), "stereo_sample must match interleaved audio port buffers");
 constexpr stereo_sample operator*(stereo_sample s, float scale) {
     return { s.l * scale, s.r * scale };
 }
@@ -27,35 +50,53 @@ constexpr stereo_sample operator*(float scale, stereo_sample s) {
 using signal_source = std::function<float(void)>;
 using signal_sink   = std::function<void(float)>;
 using sample_source = std::function<stereo_sample(void)>;
+using block_source  = std::function<bool(stereo_sample*, int)>; // Returns true if the block is silent
+
+short float_to_short(float f) {
+    int i = static_cast<int>(f);
+    if (i < std::numeric_limits<short>::min()) i = std::numeric_limits<short>::min();
+    if (i > std::numeric_limits<short>::max()) i = std::numeric_limits<short>::max();
+    return static_cast<short>(i);
+}
+
+// Converts count stereo samples to interleaved 16-bit PCM
+void convert_to_pcm(const stereo_sample* in, short* out, int count) {
+    for (int i = 0; i < count; ++i) {
+        out[2 * i + 0] = float_to_short(in[i].l * 32767.0f);
+        out[2 * i + 1] = float_to_short(in[i].r * 32767.0f);
+    }
+}
 
 class output_dev {
 public:
-    using on_out_callback = std::function<void(std::vector<short>)>;
+    // Gets the output of each period and the fraction of the period's duration spent rendering it
+    using on_out_callback = std::function<void(std::vector<short>, float)>;
 
-    explicit output_dev(const sample_source& main_generator, const on_out_callback& on_out_callback = nullptr) : main_generator_(main_generator), on_out_callback_(on_out_callback), wavedev_(samplerate, [this](short* d, size_t s) { do_mix(d, static_cast<int>(s/2)); }) {
+    explicit output_dev(const block_source& main_generator, const on_out_callback& on_out_callback = nullptr, const realtime_thread_config& rt_config = realtime_thread_config{})
+        : main_generator_(main_generator), on_out_callback_(on_out_callback), wavedev_(samplerate, [this](short* d, size_t s) { do_mix(d, static_cast<int>(s/2)); }, rt_config) {
     }
     output_dev(const output_dev&) = delete;
     output_dev& operator=(const output_dev&) = delete;
 
 private:
-    sample_source   main_generator_;
+    block_source    main_generator_;
     on_out_callback on_out_callback_;
     wavedev         wavedev_;
 
-    static short float_to_short(float f) {
-        int i = static_cast<int>(f);
-        if (i < std::numeric_limits<short>::min()) i = std::numeric_limits<short>::min();
-        if (i > std::numeric_limits<short>::max()) i = std::numeric_limits<short>::max();
-        return static_cast<short>(i);
-    }
-
     void do_mix(short* d, int num_stereo_samples) {
-        for (int i = 0; i < num_stereo_samples; ++i) {
-            auto s = main_generator_();
-            d[2 * i + 0] = float_to_short(s.l * 32767.0f);
-            d[2 * i + 1] = float_to_short(s.r * 32767.0f);
+        realtime_scope rt{"audio callback"};
+        const auto start = std::chrono::steady_clock::now();
+        stereo_sample block[block_size];
+        for (int pos = 0; pos < num_stereo_samples; pos += block_size) {
+            const int count = std::min(block_size, num_stereo_samples - pos);
+            if (main_generator_(block, count)) {
+                std::fill(d + 2 * pos, d + 2 * (pos + count), short{0});
+            } else {
+                convert_to_pcm(block, d + 2 * pos, count);
+            }
         }
-        if (on_out_callback_) on_out_callback_(std::vector<short>(d, d+num_stereo_samples));
+        const float load = std::chrono::duration<float>(std::chrono::steady_clock::now() - start).count() * samplerate / num_stereo_samples;
+        if (on_out_callback_) on_out_callback_(std::vector<short>(d, d + 2 * num_stereo_samples), load);
     }
 };
 
@@ -83,19 +124,10 @@ public:
         float val = 0;
 
         switch (waveform_) {
-        case waveform::sine:
-            val = cos(2.0f * pi * t_);
-            break;
-        case waveform::square:
-            val = cos(2.0f * pi * t_);
-            val = val < 0 ? -1.0f : 1.0f;
-            break;
-        case waveform::triangle:
-            val = 2 * abs(2*(t_ - floor(t_+0.5f))) - 1;
-            break;
-        case waveform::sawtooth:
-            val = 2 * (t_ - floor(t_ + 0.5f));
-            break;
+        case waveform::sine:     val = wave<waveform::sine>(t_);     break;
+        case waveform::square:   val = wave<waveform::square>(t_);   break;
+        case waveform::triangle: val = wave<waveform::triangle>(t_); break;
+        case waveform::sawtooth: val = wave<waveform::sawtooth>(t_); break;
         default:
             assert(false);
         }
@@ -103,8 +135,44 @@ public:
         return val;
     }
 
+    // Generates count samples of waveform Wf (which must be the current waveform)
+    template<enum waveform Wf>
+    void generate(float* out, int count) {
+        generate<Wf>(out, count, freq_);
+    }
+
+    // As above, but linearly slides the frequency to end_freq over the block
+    template<enum waveform Wf>
+    void generate(float* out, int count, float end_freq) {
+        assert(Wf == waveform_);
+        assert(count > 0);
+        float incr = freq_ / samplerate;
+        const float incr_delta = (end_freq - freq_) / (static_cast<float>(samplerate) * count);
+        float t = t_;
+        for (int i = 0; i < count; ++i) {
+            out[i] = wave<Wf>(t);
+            t += incr;
+            incr += incr_delta;
+        }
+        // All waveforms have period 1, so keep t small to retain precision
+        t_ = t - floor(t);
+        freq_ = end_freq;
+    }
+
+    template<enum waveform Wf>
+    static float wave(float t) {
+        switch (Wf) {
+        case waveform::sine:     return cos(2.0f * pi * t);
+        case waveform::square:   return cos(2.0f * pi * t) < 0 ? -1.0f : 1.0f;
+        case waveform::triangle: return 2 * abs(2*(t - floor(t+0.5f))) - 1;
+        case waveform::sawtooth: return 2 * (t - floor(t + 0.5f));
+        }
+        assert(false);
+        return 0.0f;
+    }
+
 private:
-    enum class waveform waveform_ = waveform::sawtooth;
+    splay::waveform waveform_ = waveform::sawtooth;
     float freq_        = 0.0f;
     float t_           = 0.0f;
 };
@@ -168,6 +236,105 @@ public:
         return state == state_off;
     }
 
+    // True once past the attack, the level only falls from here on
+    bool is_falling() const {
+        return state == state_decay || state == state_sustain || state == state_release;
+    }
+
+    float current_level() const {
+        return level;
+    }
+
+    // Advances count samples as operator() would, without output
+    void advance(int count) {
+        int i = 0;
+        if (state == state_decay) {
+            // The common case for held notes, stepped the same way but without the per-sample dispatch
+            for (; i < count && state == state_decay; ++i) {
+                level *= multiplier;
+                if (level <= sustain_level) {
+                    state = state_sustain;
+                    level = sustain_level;
+                }
+            }
+        }
+        if (state == state_off || state == state_sustain) {
+            if (i < count) (*this)(0.0f);
+            return;
+        }
+        for (; i < count; ++i) {
+            (*this)(0.0f);
+        }
+    }
+
+    // Multiplies count samples by the envelope, as operator() would each. The state is dispatched once
+    // per segment, within one the loops only look for the end of the ramp.
+    void apply(float* buf, int count) {
+        int i = 0;
+        while (i < count) {
+            switch (state) {
+            case state_attack:
+                assert(level);
+                for (; i < count; ++i) {
+                    level *= multiplier;
+                    if (level >= peak_level) {
+                        state = state_decay;
+                        level = peak_level;
+                        set_multiplier(peak_level, sustain_level, decay_time);
+                        buf[i++] *= level;
+                        break;
+                    }
+                    buf[i] *= level;
+                }
+                break;
+            case state_decay:
+                for (; i < count; ++i) {
+                    level *= multiplier;
+                    if (level <= sustain_level) {
+                        state = state_sustain;
+                        level = sustain_level;
+                        buf[i++] *= level;
+                        break;
+                    }
+                    buf[i] *= level;
+                }
+                break;
+            case state_sustain:
+                level = sustain_level;
+                for (; i < count; ++i) {
+                    buf[i] *= level;
+                }
+                break;
+            case state_release:
+                for (; i < count; ++i) {
+                    level *= multiplier;
+                    if (level <= min_level) {
+                        level = min_level;
+                        state = state_off;
+                        buf[i++] = 0.0f;
+                        break;
+                    }
+                    buf[i] *= level;
+                }
+                break;
+            default:
+                assert(false);
+            case state_off:
+                level = min_level;
+                std::fill(buf + i, buf + count, 0.0f);
+                i = count;
+                break;
+            }
+        }
+        assert(level >= min_level && level <= peak_level);
+    }
+
+    // Stops at once, for when the rest would be inaudible anyway
+    void cut() {
+        state = state_off;
+        level = min_level;
+    }
+
     float operator()(float in) {
         switch (state) {
         case state_attack:
@@ -262,6 +429,22 @@ public:
         
     }
 
+    // Advances count samples without using the values
+    void skip(int count) {
+        for (int i = 0; i < count && target_ != value_; ++i) {
+            (*this)();
+        }
+    }
+
+    // Highest value until the next change
+    float peak() const {
+        return std::max(value_, target_);
+    }
+
+    float target() const {
+        return target_;
+    }
+
     float operator()() {
         if (target_ == value_) {
         } else if (target_ < value_) {
@@ -291,6 +474,14 @@ public:
         pan_(p);
     }
 
+    void skip(int count) {
+        pan_.skip(count);
+    }
+
+    float target() const {
+        return pan_.target();
+    }
+
     stereo_sample operator()(float in) {
         // For actual panning see: Default Pan Formula http://www.midi.org/techspecs/rp36.php
         const auto pan = pan_();
@@ -344,9 +535,363 @@ private:
 
 double curtime = 0.0f;
 
+// Sound of a voice. Changing any of these selects a new synthesis kernel.
+struct patch {
+    enum waveform waveform;
+    filter_type   filter;
+    float         cutoff;
+};
+
+constexpr bool operator==(const patch& l, const patch& r) {
+    return l.waveform == r.waveform && l.filter == r.filter && l.cutoff == r.cutoff;
+}
+
+constexpr bool operator!=(const patch& l, const patch& r) {
+    return !(l == r);
+}
+
+constexpr patch default_patch{waveform::sawtooth, filter_type::lowpass, 15000.0f};
+
+// Maps a General MIDI program number to a patch by instrument family (8 programs each)
+patch program_to_patch(uint8_t program)
+{
+    static const patch family_patches[16] = {
+        { waveform::triangle, filter_type::lowpass,   8000.0f }, // Piano
+        { waveform::sine,     filter_type::lowpass,  15000.0f }, // Chromatic Percussion
+        { waveform::square,   filter_type::lowpass,   6000.0f }, // Organ
+        { waveform::sawtooth, filter_type::lowpass,   5000.0f }, // Guitar
+        { waveform::sawtooth, filter_type::lowpass,   2000.0f }, // Bass
+        { waveform::sawtooth, filter_type::lowpass,  15000.0f }, // Strings
+        { waveform::sawtooth, filter_type::lowpass,  15000.0f }, // Ensemble
+        { waveform::sawtooth, filter_type::lowpass,  10000.0f }, // Brass
+        { waveform::square,   filter_type::lowpass,   8000.0f }, // Reed
+        { waveform::sine,     filter_type::lowpass,  15000.0f }, // Pipe
+        { waveform::square,   filter_type::lowpass,  15000.0f }, // Synth Lead
+        { waveform::triangle, filter_type::lowpass,   4000.0f }, // Synth Pad
+        { waveform::sawtooth, filter_type::bandpass,  3000.0f }, // Synth Effects
+        { waveform::triangle, filter_type::lowpass,  10000.0f }, // Ethnic
+        { waveform::sine,     filter_type::highpass,   200.0f }, // Percussive
+        { waveform::sawtooth, filter_type::bandpass,  1000.0f }, // Sound effects
+    };
+    return family_patches[(program & 0x7f) / 8];
+}
+
+// A call made on a voice. The first pass of two-pass rendering records them, the second
+// replays them on another voice (see midi_player_0).
+struct voice_op {
+    enum kind_type : uint8_t { key_on, key_off, key_pressure, retire, modulate, render };
+
+    explicit voice_op(kind_type k) : kind(k) {
+    }
+
+    kind_type  kind;
+    piano_key  key       = piano_key::OFF;  // key_on
+    uint8_t    vel       = 0;               // key_on
+    bool       modulated = false;           // render, modulate with mod first (a modulate op merged into it)
+    int16_t    block     = 0;               // render, block of the window
+    int16_t    count     = 0;               // render
+    float      pressure  = 0.0f;            // key_pressure
+    patch      p         = default_patch;   // key_on
+    mod_values mod;                         // modulate
+};
+
+struct voice_log {
+    const int*            block = nullptr; // Block being scheduled
+    std::vector<voice_op> ops;
+};
+
+class voice {
+public:
+    voice() {
+        configure(default_patch);
+    }
+
+    void key_on(piano_key key, uint8_t vel, const patch& p) {
+        assert(key != piano_key::OFF);
+        assert(vel);
+        if (log_) {
+            voice_op op{voice_op::key_on};
+            op.key = key;
+            op.vel = vel;
+            op.p   = p;
+            log_->ops.push_back(op);
+        }
+        if (p != patch_) {
+            configure(p);
+        }
+        key_ = key;
+        vel_ = vel;
+        //freq_(piano_key_to_freq(key_));
+        freq_ = piano_key_to_freq(key_);
+        key_pressure_ = 0.0f;
+        samples_played_ = 0;
+        envelope_.key_on();
+    }
+
+    float key_pressure() const {
+        return key_pressure_;
+    }
+
+    void key_pressure(float pressure) {
+        if (log_) {
+            voice_op op{voice_op::key_pressure};
+            op.pressure = pressure;
+            log_->ops.push_back(op);
+        }
+        key_pressure_ = pressure;
+    }
+
+    // Applies control rate modulation for the next block. Pitch and amplitude
+    // are interpolated across the block, the filter cutoff is stepped.
+    void modulate(const mod_values& m) {
+        if (log_) {
+            voice_op op{voice_op::modulate};
+            op.mod = m;
+            log_->ops.push_back(op);
+            gain_target_ = m.gain();
+            if (samples_played_ == 0) gain_ = gain_target_;
+            return;
+        }
+        const float cutoff_scale = m.cutoff_scale();
+        if (fabs(cutoff_scale - cutoff_scale_) > 1e-3f * cutoff_scale_) {
+            cutoff_scale_ = cutoff_scale;
+            filter_.cutoff_frequeny(std::min(patch_.cutoff * cutoff_scale_, max_cutoff));
+        }
+        freq_target_ = freq_ * m.pitch_scale();
+        gain_target_ = m.gain();
+        if (samples_played_ == 0) {
+            // Don't slide into a new note
+            osc_.freq(freq_target_);
+            gain_ = gain_target_;
+        }
+    }
+
+    void key_off() {
+        if (log_) log_->ops.push_back(voice_op{voice_op::key_off});
+        envelope_.key_off();
+    }
+
+    piano_key key() const {
+        return key_;
+    }
+
+    const midi::channel* owner() const {
+        return owner_;
+    }
+
+    void owner(const midi::channel* o) {
+        owner_ = o;
+    }
+
+    bool active() const {
+        return key_ != piano_key::OFF && !envelope_.is_off();
+    }
+
+    // Upper bound of the voice's output level for the next block if it can only get quieter (decaying,
+    // sustaining or released), otherwise a negative number
+    float falling_level() const {
+        return envelope_.is_falling() ? envelope_.current_level() * std::max(gain_, gain_target_) : -1.0f;
+    }
+
+    // Frees the voice at once
+    void retire() {
+        if (log_) log_->ops.push_back(voice_op{voice_op::retire});
+        envelope_.cut();
+        osc_.ang(0.0f);
+    }
+
+    // Records the calls made instead of rendering (only the envelope is run, to know when the voice ends), or
+    // nullptr to render again
+    void log(voice_log* l) {
+        log_ = l;
+    }
+
+    // Replays recorded calls, rendering block b of the window to window + b * stride
+    void replay(const std::vector<voice_op>& ops, float* window, size_t stride) {
+        for (const auto& op : ops) {
+            switch (op.kind) {
+            case voice_op::key_on:       key_on(op.key, op.vel, op.p); break;
+            case voice_op::key_off:      key_off(); break;
+            case voice_op::key_pressure: key_pressure(op.pressure); break;
+            case voice_op::retire:       retire(); break;
+            case voice_op::modulate:     modulate(op.mod); break;
+            case voice_op::render:
+                {
+                    if (op.modulated) modulate(op.mod);
+                    float* out = window + op.block * stride;
+                    std::fill(out, out + op.count, 0.0f);
+                    render(out, op.count);
+                }
+                break;
+            }
+        }
+    }
+
+    // Adds count samples to out
+    void render(float* out, int count) {
+        if (log_) {
+            auto& ops = log_->ops;
+            if (ops.empty() || ops.back().kind != voice_op::modulate) {
+                ops.push_back(voice_op{voice_op::render});
+            } else {
+                ops.back().modulated = true;
+            }
+            ops.back().kind  = voice_op::render;
+            ops.back().block = static_cast<int16_t>(*log_->block);
+            ops.back().count = static_cast<int16_t>(count);
+            samples_played_ += count;
+            if (active()) {
+                envelope_.advance(count);
+                gain_ = gain_target_;
+            }
+            return;
+        }
+
+        samples_played_ += count;
+
+        if (!active()) {
+            return;
+        }
+
+        kernel_(*this, out, count);
+        gain_ = gain_target_;
+        if (envelope_.is_off()) osc_.ang(0.0f);
+    }
+
+    static bool compare_samples_played(const voice& l, const voice& r) {
+        return l.samples_played_ < r.samples_played_;
+    }
+private:
+    static constexpr float min_freq = 0.001f;
+    static constexpr float max_cutoff = 0.45f * samplerate;
+
+    using kernel_type = void (*)(voice&, float*, int);
+
+    signal_envelope  envelope_;
+    oscillator       osc_;
+    piano_key        key_ = piano_key::OFF;
+    //exp_ramped_value freq_{0.000001f, 0.001f, 20000.0f, 1.0f};
+    biquad_filter    filter_;
+    uint8_t          vel_ = 0;
+    int              samples_played_ = 0;
+    patch            patch_ = default_patch;
+    kernel_type      kernel_ = nullptr;
+    const midi::channel* owner_ = nullptr;
+    voice_log*       log_ = nullptr;
+
+    // Modulation
+    float            freq_ = 0.0f;          // Unmodulated frequency
+    float            freq_target_ = 0.0f;   // Frequency at the end of the current block
+    float            gain_ = 1.0f;          // Gain at the start of the current block...
+    float            gain_target_ = 1.0f;   // ...and at the end
+    float            cutoff_scale_ = 1.0f;
+    float            key_pressure_ = 0.0f;
+
+    void configure(const patch& p) {
+        patch_ = p;
+        osc_.waveform(p.waveform);
+        filter_.filter(p.filter);
+        filter_.cutoff_frequeny(std::min(p.cutoff * cutoff_scale_, max_cutoff));
+        kernel_ = select_kernel(p.waveform, p.filter);
+    }
+
+    // The oscillator, filter and gain stages have no per-sample branches, the envelope switches once per segment
+    template<enum waveform Wf, filter_type Ft>
+    static void render_kernel(voice& v, float* out, int count) {
+        float buf[block_size];
+        v.osc_.generate<Wf>(buf, count, v.freq_target_);
+        v.filter_.process<Ft>(buf, count);
+        v.envelope_.apply(buf, count);
+        float gain = v.gain_;
+        const float gain_delta = (v.gain_target_ - v.gain_) / count;
+        for (int i = 0; i < count; ++i) {
+            out[i] += buf[i] * gain;
+            gain += gain_delta;
+        }
+    }
+
+    static kernel_type select_kernel(enum waveform wf, filter_type ft) {
+        static const kernel_type kernels[static_cast<int>(waveform::waveform_count)][filter_type_count] = {
+            { &render_kernel<waveform::sine,     filter_type::lowpass>, &render_kernel<waveform::sine,     filter_type::bandpass>, &render_kernel<waveform::sine,     filter_type::highpass> },
+            { &render_kernel<waveform::square,   filter_type::lowpass>, &render_kernel<waveform::square,   filter_type::bandpass>, &render_kernel<waveform::square,   filter_type::highpass> },
+            { &render_kernel<waveform::triangle, filter_type::lowpass>, &render_kernel<waveform::triangle, filter_type::bandpass>, &render_kernel<waveform::triangle, filter_type::highpass> },
+            { &render_kernel<waveform::sawtooth, filter_type::lowpass>, &render_kernel<waveform::sawtooth, filter_type::bandpass>, &render_kernel<waveform::sawtooth, filter_type::highpass> },
+        };
+        assert(wf < waveform::waveform_count);
+        return kernels[static_cast<int>(wf)][static_cast<int>(ft)];
+    }
+};
+
+// Voices shared by all channels, allocated up front in one contiguous block
+class voice_pool {
+public:
+    explicit voice_pool(int size) : size_(size), voices_(new voice[size]) {
+        assert(size > 0);
+    }
+
+    voice_pool(const voice_pool&) = delete;
+    voice_pool& operator=(const voice_pool&) = delete;
+
+    int size() const {
+        return size_;
+    }
+
+    size_t memory_usage() const {
+        return sizeof(*this) + size_ * sizeof(voice);
+    }
+
+    // Touches and locks the voices (see prefault_memory), returns false if they couldn't be locked
+    bool prefault() {
+        return prefault_memory(voices_.get(), size_ * sizeof(voice));
+    }
+
+    int index(const voice* v) const {
+        assert(v >= voices_.get() && v < voices_.get() + size_);
+        return static_cast<int>(v - voices_.get());
+    }
+
+    // Makes all voices record into logs[index] instead of rendering (see voice::log), nullptr to stop
+    void log(voice_log* logs) {
+        for (int i = 0; i < size_; ++i) {
+            voices_[i].log(logs ? &logs[i] : nullptr);
+        }
+    }
+
+    int active_count() const {
+        return static_cast<int>(std::count_if(voices_.get(), voices_.get() + size_, [](const voice& v) { return v.active(); }));
+    }
+
+    // Hands out a free voice, or if there are none the one that's been playing the longest
+    voice& allocate(const midi::channel& owner) {
+        const auto first = voices_.get(), last = voices_.get() + size_;
+        auto it = std::find_if(first, last, [](const voice& v) { return !v.active(); });
+        if (it == last) {
+            //std::cout << "Harvesting!\n";
+            it = std::max_element(first, last, &voice::compare_samples_played);
+        }
+        it->owner(&owner);
+        return *it;
+    }
+
+private:
+    int                      size_;
+    std::unique_ptr<voice[]> voices_;
+};
+
 class simple_midi_channel : public midi::channel {
 public:
-    simple_midi_channel() {
+    explicit simple_midi_channel(voice_pool& pool) : pool_(pool), quota_(pool.size()) {
+        voices_.reserve(pool.size());
+    }
+
+    // Maximum number of voices this channel may use from the pool
+    void quota(int q) {
+        assert(q > 0);
+        quota_ = std::min(q, pool_.size());
+    }
+
+    size_t voice_capacity() const {
+        return voices_.capacity();
     }
 
     simple_midi_channel(const simple_midi_channel&) = delete;
@@ -367,20 +912,29 @@ public:
         // Find voice
         auto v = find_key(key);
         if (!v) { // If the key wasn't already being played
-            auto it = std::find_if(std::begin(voices), std::end(voices), [](const voice& v) { return !v.active(); });
-            if (it != std::end(voices)) {
-                v = it;
-            } else { // And we can't find an empty channel
-                // Use the channel that's been playing the longest
-                //std::cout << "Harvesting!\n";
-                v = std::max_element(std::begin(voices), std::end(voices), &voice::compare_samples_played);
+            compact();
+            if (static_cast<int>(voices_.size()) >= quota_) {
+                // Out of quota, use our voice that's been playing the longest
+                v = *std::max_element(voices_.begin(), voices_.end(), [](const voice* l, const voice* r) { return voice::compare_samples_played(*l, *r); });
+            } else {
+                v = &pool_.allocate(*this);
+                // The pool may have harvested one of our own voices
+                if (std::find(voices_.begin(), voices_.end(), v) == voices_.end()) {
+                    voices_.push_back(v);
+                }
             }
         }
-        v->key_on(key, vel);
+        v->key_on(key, vel, patch_);
+    }
+
+    virtual void polyphonic_key_pressure(piano_key key, uint8_t pressure) override {
+        if (const auto v = find_key(key)) {
+            v->key_pressure(pressure / 127.0f);
+        }
     }
 
-    virtual void polyphonic_key_pressure(piano_key key, uint8_t pressure) {
-        std::cout << "polyphonic_key_pressure " << piano_key_to_string(key) << " " << (int)pressure << std::endl;
+    virtual void channel_pressure(uint8_t pressure) override {
+        mod_.source(mod_source::channel_pressure, pressure / 127.0f);
     }
 
     virtual void controller_change(midi::controller_type controller, uint8_t value) override {
@@ -392,6 +946,12 @@ public:
             pan_.pan(value / 127.0f);
             break;
         case midi::controller_type::modulation_wheel:
+            mod_.source(mod_source::modulation_wheel, value / 127.0f);
+            break;
+        case midi::controller_type::all_sound_off:
+        case midi::controller_type::all_notes_off:
+            all_notes_off();
+            break;
         case midi::controller_type::damper_pedal:
         case midi::controller_type::sound_controller5:
         case midi::controller_type::effects1:
@@ -410,158 +970,1218 @@ public:
         }
     }
     virtual void program_change(uint8_t program) override {
-        (void)program;
         //std::cout << "program_change " << int(program) << std::endl;
+        patch_ = program_to_patch(program);
     }
 
     virtual void pitch_bend(int value) override {
         (void)value;//std::cout << "pitch_bend " << value << std::endl;
     }
 
-    stereo_sample operator()() {
-        float out = 0.0f;
-        for (auto& v : voices) {
-            out += v();
+    void all_notes_off() {
+        for (auto v : voices_) {
+            if (v->owner() == this) v->key_off();
         }
-        return pan_(out * volume_() * 10.0f / max_polyphony);
     }
 
-private:
+    // Voices whose output in the channel mix can't get above level are retired (0 to keep all)
+    void audibility_threshold(float level) {
+        audibility_threshold_ = level;
+    }
 
-    struct voice {
-        voice() {
-            filter_.filter(filter_type::lowpass);
-            filter_.cutoff_frequeny(15000.0f);            
-        }
+    // Scales the channel output, on top of its volume
+    void gain(float g) {
+        gain_ = voice_gain * g;
+    }
 
-        void key_on(piano_key key, uint8_t vel) {
-            assert(key != piano_key::OFF);
-            assert(vel);
-            key_ = key;
-            vel_ = vel;
-            //freq_(piano_key_to_freq(key_));
-            osc_.freq(piano_key_to_freq(key_));
-            samples_played_ = 0;
-            envelope_.key_on();
-        }
+    // True while any of the channel's voices is playing
+    bool sounding() const {
+        return std::any_of(voices_.begin(), voices_.end(), [this](const voice* v) { return v->owner() == this && v->active(); });
+    }
+
+    int active_count() const {
+        return static_cast<int>(std::count_if(voices_.begin(), voices_.end(), [this](const voice* v) { return v->owner() == this && v->active(); }));
+    }
 
-        void key_off() {
-            envelope_.key_off();
+    // Adds count samples to out, returns false (leaving out alone) if the channel is silent
+    bool render(stereo_sample* out, int count) {
+        float mono[block_size] = {};
+        if (!render_voices(mono, count)) {
+            skip(count);
+            return false;
         }
+        output(mono, out, count);
+        return true;
+    }
 
-        piano_key key() const {
-            return key_;
+    // The two halves of render. Adds the voices to mono, returns false if there are none.
+    // The voices rendered are appended to rendered if given.
+    bool render_voices(float* mono, int count, std::vector<const voice*>* rendered = nullptr) {
+        assert(count <= block_size);
+        mod_.begin_block(count);
+        compact();
+        if (voices_.empty()) {
+            return false;
+        }
+        const float retire_level = audibility_threshold_ / (volume_.peak() * gain_);
+        for (auto v : voices_) {
+            if (v->falling_level() >= 0.0f && v->falling_level() < retire_level) {
+                v->retire();
+                continue;
+            }
+            v->modulate(mod_.evaluate(v->key_pressure()));
+            v->render(mono, count);
+            if (rendered) rendered->push_back(v);
         }
+        return true;
+    }
 
-        bool active() const {
-            return key_ != piano_key::OFF && !envelope_.is_off();
+    // Applies volume and pan to the voices' mix and adds it to out
+    void output(const float* mono, stereo_sample* out, int count) {
+        for (int i = 0; i < count; ++i) {
+            const auto s = pan_(mono[i] * volume_() * gain_);
+            out[i].l += s.l;
+            out[i].r += s.r;
         }
+    }
 
-        float operator()() {
-            ++samples_played_;
+    // Advances volume and pan over a block without voices
+    void skip(int count) {
+        volume_.skip(count);
+        pan_.skip(count);
+    }
 
-            if (!active()) {
-                return 0.0f;
-            }
+    float volume_target() const {
+        return volume_.target();
+    }
 
-            //osc_.freq(freq_());
-            auto out = osc_();
-            out = filter_(out);
-            out = envelope_(out);
-            if (envelope_.is_off()) osc_.ang(0.0f);
-            return out;
-        }
+    float pan_target() const {
+        return pan_.target();
+    }
 
-        static bool compare_samples_played(const voice& l, const voice& r) {
-            return l.samples_played_ < r.samples_played_;
-        }
-    private:
-        static constexpr float min_freq = 0.001f;
+    // Restores targets recorded with volume_target and pan_target
+    void targets(float volume, float pan) {
+        volume_(volume);
+        pan_.pan(pan);
+    }
 
-        signal_envelope  envelope_;
-        oscillator       osc_;
-        piano_key        key_ = piano_key::OFF;
-        //exp_ramped_value freq_{0.000001f, 0.001f, 20000.0f, 1.0f};
-        biquad_filter    filter_;
-        uint8_t          vel_ = 0;
-        int              samples_played_ = 0;
-    };
+private:
 
-    static constexpr int  max_polyphony = 32;
-    voice                 voices[max_polyphony];
+    static constexpr float voice_gain = 10.0f / 32; // Level of a single voice in the channel mix
+
+    voice_pool&           pool_;
+    int                   quota_;
+    std::vector<voice*>   voices_; // Voices from the pool owned by this channel
     exp_ramped_value      volume_{0.000001f, 1.0f, 1.0f, 0.2f};
     panning_device        pan_;
+    patch                 patch_ = default_patch;
+    modulation_matrix     mod_;
+    float                 audibility_threshold_ = 0.0f;
+    float                 gain_ = voice_gain;
 
     voice* find_key(piano_key key) {
-        auto it = std::find_if(std::begin(voices), std::end(voices), [key](const voice& v) { return v.key() == key; });
-        return it == std::end(voices) ? nullptr : it;
+        auto it = std::find_if(voices_.begin(), voices_.end(), [this, key](const voice* v) { return v->owner() == this && v->key() == key; });
+        return it == voices_.end() ? nullptr : *it;
+    }
+
+    // Drops voices that have finished playing or have been taken by another channel
+    void compact() {
+        voices_.erase(std::remove_if(voices_.begin(), voices_.end(), [this](const voice* v) { return v->owner() != this || !v->active(); }), voices_.end());
     }
 };
 
-class midi_player_0 {
+// General MIDI percussion channel. Every note triggers a one-shot drum sound
+// from the channel's own voices, so drums don't take voices from the shared
+// pool. Note off is ignored, the sounds stop by themselves.
+class percussion_channel : public midi::channel {
 public:
-    explicit midi_player_0(std::istream& in) : p_(in) {
-        for (int i = 0; i < midi::max_channels; ++i) {
-            p_.set_channel(i, channels_[i]);
+    percussion_channel() = default;
+    percussion_channel(const percussion_channel&) = delete;
+    percussion_channel& operator=(const percussion_channel&) = delete;
+
+    virtual void note_off(piano_key, uint8_t) override {
+    }
+
+    virtual void note_on(piano_key key, uint8_t vel) override {
+        if (vel) {
+            constexpr int midi_a4 = 69;
+            engine_.note_on(midi_a4 + static_cast<int>(key) - static_cast<int>(piano_key::A_4), vel);
         }
     }
 
-    stereo_sample operator()() {
-        p_.advance_time(1.0f / samplerate);
-        curtime += 1.0f / samplerate;
+    virtual void polyphonic_key_pressure(piano_key, uint8_t) override {
+    }
 
-        stereo_sample s{0.0f, 0.0f};
-        for (auto& ch : channels_) {
-            const auto ch_sample = ch();
-            s.l += ch_sample.l;
-            s.r += ch_sample.r;
-        }
-        constexpr float boost = 50.0f; // Watch for loud (see below)
-        constexpr float scale = boost * 1.0f / midi::max_channels;
-        s.l *= scale;
-        s.r *= scale;
+    virtual void channel_pressure(uint8_t) override {
+    }
 
-        if (fabs(s.l) > 1.0f || fabs(s.r) > 1.0f) {
-            static bool warn = false;
-            if (!warn) {
-                warn = true;
-                std::cout << "Loud!\n";
-            }
+    virtual void controller_change(midi::controller_type controller, uint8_t value) override {
+        switch (controller) {
+        case midi::controller_type::volume:
+            volume_(value / 127.0f);
+            break;
+        case midi::controller_type::pan:
+            pan_.pan(value / 127.0f);
+            break;
+        case midi::controller_type::all_sound_off:
+        case midi::controller_type::all_notes_off:
+            all_notes_off();
+            break;
+        default:
+            break;
         }
-        return s;
     }
 
-private:
-    midi::player          p_;
-    simple_midi_channel   channels_[midi::max_channels];
-};
-
-} // namespace splay
+    // Drum sounds have no note off, so they're cut off
+    void all_notes_off() {
+        engine_.choke_all();
+    }
 
+    virtual void program_change(uint8_t) override {
+        // Drum kit selection, there's only one kit
+    }
 
-template<typename X, typename Arg>
-auto makesink(X& x, void (X::*func)(Arg))
-{
-    return std::bind(func, std::ref(x), std::placeholders::_1);
-}
+    virtual void pitch_bend(int) override {
+    }
 
-#include <conio.h>
-#include <fstream>
-#include <iomanip>
-#include <sstream>
-#include <mutex>
-#include <condition_variable>
-#include "gui.h"
-#include "vis.h"
-#include "job_queue.h"
+    int active_count() const {
+        return engine_.active_count();
+    }
 
-using namespace splay;
+    // Scales the channel output, on top of its volume
+    void gain(float g) {
+        gain_ = drum_gain * g;
+    }
 
+    // Adds count samples to out, returns false (leaving out alone) if no drum is sounding
+    bool render(stereo_sample* out, int count) {
+        assert(count <= block_size);
+        if (!engine_.active_count()) {
+            volume_.skip(count);
+            pan_.skip(count);
+            return false;
+        }
+        float mono[block_size] = {};
+        engine_.render(mono, count);
+        for (int i = 0; i < count; ++i) {
+            const auto s = pan_(mono[i] * volume_() * gain_);
+            out[i].l += s.l;
+            out[i].r += s.r;
+        }
+        return true;
+    }
 
+private:
+    static constexpr float drum_gain = 10.0f / 32; // Same level as a single melodic voice
 
-int main(int argc, const char* argv[])
+    percussion_engine     engine_;
+    exp_ramped_value      volume_{0.000001f, 1.0f, 1.0f, 0.2f};
+    panning_device        pan_;
+    float                 gain_ = drum_gain;
+};
+
+constexpr int default_voice_pool_size = 256;
+constexpr float default_audibility_threshold = -60.0f; // dB below the mix
+
+// A song or cue playing on a midi_player_0, with its own position, looping and
+// level. The melodic channels take their voices from the player's shared pool,
+// the drums have their own. The player mixes the channels by channel number with
+// those of the other sequences. Control is for the thread rendering the player.
+class midi_sequence {
+public:
+    // From any source midi::player takes, see midi_player_0::make_sequence
+    template<typename... Source>
+    explicit midi_sequence(voice_pool& voices, Source&&... source) : p_(std::forward<Source>(source)...) {
+        for (int i = 0; i < midi::max_channels; ++i) {
+            if (i == midi::drum_channel) {
+                p_.set_channel(i, drums_);
+            } else {
+                channels_[i].reset(new simple_midi_channel{voices});
+                p_.set_channel(i, *channels_[i]);
+            }
+        }
+    }
+
+    midi_sequence(const midi_sequence&) = delete;
+    midi_sequence& operator=(const midi_sequence&) = delete;
+
+    // Jumps to seconds into the song, compiled songs only (see midi::player::seek).
+    // The notes sounding are released and the drums cut off.
+    void seek(double seconds) {
+        release_notes();
+        p_.seek(seconds);
+        position_ = std::max(seconds, 0.0);
+        notes_released_ = false;
+    }
+
+    // Starts over at the end of the song instead of finishing
+    void loop(bool enable) {
+        loop_ = enable;
+    }
+
+    bool looping() const {
+        return loop_;
+    }
+
+    // Level of the sequence in the mix
+    void gain(float g) {
+        for_each_channel([g](simple_midi_channel& ch) { ch.gain(g); });
+        drums_.gain(g);
+    }
+
+    // Maximum number of voices a melodic channel may use from the pool
+    void voice_quota(int channel, int quota) {
+        channel_of(channel).quota(quota);
+    }
+
+    // Seconds into the song
+    double position() const {
+        return position_;
+    }
+
+    const midi::player& player() const {
+        return p_;
+    }
+
+    // True once all events have been played and its voices have rung out
+    bool finished() const {
+        if (loop_ || !p_.finished()) {
+            return false;
+        }
+        return drums_.active_count() == 0 && std::none_of(std::begin(channels_), std::end(channels_), [](const std::unique_ptr<simple_midi_channel>& ch) { return ch && ch->sounding(); });
+    }
+
+    // Processes the events of the next count samples
+    void advance(int count) {
+        p_.advance_time(static_cast<float>(count) / samplerate);
+        position_ += static_cast<double>(count) / samplerate;
+
+        if (p_.finished()) {
+            if (loop_) {
+                p_.rewind();
+                position_ = 0.0;
+            } else if (!notes_released_) {
+                // Release notes left hanging at the end of the song, so they can ring out
+                notes_released_ = true;
+                release_notes(false);
+            }
+        }
+    }
+
+    // A melodic channel, the drum channel is drums()
+    simple_midi_channel& channel(int index) {
+        return channel_of(index);
+    }
+
+    percussion_channel& drums() {
+        return drums_;
+    }
+
+    // Bytes used by the song data, player and channels
+    size_t memory_usage() const {
+        size_t bytes = sizeof(*this) + p_.memory_usage();
+        for (const auto& ch : channels_) {
+            if (ch) bytes += sizeof(*ch) + ch->voice_capacity() * sizeof(voice*);
+        }
+        return bytes;
+    }
+
+private:
+    midi::player          p_;
+    std::unique_ptr<simple_midi_channel> channels_[midi::max_channels]; // None for the drum channel
+    percussion_channel    drums_;
+    double                position_ = 0.0;
+    bool                  loop_ = false;
+    bool                  notes_released_ = false;
+
+    simple_midi_channel& channel_of(int index) {
+        assert(index != midi::drum_channel);
+        return *channels_[index];
+    }
+
+    template<typename F>
+    void for_each_channel(F f) {
+        for (auto& ch : channels_) {
+            if (ch) f(*ch);
+        }
+    }
+
+    // Releases the melodic notes and cuts off the drums unless they may ring out
+    void release_notes(bool stop_drums = true) {
+        for_each_channel([](simple_midi_channel& ch) { ch.all_notes_off(); });
+        if (stop_drums) drums_.all_notes_off();
+    }
+};
+
+// Engine state for displays, filled in by the audio thread once per output period and
+// handed to the UI through a triple_buffer, so neither thread waits for the other.
+struct engine_snapshot {
+    struct channel_meter {
+        float peak   = 0.0f;    // Of the channel in the mix over the period, 1 is full scale
+        float rms    = 0.0f;
+        int   voices = 0;       // Sounding, of all sequences
+    };
+
+    channel_meter channels[midi::max_channels];
+    int           voices_active   = 0;    // From the shared pool
+    int           voice_pool_size = 0;
+    int           sequences       = 0;    // Not finished
+    double        position        = 0.0;  // Seconds into the song in slot 0
+    int           tick            = 0;
+    float         tempo           = 0.0f; // Quarter notes per minute
+    float         dsp_load        = 0.0f; // Fraction of the period spent rendering
+    uint64_t      period          = 0;    // Number of the period, counting from 1
+};
+
+// The synthesizer engine: the shared voice pool and mix, playing up to max_sequences
+// sequences at once. The one it's constructed with is in slot 0, more are started
+// with play.
+class midi_player_0 {
+public:
+    static constexpr int max_sequences = 16;
+
+    explicit midi_player_0(std::istream& in, int voice_pool_size = default_voice_pool_size) : voices_(voice_pool_size) {
+        sequences_[0] = make_sequence(in);
+        make_graph();
+    }
+
+    explicit midi_player_0(std::vector<char> data, midi::decoding decoding, int voice_pool_size = default_voice_pool_size) : voices_(voice_pool_size) {
+        sequences_[0] = make_sequence(std::move(data), decoding);
+        make_graph();
+    }
+
+    explicit midi_player_0(std::shared_ptr<const midi::compiled_song> song, int voice_pool_size = default_voice_pool_size) : voices_(voice_pool_size) {
+        sequences_[0] = make_sequence(std::move(song));
+        make_graph();
+    }
+
+    // A sequence to play on this player, from any source midi::player takes. Can be
+    // made on any thread, it only refers to the voice pool until it's played.
+    template<typename... Source>
+    std::unique_ptr<midi_sequence> make_sequence(Source&&... source) {
+        return std::unique_ptr<midi_sequence>(new midi_sequence{voices_, std::forward<Source>(source)...});
+    }
+
+    // Starts playing s in a free slot, the first one empty or holding a finished sequence.
+    // s is swapped with the slot, so this doesn't allocate or free and the caller frees
+    // what's left in s (on a thread that may). Returns the sequence for transport control,
+    // or nullptr if all slots are busy. With two_pass only between windows, in practice
+    // before rendering.
+    midi_sequence* play(std::unique_ptr<midi_sequence>& s) {
+        assert(s);
+        assert(!two_pass_ || two_pass_->pos == two_pass_->size);
+        for (auto& slot : sequences_) {
+            if (!slot || slot->finished()) {
+                slot.swap(s);
+                return slot.get();
+            }
+        }
+        return nullptr;
+    }
+
+    // The sequence in a slot, nullptr if empty
+    midi_sequence* sequence(int slot) {
+        return sequences_[slot].get();
+    }
+
+    // Retires sounding voices that have decayed to more than db below the level of the mix,
+    // freeing them for new notes. -infinity keeps all voices until they've been released.
+    void audibility_threshold(float db) {
+        audibility_ = pow(10.0f, db / 20.0f);
+    }
+
+    // Renders the channels in parallel on the workers (nullptr to render on the calling thread)
+    void workers(worker_pool* w) {
+        workers_ = w;
+    }
+
+    // Renders in two passes (see two_pass_window), so the voices of one busy channel render in parallel too.
+    // For offline rendering, as it runs a window ahead. Voices aren't retired by audibility, the first pass
+    // doesn't know the mix level. Must be called before rendering.
+    void two_pass() {
+        assert(!two_pass_);
+        audibility_ = 0.0f;
+        two_pass_.reset(new two_pass_window{voices_.size()});
+        for (auto& l : two_pass_->logs) {
+            l.block = &two_pass_->block;
+        }
+        voices_.log(two_pass_->logs.data());
+    }
+
+    // True once all sequences have finished, except looping ones
+    bool finished() const {
+        if (two_pass_ && two_pass_->pos < two_pass_->size) {
+            return two_pass_->finished[two_pass_->pos] != 0;
+        }
+        return sequences_finished();
+    }
+
+    // State of the engine and the channel levels since the last call, for the thread rendering
+    void snapshot(engine_snapshot& s) {
+        for (int i = 0; i < midi::max_channels; ++i) {
+            auto& m = meters_[i];
+            auto& c = s.channels[i];
+            c.peak   = m.peak * mix_scale;
+            c.rms    = m.samples ? sqrt(m.sum_squares / static_cast<float>(m.samples)) * mix_scale : 0.0f;
+            c.voices = 0;
+            m = level_meter{};
+        }
+        s.sequences = 0;
+        for (const auto& seq : sequences_) {
+            if (!seq) continue;
+            if (!seq->finished()) ++s.sequences;
+            for (int i = 0; i < midi::max_channels; ++i) {
+                s.channels[i].voices += i == midi::drum_channel ? seq->drums().active_count() : seq->channel(i).active_count();
+            }
+        }
+        s.voices_active   = voices_.active_count();
+        s.voice_pool_size = voices_.size();
+        if (const auto& seq = sequences_[0]) {
+            s.position = seq->position();
+            s.tick     = seq->player().current_tick();
+            s.tempo    = seq->player().tempo();
+        }
+    }
+
+    // Touches and locks the voices and render buffers, so the audio thread doesn't page fault
+    // on them. Returns false if some couldn't be locked (they're still touched).
+    bool prefault() {
+        const bool voices_locked = voices_.prefault();
+        return graph_.prefault_buffers() && voices_locked;
+    }
+
+    // See midi::player::report_errors, not while rendering
+    void report_errors(std::ostream& out) const {
+        for (const auto& s : sequences_) {
+            if (s) s->player().report_errors(out);
+        }
+    }
+
+    // Bytes used by this instance: sequences, voices and render buffers
+    size_t memory_usage() const {
+        size_t bytes = sizeof(*this) + voices_.memory_usage() + graph_.buffer_memory();
+        if (two_pass_) {
+            bytes += two_pass_->memory_usage();
+        }
+        for (const auto& s : sequences_) {
+            if (s) bytes += s->memory_usage();
+        }
+        return bytes;
+    }
+
+    // MIDI events are processed at the start of each block, so timing is accurate to block_size samples.
+    // Returns true if all of it is silent.
+    bool render(stereo_sample* out, int count) {
+        bool silent = true;
+        for (int pos = 0; pos < count; pos += block_size) {
+            silent &= render_block(out + pos, std::min(block_size, count - pos));
+        }
+        return silent;
+    }
+
+private:
+    voice_pool            voices_;
+    std::unique_ptr<midi_sequence> sequences_[max_sequences];
+    processing_graph      graph_;
+    worker_pool*          workers_ = nullptr;
+
+    // Levels of the channel outputs (before mix_scale) since the last snapshot, each
+    // only updated by the node of its channel
+    struct level_meter {
+        float    peak        = 0.0f;
+        float    sum_squares = 0.0f;    // Of both sides
+        uint64_t samples     = 0;       // Times two
+    };
+    level_meter           meters_[midi::max_channels];
+
+    static constexpr float boost     = 50.0f; // Watch for loud (see the mix node)
+    static constexpr float mix_scale = boost * 1.0f / midi::max_channels;
+
+    // Peak level of the mix, falling 20 dB per second after the peak. Voices more than the
+    // audibility threshold below it are retired.
+    float                 mix_level_       = 0.0f;
+    const float           mix_level_decay_ = pow(calc_exp_multiplier(1.0f, 0.1f, 1.0f), static_cast<float>(block_size));
+    float                 audibility_      = pow(10.0f, default_audibility_threshold / 20.0f);
+
+    // Two-pass rendering. The first pass runs the song a window of blocks ahead with the voices only
+    // recording what they're told (and running their envelopes, so voice allocation and stealing play
+    // out as they would). The second replays each voice's calls on a twin voice, in parallel, into a
+    // buffer per voice. When the window is played the channels mix these buffers in the order the
+    // voices rendered in the first pass, so the output is exactly that of rendering in one pass.
+    struct two_pass_window {
+        static constexpr int blocks = 64;
+
+        struct channel_block {
+            float volume;       // Channel targets at the start of the block
+            float pan;
+            bool  silent;
+            int   first_voice;  // Of voices
+            int   num_voices;
+        };
+
+        explicit two_pass_window(int num_voices)
+            : twins(new voice[num_voices]), logs(num_voices), slots(num_voices, -1)
+            , drums(blocks * block_size), drums_silent(blocks), finished(blocks) {
+            channel_blocks.reserve(blocks * midi::max_channels);
+        }
+
+        std::unique_ptr<voice[]>    twins;          // By pool index
+        std::vector<voice_log>      logs;           // By pool index
+        std::vector<int>            used;           // Pool indices with calls in this window
+        std::vector<int>            slots;          // Buffer slot by pool index, for those used
+        std::vector<float>          buffers;        // By block and slot, so a block is mixed from contiguous memory
+        std::vector<channel_block>  channel_blocks; // By block, sequence and channel
+        int                         sequences = 0;  // Sequences scheduled, in slot order
+        std::vector<const voice*>   voices;         // Rendered by the channels, in order
+        std::vector<stereo_sample>  drums;
+        std::vector<char>           drums_silent;   // By block
+        std::vector<char>           finished;       // By block, whether the song had finished before it
+        int                         block = 0;      // Being scheduled
+        int                         size  = 0;      // Blocks scheduled
+        int                         pos   = 0;      // Next block to play
+
+        float* buffer(int slot, int b) {
+            return &buffers[(static_cast<size_t>(b) * used.size() + slot) * block_size];
+        }
+
+        size_t memory_usage() const {
+            size_t bytes = sizeof(*this) + logs.size() * (sizeof(voice) + sizeof(voice_log) + sizeof(int)) + buffers.capacity() * sizeof(float) + drums.capacity() * sizeof(stereo_sample);
+            for (const auto& l : logs) {
+                bytes += l.ops.capacity() * sizeof(voice_op);
+            }
+            return bytes + channel_blocks.capacity() * sizeof(channel_block) + voices.capacity() * sizeof(const voice*);
+        }
+    };
+    std::unique_ptr<two_pass_window> two_pass_;
+
+    // Looping sequences play on until the others have finished
+    bool sequences_finished() const {
+        return std::all_of(std::begin(sequences_), std::end(sequences_), [](const std::unique_ptr<midi_sequence>& s) { return !s || s->looping() || s->finished(); });
+    }
+
+    // Each channel number renders into its own buffer (that channel of all sequences, in slot order),
+    // the mix node sums them (in channel order) and scales the result. Channels without sounding voices
+    // only flag their buffer as silent.
+    void make_graph() {
+        std::vector<processing_graph::node_id> sources;
+        for (int i = 0; i < midi::max_channels; ++i) {
+            if (i == midi::drum_channel) continue;
+            sources.push_back(graph_.add_node("channel " + std::to_string(i), {}, {port_type::audio}, [this, i](const node_buffers& b) {
+                auto out = reinterpret_cast<stereo_sample*>(b.outputs[0]);
+                std::fill(out, out + b.count, stereo_sample{0.0f, 0.0f});
+                if (two_pass_) {
+                    const bool sounding = output_scheduled(i, out, b.count);
+                    b.output_silent(0, !sounding);
+                    meter(i, sounding ? out : nullptr, b.count);
+                    return;
+                }
+                bool silent = true;
+                for (const auto& s : sequences_) {
+                    if (s) silent &= !s->channel(i).render(out, b.count);
+                }
+                b.output_silent(0, silent);
+                meter(i, silent ? nullptr : out, b.count);
+            }));
+        }
+        sources.push_back(graph_.add_node("drums", {}, {port_type::audio}, [this](const node_buffers& b) {
+            auto out = reinterpret_cast<stereo_sample*>(b.outputs[0]);
+            if (two_pass_) {
+                const auto& w = *two_pass_;
+                std::copy(&w.drums[w.pos * block_size], &w.drums[w.pos * block_size] + b.count, out);
+                b.output_silent(0, w.drums_silent[w.pos] != 0);
+                meter(midi::drum_channel, w.drums_silent[w.pos] ? nullptr : out, b.count);
+                return;
+            }
+            std::fill(out, out + b.count, stereo_sample{0.0f, 0.0f});
+            bool silent = true;
+            for (const auto& s : sequences_) {
+                if (s) silent &= !s->drums().render(out, b.count);
+            }
+            b.output_silent(0, silent);
+            meter(midi::drum_channel, silent ? nullptr : out, b.count);
+        }));
+
+        const int num_inputs = static_cast<int>(sources.size());
+        const auto mix = graph_.add_node("mix", std::vector<port_type>(num_inputs, port_type::audio), {port_type::audio}, [this, num_inputs](const node_buffers& b) {
+            auto out = reinterpret_cast<stereo_sample*>(b.outputs[0]);
+            bool silent = true;
+            std::fill(out, out + b.count, stereo_sample{0.0f, 0.0f});
+            for (int in = 0; in < num_inputs; ++in) {
+                if (b.input_silent(in)) continue;
+                silent = false;
+                const auto s = reinterpret_cast<const stereo_sample*>(b.inputs[in]);
+                for (int i = 0; i < b.count; ++i) {
+                    out[i].l += s[i].l;
+                    out[i].r += s[i].r;
+                }
+            }
+            mix_level_ *= mix_level_decay_;
+            if (silent) {
+                b.output_silent(0, true);
+                return;
+            }
+            float peak = 0.0f;
+            for (int i = 0; i < b.count; ++i) {
+                auto& s = out[i];
+                s.l *= mix_scale;
+                s.r *= mix_scale;
+                peak = std::max(peak, static_cast<float>(std::max(fabs(s.l), fabs(s.r))));
+
+                if (fabs(s.l) > 1.0f || fabs(s.r) > 1.0f) {
+                    static bool warn = false;
+                    if (!warn) {
+                        warn = true;
+                        std::cout << "Loud!\n";
+                    }
+                }
+            }
+            mix_level_ = std::max(mix_level_, peak);
+        });
+        for (int in = 0; in < num_inputs; ++in) {
+            graph_.connect(sources[in], 0, mix, in);
+        }
+        graph_.output(mix, 0);
+        graph_.compile();
+    }
+
+    // Adds count samples of a channel's output (nullptr if silent) to its meter
+    void meter(int channel, const stereo_sample* out, int count) {
+        auto& m = meters_[channel];
+        m.samples += 2 * count;
+        if (!out) return;
+        float peak = m.peak;
+        float sum_squares = 0.0f;
+        for (int i = 0; i < count; ++i) {
+            peak = std::max(peak, static_cast<float>(std::max(fabs(out[i].l), fabs(out[i].r))));
+            sum_squares += out[i].l * out[i].l + out[i].r * out[i].r;
+        }
+        m.peak = peak;
+        m.sum_squares += sum_squares;
+    }
+
+    // Processes the events of the next count samples
+    void advance(int count) {
+        for (auto& s : sequences_) {
+            if (s) s->advance(count);
+        }
+    }
+
+    // First and second pass over the next window
+    void schedule() {
+        auto& w = *two_pass_;
+        for (auto& l : w.logs) {
+            l.ops.clear();
+        }
+        w.voices.clear();
+        w.channel_blocks.clear();
+        w.sequences = static_cast<int>(std::count_if(std::begin(sequences_), std::end(sequences_), [](const std::unique_ptr<midi_sequence>& s) { return s != nullptr; }));
+        for (w.block = 0; w.block < two_pass_window::blocks; ++w.block) {
+            w.finished[w.block] = sequences_finished();
+            advance(block_size);
+            auto drums = &w.drums[w.block * block_size];
+            std::fill(drums, drums + block_size, stereo_sample{0.0f, 0.0f});
+            bool drums_silent = true;
+            for (auto& s : sequences_) {
+                if (!s) continue;
+                for (int i = 0; i < midi::max_channels; ++i) {
+                    if (i == midi::drum_channel) {
+                        w.channel_blocks.push_back({}); // Keeps the layout by channel number, never read
+                        continue;
+                    }
+                    auto& ch = s->channel(i);
+                    two_pass_window::channel_block cb{ch.volume_target(), ch.pan_target(), false, static_cast<int>(w.voices.size()), 0};
+                    float unused[block_size];
+                    cb.silent     = !ch.render_voices(unused, block_size, &w.voices);
+                    cb.num_voices = static_cast<int>(w.voices.size()) - cb.first_voice;
+                    w.channel_blocks.push_back(cb);
+                }
+                drums_silent &= !s->drums().render(drums, block_size);
+            }
+            w.drums_silent[w.block] = drums_silent;
+        }
+        w.size = two_pass_window::blocks;
+        w.pos  = 0;
+
+        // Buffers only for the voices used, so the mix reads from less memory
+        w.used.clear();
+        for (int i = 0; i < voices_.size(); ++i) {
+            w.slots[i] = w.logs[i].ops.empty() ? -1 : static_cast<int>(w.used.size());
+            if (w.slots[i] >= 0) w.used.push_back(i);
+        }
+        w.buffers.resize(std::max(w.buffers.size(), w.used.size() * two_pass_window::blocks * block_size));
+        const auto replay = [&w](int n) {
+            const int i = w.used[n];
+            w.twins[i].replay(w.logs[i].ops, w.buffer(n, 0), w.used.size() * block_size);
+        };
+        if (workers_) {
+            workers_->run(static_cast<int>(w.used.size()), replay);
+        } else {
+            for (int n = 0; n < static_cast<int>(w.used.size()); ++n) replay(n);
+        }
+    }
+
+    // Output of a channel number (of all sequences) for the block being played from the window
+    bool output_scheduled(int channel, stereo_sample* out, int count) {
+        auto& w = *two_pass_;
+        bool sounding = false;
+        int n = 0;
+        for (auto& s : sequences_) {
+            if (!s) continue;
+            auto& ch = s->channel(channel);
+            const auto& cb = w.channel_blocks[(w.pos * w.sequences + n++) * midi::max_channels + channel];
+            ch.targets(cb.volume, cb.pan);
+            if (cb.silent) {
+                ch.skip(count);
+                continue;
+            }
+            float mono[block_size] = {};
+            for (int v = cb.first_voice; v < cb.first_voice + cb.num_voices; ++v) {
+                const float* b = w.buffer(w.slots[voices_.index(w.voices[v])], w.pos);
+                for (int i = 0; i < count; ++i) {
+                    mono[i] += b[i];
+                }
+            }
+            ch.output(mono, out, count);
+            sounding = true;
+        }
+        return sounding;
+    }
+
+    bool render_block(stereo_sample* out, int count) {
+        curtime += static_cast<double>(count) / samplerate;
+        if (two_pass_) {
+            // The live session and playlist always render whole blocks
+            assert(count == block_size);
+            if (two_pass_->pos == two_pass_->size) {
+                schedule();
+            }
+            const bool silent = graph_.process(&out[0].l, count, workers_);
+            ++two_pass_->pos;
+            return silent;
+        }
+        advance(count);
+
+        // Set here rather than by the channels themselves, which may render on other threads
+        const float threshold = mix_level_ * audibility_ / mix_scale;
+        for (auto& s : sequences_) {
+            if (!s) continue;
+            for (int i = 0; i < midi::max_channels; ++i) {
+                if (i != midi::drum_channel) s->channel(i).audibility_threshold(threshold);
+            }
+        }
+
+        return graph_.process(&out[0].l, count, workers_);
+    }
+};
+
+std::unique_ptr<midi_player_0> load_midi_player(const std::string& filename, int voice_pool_size = default_voice_pool_size)
+{
+    assert(midi::is_compiled_song_filename(filename));
+    return std::unique_ptr<midi_player_0>(new midi_player_0{midi::compiled_song::load(filename), voice_pool_size});
+}
+
+std::unique_ptr<midi_player_0> load_midi_player(std::vector<char> data, midi::decoding decoding, int voice_pool_size = default_voice_pool_size)
+{
+    return std::unique_ptr<midi_player_0>(new midi_player_0{std::move(data), decoding, voice_pool_size});
+}
+
+// A --layer argument: <file>[,gain=<level>][,start=<seconds>][,loop]
+struct layer_spec {
+    std::string filename;
+    float       gain  = 1.0f;   // See midi_sequence::gain
+    double      start = 0.0;    // Seconds into the song to start at, compiled songs only
+    bool        loop  = false;
+};
+
+layer_spec parse_layer_spec(const std::string& spec)
+{
+    std::istringstream iss(spec);
+    layer_spec res;
+    std::getline(iss, res.filename, ',');
+    for (std::string option; std::getline(iss, option, ',');) {
+        if (option == "loop") {
+            res.loop = true;
+        } else if (option.compare(0, 5, "gain=") == 0) {
+            res.gain = std::stof(option.substr(5));
+        } else if (option.compare(0, 6, "start=") == 0) {
+            res.start = std::stod(option.substr(6));
+        } else {
+            throw std::runtime_error("Invalid layer option " + option + " in " + spec);
+        }
+    }
+    if (res.filename.empty() || res.gain < 0.0f || res.start < 0.0) {
+        throw std::runtime_error("Invalid layer " + spec);
+    }
+    if (res.start > 0.0 && !midi::is_compiled_song_filename(res.filename)) {
+        throw std::runtime_error("Only compiled songs can start later than the beginning: " + spec);
+    }
+    return res;
+}
+
+// How the playlist sets up the player of each song
+struct player_options {
+    midi::decoding decoding             = midi::decoding::eager;
+    float          audibility_threshold = default_audibility_threshold; // dB, see midi_player_0::audibility_threshold
+    bool           two_pass             = false;                        // Offline only, see midi_player_0::two_pass
+    std::vector<std::string> layers;                                    // Played along with the first song, on its player (see layer_spec)
+    bool           prefault             = false;                        // For live playback, see midi_player_0::prefault
+    int            voice_pool_size      = default_voice_pool_size;      // Voices shared by the melodic channels of all sequences
+    std::vector<std::pair<int, int>> voice_quotas;                      // (channel, voices) for every sequence, see midi_sequence::voice_quota
+    double         start                = 0.0;                          // Seconds into the first song, compiled songs only (see midi_sequence::seek)
+};
+
+// Plays a list of MIDI files back to back. While one song is playing the next one is
+// loaded on a background thread and handed over to the audio thread without locking
+// once the current song (including release tails) has finished.
+class playlist_player {
+public:
+    explicit playlist_player(async_io& io, const std::vector<std::string>& filenames, worker_pool* workers = nullptr, const player_options& options = player_options{})
+        : io_(io), filenames_(filenames), reads_(filenames.size()), workers_(workers), options_(options) {
+        assert(!filenames_.empty());
+        current_ = load(0);
+        next_index_ = 1;
+        loader_ = std::thread{&playlist_player::loader_thread, this};
+    }
+
+    ~playlist_player() {
+        exiting_ = true;
+        loader_.join();
+        delete next_.exchange(nullptr);
+        retire(retired_.exchange(nullptr));
+        current_->report_errors(std::cout);
+    }
+
+    playlist_player(const playlist_player&) = delete;
+    playlist_player& operator=(const playlist_player&) = delete;
+
+    // True when the last song has finished playing
+    bool finished() const {
+        return loader_done_ && !next_.load() && current_->finished();
+    }
+
+    // See midi_player_0::snapshot, for the audio thread
+    void snapshot(engine_snapshot& s) {
+        current_->snapshot(s);
+    }
+
+    // Returns true if all of it is silent
+    bool render(stereo_sample* out, int count) {
+        bool silent = true;
+        for (int pos = 0; pos < count; pos += block_size) {
+            if (current_->finished() && next_.load()) {
+                // Retire before taking the next song, the loader only frees retired_ once next_ is empty
+                assert(!retired_.load());
+                retired_ = current_.release();
+                current_.reset(next_.exchange(nullptr));
+            }
+            silent &= current_->render(out + pos, std::min(block_size, count - pos));
+        }
+        return silent;
+    }
+
+private:
+    static constexpr size_t max_prefetch = 8;
+
+    async_io&                      io_;
+    std::vector<std::string>       filenames_;
+    std::vector<std::future<std::vector<char>>> reads_;       // Pending reads of MIDI files, by index
+    worker_pool*                   workers_;
+    player_options                 options_;
+    size_t                         prefetched_ = 0;
+    size_t                         next_index_ = 0;
+    std::unique_ptr<midi_player_0> current_;                  // Only touched by the audio thread
+    std::atomic<midi_player_0*>    next_{nullptr};            // Set by the loader, taken by the audio thread
+    std::atomic<midi_player_0*>    retired_{nullptr};         // Set by the audio thread, freed by the loader
+    std::atomic<bool>              exiting_{false};
+    std::atomic<bool>              loader_done_{false};       // Set once all files have been loaded
+    std::thread                    loader_;
+
+    void loader_thread() {
+        while (!exiting_) {
+            if (next_.load()) {
+                // Wait for the audio thread to pick up the song we already loaded
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                continue;
+            }
+            retire(retired_.exchange(nullptr));
+
+            if (next_index_ == filenames_.size()) {
+                loader_done_ = true;
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                continue;
+            }
+            const auto index = next_index_++;
+            try {
+                next_ = load(index).release();
+            } catch (const std::exception& e) {
+                std::cout << "Skipping " << filenames_[index] << ": " << e.what() << std::endl;
+            }
+        }
+    }
+
+    // Frees a song the audio thread is done with, reporting what went wrong playing it
+    static void retire(midi_player_0* p) {
+        if (p) p->report_errors(std::cout);
+        delete p;
+    }
+
+    // Reads the next few MIDI files in one batch, so the I/O overlaps with loading and rendering
+    void prefetch(size_t index) {
+        std::vector<std::string> batch;
+        std::vector<size_t> indices;
+        for (const auto end = std::min(filenames_.size(), index + max_prefetch); prefetched_ < end; ++prefetched_) {
+            if (!midi::is_compiled_song_filename(filenames_[prefetched_])) {
+                batch.push_back(filenames_[prefetched_]);
+                indices.push_back(prefetched_);
+            }
+        }
+        auto futures = io_.read_files(batch);
+        for (size_t i = 0; i < futures.size(); ++i) {
+            reads_[indices[i]] = std::move(futures[i]);
+        }
+    }
+
+    std::unique_ptr<midi_player_0> load(size_t index) {
+        const auto start = std::chrono::steady_clock::now();
+        std::unique_ptr<midi_player_0> player;
+        if (midi::is_compiled_song_filename(filenames_[index])) {
+            player = load_midi_player(filenames_[index], options_.voice_pool_size);
+        } else {
+            prefetch(index);
+            player = load_midi_player(reads_[index].get(), options_.decoding, options_.voice_pool_size);
+        }
+        if (index == 0) {
+            for (const auto& spec : options_.layers) {
+                const auto layer = parse_layer_spec(spec);
+                std::unique_ptr<midi_sequence> s;
+                if (midi::is_compiled_song_filename(layer.filename)) {
+                    s = player->make_sequence(midi::compiled_song::load(layer.filename));
+                } else {
+                    s = player->make_sequence(io_.read_files({layer.filename})[0].get(), options_.decoding);
+                }
+                s->gain(layer.gain);
+                s->loop(layer.loop);
+                if (layer.start > 0.0) s->seek(layer.start);
+                if (!player->play(s)) {
+                    throw std::runtime_error("Too many layers, at most " + std::to_string(midi_player_0::max_sequences - 1));
+                }
+            }
+        }
+        if (index == 0 && options_.start > 0.0) {
+            player->sequence(0)->seek(options_.start);
+        }
+        for (int slot = 0; slot < midi_player_0::max_sequences; ++slot) {
+            if (auto s = player->sequence(slot)) {
+                for (const auto& q : options_.voice_quotas) {
+                    s->voice_quota(q.first, q.second);
+                }
+            }
+        }
+        player->workers(workers_);
+        player->audibility_threshold(options_.audibility_threshold);
+        if (options_.two_pass) player->two_pass();
+        if (options_.prefault && !player->prefault()) {
+            std::cout << filenames_[index] << ": engine memory couldn't be locked, only prefaulted" << std::endl;
+        }
+        const auto ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        std::cout << filenames_[index] << ": " << (player->memory_usage() + 1023) / 1024 << " KB, loaded in " << std::setprecision(3) << ms << " ms" << std::endl;
+        return player;
+    }
+};
+
+// What the audio callback plays: the playlist, or the edit channel played from
+// the keyboard. Input is applied at block boundaries of the session's own
+// render position, so a recording of it renders the same offline however the
+// output device splits its buffers.
+class live_session {
+public:
+    static constexpr float edit_gain = 10.0f;
+
+    explicit live_session(playlist_player& p) : p_(p), channel_(edit_voices_) {
+        pending_.reserve(max_pending);
+    }
+
+    live_session(const live_session&) = delete;
+    live_session& operator=(const live_session&) = delete;
+
+    // Applied input is appended to the recording, which must have room for it
+    // so the audio thread doesn't allocate
+    void record(input_recording* recording) {
+        recording_ = recording;
+    }
+
+    // Applies the input of a recording instead of live input, and ends at its length
+    void replay(const input_recording& recording) {
+        replay_ = &recording;
+        replay_pos_ = 0;
+    }
+
+    uint64_t position() const {
+        return position_;
+    }
+
+    // Queues input for the next block, must be called from the audio thread (e.g. from its job queue)
+    void input(input_event_type type, piano_key key = piano_key::OFF, uint8_t velocity = 0) {
+        if (pending_.size() < max_pending) {
+            pending_.push_back({0, type, key, velocity});
+        }
+    }
+
+    bool finished() const {
+        return replay_ ? position_ >= replay_->length : p_.finished();
+    }
+
+    // State of the song's engine, for the audio thread
+    void snapshot(engine_snapshot& s) {
+        p_.snapshot(s);
+    }
+
+    // Number of samples to render next, at most count (a replay stops at the recorded length)
+    int next_count(int count) const {
+        return replay_ ? static_cast<int>(std::min<uint64_t>(count, replay_->length - position_)) : count;
+    }
+
+    // Returns true if all of it is silent
+    bool render(stereo_sample* out, int count) {
+        bool silent = true;
+        while (count) {
+            if (carry_pos_ == block_size) {
+                carry_silent_ = render_block(carry_);
+                carry_pos_ = 0;
+            }
+            const int n = std::min(count, block_size - carry_pos_);
+            std::copy(carry_ + carry_pos_, carry_ + carry_pos_ + n, out);
+            silent &= carry_silent_;
+            carry_pos_ += n;
+            out += n;
+            count -= n;
+        }
+        return silent;
+    }
+
+private:
+    static constexpr size_t max_pending = 64;
+
+    playlist_player&          p_;
+    voice_pool                edit_voices_{32};
+    simple_midi_channel       channel_;
+    bool                      edit_mode_ = false;
+    std::vector<input_event>  pending_;
+    input_recording*          recording_ = nullptr;
+    const input_recording*    replay_ = nullptr;
+    size_t                    replay_pos_ = 0;
+    uint64_t                  position_ = 0;            // Samples rendered (in whole blocks)
+    stereo_sample             carry_[block_size];       // Last block rendered, handed out from carry_pos_
+    int                       carry_pos_ = block_size;
+    bool                      carry_silent_ = true;
+
+    void apply(const input_event& e) {
+        switch (e.type) {
+        case input_event_type::note_on:          channel_.note_on(e.key, e.velocity); break;
+        case input_event_type::note_off:         channel_.note_off(e.key, e.velocity); break;
+        case input_event_type::toggle_edit_mode: edit_mode_ = !edit_mode_; break;
+        }
+    }
+
+    bool render_block(stereo_sample* out) {
+        if (replay_) {
+            const auto& events = replay_->events;
+            for (; replay_pos_ < events.size() && events[replay_pos_].position <= position_; ++replay_pos_) {
+                apply(events[replay_pos_]);
+            }
+        } else {
+            for (auto e : pending_) {
+                e.position = position_;
+                apply(e);
+                if (recording_ && recording_->events.size() < recording_->events.capacity()) {
+                    recording_->events.push_back(e);
+                }
+            }
+            pending_.clear();
+        }
+
+        bool silent;
+        if (edit_mode_) {
+            std::fill(out, out + block_size, stereo_sample{0.0f, 0.0f});
+            silent = !channel_.render(out, block_size);
+            if (!silent) std::transform(out, out + block_size, out, [](stereo_sample s) { return edit_gain * s; });
+        } else {
+            silent = p_.render(out, block_size);
+        }
+        position_ += block_size;
+        if (recording_) recording_->length = position_;
+        return silent;
+    }
+};
+
+// Renders the session as fast as possible to a wave file, and saves its waveform overview next to it
+void render_offline(async_io& io, live_session& p, const std::string& filename)
+{
+    constexpr int chunk_size = 4096;
+    std::vector<stereo_sample> block(chunk_size);
+    std::vector<short> pcm(2 * chunk_size);
+    std::vector<short> mono(chunk_size);
+    wav_writer out{io, filename, samplerate};
+    waveform_overview overview;
+    spectrogram spec{1, 256, true};
+    uint64_t samples = 0;
+    while (!p.finished()) {
+        const int count = p.next_count(chunk_size);
+        bool silent;
+        {
+            // Held to the same standard as the audio callback
+            realtime_scope rt{"offline render"};
+            silent = p.render(&block[0], count);
+        }
+        if (silent) {
+            // Silence only needs to be written, the analyzers have shortcuts for it
+            std::fill(pcm.begin(), pcm.begin() + 2 * count, short{0});
+            out.write(&pcm[0], 2 * count);
+            overview.append_silence(count);
+            spec.append_silence(count);
+        } else {
+            convert_to_pcm(&block[0], &pcm[0], count);
+            out.write(&pcm[0], 2 * count);
+            for (int i = 0; i < count; ++i) {
+                mono[i] = static_cast<short>((pcm[2 * i] + pcm[2 * i + 1]) / 2);
+            }
+            overview.append(&mono[0], count);
+            spec.append(&mono[0], count);
+        }
+        samples += count;
+    }
+    out.close();
+    std::ofstream overview_out(filename + ".overview", std::ofstream::binary);
+    overview.save(overview_out);
+    spec.save_bmp(filename + ".spectrogram.bmp");
+    std::cout << "Rendered " << samples / static_cast<double>(samplerate) << " seconds to " << filename << std::endl;
+}
+
+} // namespace splay
+
+
+template<typename X, typename Arg>
+auto makesink(X& x, void (X::*func)(Arg))
+{
+    return std::bind(func, std::ref(x), std::placeholders::_1);
+}
+
+#include <mutex>
+#include <condition_variable>
+#include "gui.h"
+#include "job_queue.h"
+#ifdef SPLAY_HEADLESS_GUI
+#include "gui_headless.h"
+#endif
+
+using namespace splay;
+
+
+
+int main(int argc, const char* argv[])
 {
     try {
+        std::vector<std::string> filenames;
         std::string filename;
         //filename = "../data/onestop.mid";
         //filename = "../data/A_natural_minor_scale_ascending_and_descending.mid";
@@ -570,12 +2190,202 @@ int main(int argc, const char* argv[])
         filename = "../data/Beethoven_Ludwig_van_-_Beethoven_Symphony_No._5_4th.mid";
         //filename = "../data/Led_Zeppelin_-_Stairway_to_Heaven.mid";
         //filename = "../data/Blue_Oyster_Cult_-_Don't_Fear_the_Reaper.mid";
-        if (argc >= 2) filename = argv[1];
-        std::ifstream in(filename, std::ifstream::binary);
-        if (!in) throw std::runtime_error("File not found: " + filename);
-        midi_player_0 p{in};
+        std::string output_filename;
+        std::string record_filename;
+        std::string replay_filename;
+        int render_threads = 1;
+        player_options options;
+        realtime_thread_config rt_config;   // For the audio thread and the render workers
+        bool lock_memory = false;
+        std::string shm_name;
+#ifdef SPLAY_HEADLESS_GUI
+        headless::options headless_options;
+#endif
+        for (int i = 1; i < argc; ++i) {
+            const std::string arg = argv[i];
+            if (arg == "-o" && i + 1 < argc) {
+                output_filename = argv[++i];
+            } else if (arg == "--threads" && i + 1 < argc) {
+                // Render the channels of a song on this many threads
+                render_threads = std::max(1, std::stoi(argv[++i]));
+            } else if (arg == "--lazy") {
+                // Decode MIDI files while they play, so large files start right away
+                options.decoding = midi::decoding::lazy;
+            } else if (arg == "--audibility" && i + 1 < argc) {
+                // Retire voices decayed this many dB below the mix (e.g. -60), or "off" to keep them
+                const std::string value = argv[++i];
+                options.audibility_threshold = value == "off" ? -std::numeric_limits<float>::infinity() : std::stof(value);
+            } else if (arg == "--two-pass") {
+                // When rendering to a file, schedule the voices a window ahead and render them in parallel (see --threads)
+                options.two_pass = true;
+            } else if (arg == "--voices" && i + 1 < argc) {
+                // Size of the voice pool the melodic channels share
+                options.voice_pool_size = std::stoi(argv[++i]);
+                if (options.voice_pool_size < 1) throw std::runtime_error("--voices must be at least 1");
+            } else if (arg == "--quota" && i + 1 < argc) {
+                // <channel>=<voices>: the most voices channel 0-15 (not the drums on 9) may take from the pool (repeatable)
+                const std::string value = argv[++i];
+                const auto eq = value.find('=');
+                if (eq == std::string::npos) throw std::runtime_error("--quota takes <channel>=<voices>");
+                const int channel = std::stoi(value.substr(0, eq));
+                const int quota   = std::stoi(value.substr(eq + 1));
+                if (!valid_voice_quota(channel, quota)) {
+                    throw std::runtime_error("Invalid voice quota " + value);
+                }
+                options.voice_quotas.emplace_back(channel, quota);
+            } else if (arg == "--start" && i + 1 < argc) {
+                // Start the first song this many seconds in, it must be a compiled song (.splc)
+                options.start = std::stod(argv[++i]);
+                if (options.start < 0.0) throw std::runtime_error("--start must not be negative");
+            } else if (arg == "--layer" && i + 1 < argc) {
+                // <file>[,gain=<level>][,start=<seconds>][,loop]: play a MIDI file along with the first song,
+                // sharing its voices and mix, at a level, from a position (compiled songs) or looping (repeatable)
+                options.layers.push_back(argv[++i]);
+                parse_layer_spec(options.layers.back()); // Fail early on errors
+            } else if (arg == "--rt-priority" && i + 1 < argc) {
+                // SCHED_FIFO priority of the audio thread and render workers (0 for the default), or "off" for normal scheduling
+                const std::string value = argv[++i];
+                rt_config.realtime_scheduling = value != "off";
+                if (rt_config.realtime_scheduling) rt_config.priority = std::stoi(value);
+            } else if (arg == "--rt-cpus" && i + 1 < argc) {
+                // Comma separated CPUs to run the audio thread and render workers on
+                std::istringstream iss(argv[++i]);
+                rt_config.cpus.clear();
+                for (std::string cpu; std::getline(iss, cpu, ',');) {
+                    rt_config.cpus.push_back(std::stoi(cpu));
+                }
+            } else if (arg == "--lock-memory" && i + 1 < argc) {
+                // "on" or "off" (default): lock all process memory for live playback (see lock_process_memory)
+                const std::string value = argv[++i];
+                if (value != "on" && value != "off") throw std::runtime_error("--lock-memory takes on or off");
+                lock_memory = value == "on";
+            } else if (arg == "--shm" && i + 1 < argc) {
+                // Also write the live output to a shared memory PCM ring (see pcm_ring.h) for other processes
+                shm_name = argv[++i];
+#ifdef SPLAY_HEADLESS_GUI
+            } else if (arg == "--headless-duration" && i + 1 < argc) {
+                // Virtual seconds the off-screen gui runs for
+                headless_options.duration = std::stod(argv[++i]);
+            } else if (arg == "--headless-dump" && i + 1 < argc) {
+                // Write every bitmap update to <prefix><window>_<frame>.bmp
+                headless_options.dump_prefix = argv[++i];
+#endif
+            } else if (arg == "--record" && i + 1 < argc) {
+                // Save the keyboard input of the live session, so it can be replayed
+                record_filename = argv[++i];
+            } else if (arg == "--replay" && i + 1 < argc) {
+                // Render a recorded live session offline (to the -o file or <recording>.wav)
+                replay_filename = argv[++i];
+            } else if (arg == "--compile" && i + 2 < argc) {
+                // Compile a MIDI file to the precompiled song format (.splc) for instant loading
+                const std::string in_filename = argv[++i];
+                std::ifstream in(in_filename, std::ifstream::binary);
+                if (!in) throw std::runtime_error("File not found: " + in_filename);
+                const auto song = midi::compiled_song::compile(in);
+                song->save(argv[++i]);
+                std::cout << "Compiled " << song->header().num_events << " events, " << song->header().num_snapshots << " snapshots" << std::endl;
+                return 0;
+            } else if (arg == "--generate" && i + 1 < argc) {
+                // Write a synthetic workload, parameters are given as name=value
+                const std::string out_filename = argv[++i];
+                midi::workload w;
+                for (; i + 1 < argc && strchr(argv[i + 1], '='); ++i) {
+                    if (!midi::set_workload_parameter(w, argv[i + 1])) {
+                        throw std::runtime_error(std::string("Invalid workload parameter ") + argv[i + 1]);
+                    }
+                }
+                std::ofstream out(out_filename, std::ofstream::binary);
+                midi::write_workload(out, w);
+                if (!out) throw std::runtime_error("Error writing " + out_filename);
+                return 0;
+            } else if (arg == "--generate-corpus" && i + 1 < argc) {
+                // Write all workload presets to a directory
+                const std::string dir = argv[++i];
+                for (const auto& preset : midi::workload_presets()) {
+                    const auto out_filename = dir + "/" + preset.first + ".mid";
+                    std::ofstream out(out_filename, std::ofstream::binary);
+                    midi::write_workload(out, preset.second);
+                    if (!out) throw std::runtime_error("Error writing " + out_filename);
+                    std::cout << "Wrote " << out_filename << std::endl;
+                }
+                return 0;
+            } else if (arg == "--scan" && i + 1 < argc) {
+                // Only print metadata of all MIDI files in a directory tree
+                const auto start = std::chrono::steady_clock::now();
+                const auto entries = scan_catalog(argv[++i]);
+                print_catalog(std::cout, entries);
+                std::cout << "Scanned in " << std::setprecision(3) << std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() << " seconds" << std::endl;
+                return 0;
+            } else {
+                // Several files are played back to back
+                filenames.push_back(arg);
+            }
+        }
+        input_recording recording;
+        if (!replay_filename.empty()) {
+            std::ifstream in(replay_filename);
+            if (!in) throw std::runtime_error("File not found: " + replay_filename);
+            recording = input_recording::load(in);
+            filenames = recording.files;
+            if (recording.has_player_settings) {
+                // Set up the player like the recorded session, whatever the command line says
+                options.layers               = recording.layers;
+                options.audibility_threshold = recording.audibility_threshold;
+                options.voice_pool_size      = recording.voice_pool_size;
+                options.voice_quotas         = recording.voice_quotas;
+                options.start                = recording.start;
+                if (options.two_pass && !std::isinf(options.audibility_threshold)) {
+                    throw std::runtime_error("The session retired voices by audibility, which --two-pass doesn't, so it can't be replayed with --two-pass");
+                }
+            }
+            if (output_filename.empty()) output_filename = replay_filename + ".wav";
+        }
+        if (filenames.empty()) {
+            filenames.push_back(filename);
+        }
+        if (options.start > 0.0 && !midi::is_compiled_song_filename(filenames[0])) {
+            throw std::runtime_error("--start needs a compiled song (see --compile), not " + filenames[0]);
+        }
+        async_io io;
+        const bool offline = !output_filename.empty();
+        // Rendering offline, the workers help the main thread and don't need realtime setup
+        realtime_thread_config worker_rt_config = rt_config;
+        if (offline) {
+            worker_rt_config.realtime_scheduling = false;
+            worker_rt_config.stack_prefault_size = 0;
+        } else if (lock_memory) {
+            report_realtime_problems("main", lock_process_memory());
+        }
+        std::unique_ptr<worker_pool> workers;
+        if (render_threads > 1) workers.reset(new worker_pool{render_threads, worker_rt_config});
+        options.two_pass &= offline; // Runs ahead of the output, so offline only
+        options.prefault = !offline;
+        playlist_player p{io, filenames, workers.get(), options};
+        live_session session{p};
+
+        if (offline) {
+            if (!replay_filename.empty()) session.replay(recording);
+            render_offline(io, session, output_filename);
+            io.report(std::cout);
+            return 0;
+        }
+        if (!record_filename.empty()) {
+            constexpr size_t max_recorded_events = 1 << 20;
+            recording.files = filenames;
+            recording.has_player_settings  = true;
+            recording.layers               = options.layers;
+            recording.audibility_threshold = options.audibility_threshold;
+            recording.voice_pool_size      = options.voice_pool_size;
+            recording.voice_quotas         = options.voice_quotas;
+            recording.start                = options.start;
+            recording.events.reserve(max_recorded_events);
+            session.record(&recording);
+        }
 
-        gui g{1000, 400};
+#ifdef SPLAY_HEADLESS_GUI
+        headless::configure(headless_options);
+#endif
+        gui g{1000, 560};
         std::mutex data_mutex;
         std::condition_variable data_cv;
         std::vector<short> data;
@@ -583,6 +2393,13 @@ int main(int argc, const char* argv[])
         auto& max_freq_label = g.make_label("", 0, 300, 400, 100);
         spectrum_analyzer spec_an{};
         auto& wave_bitmap = g.make_bitmap_window(500, 0, 400, 300);
+        auto& overview_bitmap = g.make_bitmap_window(500, 310, 400, 60);
+        waveform_overview overview;
+        auto& spectrogram_bitmap = g.make_bitmap_window(0, 400, 900, 128);
+        spectrogram spec_gram{spectrogram_bitmap.width(), spectrogram_bitmap.height()};
+        auto& meter_bitmap = g.make_bitmap_window(910, 0, 80, 300);
+        auto& engine_label = g.make_label("", 500, 370, 400, 30);
+        triple_buffer<engine_snapshot> snapshots;   // Published by the audio thread every period
 
         g.set_on_idle([&]() {
             std::vector<short> d;
@@ -591,6 +2408,22 @@ int main(int argc, const char* argv[])
                 data_cv.wait_for(lock, std::chrono::milliseconds(10), [&] { d = std::move(data); return !d.empty(); });
             }
 
+            if (snapshots.update()) {
+                const auto& s = snapshots.read_buffer();
+                float peaks[midi::max_channels];
+                float rms[midi::max_channels];
+                for (int i = 0; i < midi::max_channels; ++i) {
+                    peaks[i] = s.channels[i].peak;
+                    rms[i]   = s.channels[i].rms;
+                }
+                draw_level_meters(meter_bitmap, peaks, rms, midi::max_channels);
+                std::ostringstream oss;
+                oss << "Voices " << s.voices_active << "/" << s.voice_pool_size << "  Sequences " << s.sequences;
+                oss << std::fixed << std::setprecision(1) << "  " << s.position << " s  Tick " << s.tick;
+                oss << std::setprecision(0) << "  " << s.tempo << " BPM  DSP " << 100.0f * s.dsp_load << "%";
+                engine_label.text(oss.str());
+            }
+
             if (d.empty()) return;
 
             // Stero -> Mono
@@ -601,44 +2434,82 @@ int main(int argc, const char* argv[])
             }
             d.resize(s);
 
+            if (std::all_of(d.begin(), d.end(), [](short s) { return s == 0; })) {
+                overview.append_silence(d.size());
+                spec_gram.append_silence(d.size());
+            } else {
+                overview.append(&d[0], d.size());
+                spec_gram.append(&d[0], d.size());
+            }
+            draw_waveform_overview(overview_bitmap, overview, 0, overview.sample_count());
+            spec_gram.draw(spectrogram_bitmap);
+
+            // Only show the most recent audio if we've fallen behind
+            constexpr int max_recent_samples = 4096;
+            if (s > max_recent_samples) {
+                d.erase(d.begin(), d.end() - max_recent_samples);
+            }
+
             draw_waveform_data(wave_bitmap, d);
             double freq_max = spec_an.draw_spetrum_data(spec_bitmap, d);
             std::ostringstream oss;
             oss << "Maximum frequency: " << std::setw(5) << int(freq_max+0.5) << " Hz";
             max_freq_label.text(oss.str());
         });
-        simple_midi_channel ch;
+        std::unique_ptr<pcm_ring_writer> pcm_ring;
+        if (!shm_name.empty()) pcm_ring.reset(new pcm_ring_writer{shm_name, samplerate});
         job_queue sound_job_queue;
-        bool sound_instrument_edit_mode = false;
         g.add_key_listener(
         [&] (bool pressed, int vk) {
             if (!pressed && vk == 13) {
-                sound_job_queue.push([&sound_instrument_edit_mode] { sound_instrument_edit_mode = !sound_instrument_edit_mode; });
+                sound_job_queue.push([&session] { session.input(input_event_type::toggle_edit_mode); });
+                return;
+            }
+            if (!pressed && vk == 'Q') {
+                // Toggle between linear and constant-Q (per piano key) spectrum
+                spec_an.mode(spec_an.mode() == spectrum_mode::linear ? spectrum_mode::constant_q : spectrum_mode::linear);
                 return;
             }
             auto key = key_to_note(vk);
             if (key == piano_key::OFF) {
                 return;
             }
-            sound_job_queue.push([&ch, pressed, key] { pressed  ? ch.note_on(key, 0x40) : ch.note_off(key, 0x40); });
+            sound_job_queue.push([&session, pressed, key] { session.input(pressed ? input_event_type::note_on : input_event_type::note_off, key, 0x40); });
         });
 
-        output_dev od{
-        [&] { 
-            if (sound_instrument_edit_mode) {
-                return 10.0f*ch();
-            } else {
-                return p();
-            }
-        },
-        [&](std::vector<short> new_data) {
-            {
-                std::lock_guard<std::mutex> lock(data_mutex);
-                data = std::move(new_data); 
-            }
-            sound_job_queue.execute_all();
-        }};
-        g.main_loop();
+        {
+            output_dev od{
+            [&](stereo_sample* out, int count) {
+                return session.render(out, count);
+            },
+            [&, periods = uint64_t{0}](std::vector<short> new_data, float dsp_load) mutable {
+                auto& snapshot = snapshots.write_buffer();
+                session.snapshot(snapshot);
+                snapshot.dsp_load = dsp_load;
+                snapshot.period   = ++periods;
+                snapshots.publish();
+                if (pcm_ring) pcm_ring->write(new_data.data(), new_data.size() / 2);
+                {
+                    realtime_check_lock("gui data mutex");
+                    std::lock_guard<std::mutex> lock(data_mutex);
+                    // Append so the GUI sees all audio even if it didn't keep up
+                    data.insert(data.end(), new_data.begin(), new_data.end());
+                }
+                sound_job_queue.execute_all();
+            },
+            rt_config};
+            g.main_loop();
+#ifdef SPLAY_HEADLESS_GUI
+            headless::report(std::cout);
+#endif
+        }
+        if (!record_filename.empty()) {
+            // The output device has stopped, so the recording is no longer touched by the audio thread
+            std::ofstream out(record_filename);
+            recording.save(out);
+            if (!out) throw std::runtime_error("Error writing " + record_filename);
+            std::cout << "Recorded " << recording.events.size() << " input events" << std::endl;
+        }
     } catch (const std::exception& e) {
         std::cout << e.what() << std::endl;
     }
@@ -0,0 +1,102 @@
+#include "mapped_file.h"
+#include <stdexcept>
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+class mapped_file::impl {
+public:
+    explicit impl(const std::string& filename) {
+#ifdef _WIN32
+        file_ = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file_ == INVALID_HANDLE_VALUE) {
+            throw std::runtime_error("File not found: " + filename);
+        }
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(file_, &size)) {
+            CloseHandle(file_);
+            throw std::runtime_error("GetFileSizeEx failed: " + std::to_string(GetLastError()));
+        }
+        size_ = static_cast<size_t>(size.QuadPart);
+        if (size_) {
+            mapping_ = CreateFileMapping(file_, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            data_ = mapping_ ? MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0) : nullptr;
+            if (!data_) {
+                const auto err = GetLastError();
+                if (mapping_) CloseHandle(mapping_);
+                CloseHandle(file_);
+                throw std::runtime_error("Mapping " + filename + " failed: " + std::to_string(err));
+            }
+        }
+#else
+        fd_ = open(filename.c_str(), O_RDONLY);
+        if (fd_ < 0) {
+            throw std::runtime_error("File not found: " + filename);
+        }
+        struct stat st;
+        if (fstat(fd_, &st) != 0) {
+            close(fd_);
+            throw std::runtime_error("fstat failed for " + filename);
+        }
+        size_ = static_cast<size_t>(st.st_size);
+        if (size_) {
+            data_ = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+            if (data_ == MAP_FAILED) {
+                close(fd_);
+                throw std::runtime_error("Mapping " + filename + " failed");
+            }
+        }
+#endif
+    }
+
+    ~impl() {
+#ifdef _WIN32
+        if (data_) UnmapViewOfFile(data_);
+        if (mapping_) CloseHandle(mapping_);
+        CloseHandle(file_);
+#else
+        if (data_) munmap(data_, size_);
+        close(fd_);
+#endif
+    }
+
+    const char* data() const {
+        return static_cast<const char*>(data_);
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+private:
+#ifdef _WIN32
+    HANDLE file_    = INVALID_HANDLE_VALUE;
+    HANDLE mapping_ = nullptr;
+#else
+    int    fd_      = -1;
+#endif
+    void*  data_    = nullptr;
+    size_t size_    = 0;
+};
+
+mapped_file::mapped_file(const std::string& filename) : impl_(new impl(filename))
+{
+}
+
+mapped_file::~mapped_file() = default;
+
+const char* mapped_file::data() const
+{
+    return impl_->data();
+}
+
+size_t mapped_file::size() const
+{
+    return impl_->size();
+}
@@ -0,0 +1,25 @@
+#ifndef MAPPED_FILE_H_INCLUDED
+#define MAPPED_FILE_H_INCLUDED
+
+#include <memory>
+#include <string>
+#include <stddef.h>
+
+// Read-only memory mapping of a whole file
+class mapped_file {
+public:
+    explicit mapped_file(const std::string& filename);
+    ~mapped_file();
+
+    mapped_file(const mapped_file&) = delete;
+    mapped_file& operator=(const mapped_file&) = delete;
+
+    const char* data() const;
+    size_t size() const;
+
+private:
+    class impl;
+    std::unique_ptr<impl> impl_;
+};
+
+#endif
@@ -1,5 +1,7 @@
 #include "midi.h"
 #include "note.h"
+#include "mapped_file.h"
+#include "arena.h"
 
 #include <iostream>
 #include <iomanip>
@@ -8,8 +10,10 @@
 #include <string>
 #include <vector>
 #include <algorithm>
+#include <iterator>
 #include <stdexcept>
 #include <stdint.h>
+#include <string.h>
 #include <assert.h>
 
 namespace splay { namespace midi {
@@ -32,35 +36,6 @@ constexpr uint32_t pack_u32(char a, char b, char c, char d)
     return (static_cast<uint32_t>(static_cast<uint8_t>(a)) << 24) | (static_cast<uint32_t>(static_cast<uint8_t>(b)) << 16) | (static_cast<uint32_t>(static_cast<uint8_t>(c)) << 8) | static_cast<uint8_t>(d);
 }
 
-uint16_t read_be_u16(std::istream& in)
-{
-    char data[2];
-    in.read(data, sizeof(data));
-    return pack_u16(data[0], data[1]);
-}
-
-uint32_t read_be_u32(std::istream& in)
-{
-    char data[4];
-    in.read(data, sizeof(data));
-    return pack_u32(data[0], data[1], data[2], data[3]);
-}
-
-uint32_t read_var_num(std::istream& in)
-{
-    // Maximamlly allowed number is 0x0FFFFFFF
-    uint32_t result = 0;
-    for (int n = 0; n < 4; ++n) {
-        int ch = in.get();
-        assert(ch >= 0); // TODO: Handle failure better
-        result <<= 7;
-        result |= ch & 0x7f;
-        if (!(ch & 0x80)) break;
-        assert(n != 3); // TODO: Handle failure better
-    }
-    return result;
-}
-
 class chunk_type {
 public:
     constexpr chunk_type() = default;
@@ -70,7 +45,7 @@ public:
     constexpr uint32_t repr() const { return repr_; }
 
 private:
-    uint32_t repr_;
+    uint32_t repr_ = 0;
 };
 
 constexpr chunk_type header_chunk_type{pack_u32('M', 'T', 'h', 'd')};
@@ -95,15 +70,6 @@ std::ostream& operator<<(std::ostream& os, const chunk_header& header)
     return os << '<' << header.type << ' ' << header.length << '>';
 }
 
-chunk_header read_chunk_header(std::istream& in)
-{
-    const chunk_type type{read_be_u32(in)};
-    const uint32_t length = read_be_u32(in);
-    if (!in) return { chunk_type{0}, 0 };
-
-    return { type, length };
-}
-
 struct event {
     static constexpr uint8_t max_data_size = 15;
 
@@ -128,86 +94,582 @@ std::ostream& operator<<(std::ostream& os, const event& e)
     return os;
 }
 
+// Bounds checked big-endian reader over a memory buffer
+class byte_reader {
+public:
+    explicit byte_reader(const uint8_t* begin, const uint8_t* end) : p_(begin), end_(end) {
+    }
+
+    size_t remaining() const {
+        return static_cast<size_t>(end_ - p_);
+    }
+
+    const uint8_t* pos() const {
+        return p_;
+    }
+
+    uint8_t peek() const {
+        need(1);
+        return *p_;
+    }
+
+    uint8_t u8() {
+        need(1);
+        return *p_++;
+    }
+
+    uint16_t be16() {
+        need(2);
+        const uint16_t v = static_cast<uint16_t>((p_[0] << 8) | p_[1]);
+        p_ += 2;
+        return v;
+    }
+
+    uint32_t be32() {
+        need(4);
+        const uint32_t v = (static_cast<uint32_t>(p_[0]) << 24) | (static_cast<uint32_t>(p_[1]) << 16) | (static_cast<uint32_t>(p_[2]) << 8) | p_[3];
+        p_ += 4;
+        return v;
+    }
+
+    uint32_t var_num() {
+        uint32_t result = 0;
+        for (int n = 0; n < 4; ++n) {
+            const uint8_t ch = u8();
+            result = (result << 7) | (ch & 0x7f);
+            if (!(ch & 0x80)) return result;
+        }
+        throw std::runtime_error("Invalid variable length number");
+    }
+
+    void skip(size_t n) {
+        need(n);
+        p_ += n;
+    }
+
+private:
+    const uint8_t* p_;
+    const uint8_t* end_;
+
+    void need(size_t n) const {
+        if (remaining() < n) throw std::runtime_error("Unexpected EOF");
+    }
+};
+
+// Events of one track
 struct track {
-    std::vector<event> events;
-    std::string        text_;
+    const event* events;
+    uint32_t     num_events;
+};
+
+// Parsed Standard MIDI File. The tracks and their events are allocated from
+// one arena sized from the file, so a song is freed in one operation.
+struct song {
+    int      division   = 0;
+    uint16_t num_tracks = 0;
+    track*   tracks     = nullptr;
+    arena    memory;
 };
 
-track read_track(std::istream& in)
+// Decodes the events of a track chunk one at a time
+class track_decoder {
+public:
+    explicit track_decoder(byte_reader in) : in_(in) {
+    }
+
+    // Decodes the next event to e, returns false at the end of the track. Skipped
+    // system exclusive events are reported if verbose.
+    bool next(event& e, bool verbose) {
+        while (in_.remaining()) {
+            current_time_ += in_.var_num();
+
+            const uint8_t command_byte = in_.peek();
+            if ((command_byte & 0xF0) == 0xF0) {
+                in_.u8(); // consume
+
+                // Sys event
+                if (command_byte == 0xFF) { // Meta event
+                    const uint8_t meta_event_type = in_.u8();
+                    assert(meta_event_type <= 0x7F);
+                    const uint32_t meta_event_length = in_.var_num();
+                    const uint8_t* data = in_.pos();
+                    in_.skip(meta_event_length);
+                    e.time      = current_time_;
+                    e.command   = static_cast<uint16_t>(0xFF00 | meta_event_type);
+                    e.data_size = static_cast<uint8_t>(std::min<uint32_t>(event::max_data_size, meta_event_length));
+                    memcpy(e.data, data, e.data_size);
+                    return true;
+                }
+                const auto len = in_.var_num();
+                if (verbose) {
+                    std::cout << "Skipping system event 0x" << std::hex << std::setw(2) << std::setfill('0') << int(command_byte) << std::dec << std::setfill(' ') << " lemgth " << len << std::endl;
+                }
+                in_.skip(len);
+                continue;
+            }
+
+            // Channel message
+            if (command_byte & 0x80) {
+                last_message_ = in_.u8();
+            } else if (!last_message_) {
+                throw std::runtime_error("Running status without previous message");
+            }
+
+            e.time      = current_time_;
+            e.command   = last_message_;
+            e.data_size = (last_message_>>4 == 0xC || last_message_>>4 == 0x0D) ? 1 : 2;
+            for (int i = 0; i < e.data_size; ++i) {
+                const auto x = in_.u8();
+                assert(x <= 0x7F);
+                e.data[i] = x;
+            }
+            return true;
+        }
+        return false;
+    }
+
+private:
+    byte_reader in_;
+    int         current_time_ = 0;
+    uint8_t     last_message_ = 0;
+};
+
+// Parses the events of a track chunk to out, or only counts them if out is null
+uint32_t parse_track(byte_reader in, event* out)
+{
+    track_decoder decoder{in};
+    uint32_t count = 0;
+    event e;
+    while (decoder.next(e, out != nullptr)) {
+        if (out) out[count] = e;
+        ++count;
+    }
+    return count;
+}
+
+// Calls f(track_number, chunk) for the track chunks of a file positioned after the header
+template<typename F>
+void for_each_track(byte_reader in, int num_tracks, F f)
 {
-    const auto track_header = read_chunk_header(in);
-    if (track_header.length == 0 || !in) {
-        assert(track_header.type == chunk_type{0});
-        throw std::runtime_error("Unexpected EOF");
+    for (int track_number = 0; track_number < num_tracks; ++track_number) {
+        if (in.remaining() < 8) {
+            throw std::runtime_error("Unexpected EOF");
+        }
+        const chunk_header track_header{chunk_type{in.be32()}, in.be32()};
+        if (track_header.type != track_chunk_type) {
+            std::ostringstream oss;
+            oss << "Invalid track header " << track_header;
+            throw std::runtime_error(oss.str());
+        }
+        if (track_header.length > in.remaining()) {
+            throw std::runtime_error("Unexpected EOF");
+        }
+        f(track_number, byte_reader{in.pos(), in.pos() + track_header.length});
+        in.skip(track_header.length);
     }
+}
 
-    if (track_header.type != track_chunk_type) {
+// Reads the file header, leaving in positioned at the first track chunk
+song read_song_header(byte_reader& in)
+{
+    chunk_header midi_header{chunk_type{0}, 0};
+    if (in.remaining() >= 8) {
+        midi_header = chunk_header{chunk_type{in.be32()}, in.be32()};
+    }
+    if (midi_header.type != header_chunk_type || midi_header.length != 6) {
         std::ostringstream oss;
-        oss << "Invalid track header " << track_header;
+        oss << "Invalid MIDI header " << midi_header;
         throw std::runtime_error(oss.str());
     }
+    const uint16_t midi_format    = in.be16();
+    const int16_t  midi_tracks    = static_cast<int16_t>(in.be16());
+    const uint16_t midi_divisions = in.be16();
 
-    track t{};
-
-    const auto expected_end = in.tellg() + static_cast<std::ios::streamoff>(track_header.length);
-
-    int current_time = 0;
-    uint8_t last_message = 0;
-    while (in.tellg() < expected_end) {
-        current_time += read_var_num(in);
-
-        const int command_byte = in.peek();
-        if ((command_byte & 0xF0) == 0xF0) {
-            in.get(); // consume
-
-            // Sys event
-            if (command_byte == 0xFF) { // Meta event
-                const auto meta_event_type = in.get();
-                assert(meta_event_type >= 0 && meta_event_type <= 0x7F);
-                const auto meta_event_length = read_var_num(in);
-                
-                event e;
-                e.time      = current_time;
-                e.command   = static_cast<uint16_t>(0xFF00 | meta_event_type);
-                e.data_size = static_cast<uint8_t>(std::min<uint32_t>(event::max_data_size, meta_event_length));
-                in.read(reinterpret_cast<char*>(e.data), e.data_size);
-                if (e.data_size != meta_event_length) {
-                    in.seekg(meta_event_length - e.data_size, std::ios::cur);
-                }
-                t.events.push_back(e);
-            } else {
-                const auto len = read_var_num(in);
-                std::cout << "Skipping system event 0x" << std::hex << std::setw(2) << std::setfill('0') << command_byte << std::dec << std::setfill(' ') << " lemgth " << len << std::endl;
-                in.seekg(len, std::ios::cur);
+    if (midi_format != 1) {
+        throw std::runtime_error("Unsupported MIDI format " + std::to_string(midi_format));
+    }
+
+    std::cout << "Format: " << midi_format << " Tracks: " << midi_tracks << " Divisions: " << midi_divisions << std::endl;
+
+    song s;
+    s.division = static_cast<int16_t>(midi_divisions); // If bit 15 of <division> is zero, the bits 14 thru 0 represent the number of delta time "ticks" which make up a quarter-note.
+    assert(s.division > 0.0f);
+    s.num_tracks = static_cast<uint16_t>(std::max<int16_t>(midi_tracks, 0));
+    return s;
+}
+
+// The arena has room for one extra uint32_t per track, for the player's cursors
+song read_song(const char* data, size_t size)
+{
+    const auto begin = reinterpret_cast<const uint8_t*>(data);
+    byte_reader in{begin, begin + size};
+    song s = read_song_header(in);
+
+    // Count the events first, so everything fits in one allocation
+    size_t num_events = 0;
+    for_each_track(in, s.num_tracks, [&](int, byte_reader chunk) { num_events += parse_track(chunk, nullptr); });
+    s.memory = arena{arena::size_for<track>(s.num_tracks) + arena::size_for<event>(num_events) + arena::size_for<uint32_t>(s.num_tracks)};
+    s.tracks = s.memory.allocate<track>(s.num_tracks);
+    auto events = s.memory.allocate<event>(num_events);
+    for_each_track(in, s.num_tracks, [&](int track_number, byte_reader chunk) {
+        auto& t = s.tracks[track_number];
+        t.events     = events;
+        t.num_events = parse_track(chunk, events);
+        events      += t.num_events;
+    });
+    return s;
+}
+
+song read_song(std::istream& in)
+{
+    std::vector<char> data;
+    const auto start = in.tellg();
+    if (start >= 0 && in.seekg(0, std::ios::end)) {
+        data.resize(static_cast<size_t>(in.tellg() - start));
+        in.seekg(start);
+        in.read(data.data(), data.size());
+    } else {
+        in.clear();
+        data.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+    return read_song(data.data(), data.size());
+}
+
+struct tempo_change {
+    uint32_t tick;
+    uint32_t us_per_quater_note;
+};
+
+void scan_track(byte_reader& in, file_info& info, std::vector<tempo_change>& tempo_map)
+{
+    uint32_t current_time = 0;
+    uint8_t  last_message = 0;
+    while (in.remaining()) {
+        current_time += in.var_num();
+        const uint8_t command_byte = in.peek();
+        if (command_byte == 0xFF) { // Meta event
+            in.u8();
+            const uint8_t meta_event_type = in.u8();
+            const uint32_t len = in.var_num();
+            if (meta_event_type == 0x51 && len == 3) {
+                const uint8_t* d = in.pos();
+                tempo_map.push_back({current_time, static_cast<uint32_t>((d[0] << 16) | (d[1] << 8) | d[2])});
+                info.tempo_changes++;
             }
+            in.skip(len);
+            if (meta_event_type == 0x2F) break;
+        } else if (command_byte == 0xF0 || command_byte == 0xF7) { // Sys-ex
+            in.u8();
+            in.skip(in.var_num());
         } else {
-            // Channel message
             if (command_byte & 0x80) {
-                last_message = static_cast<uint8_t>(command_byte);
-                in.get(); // consume
+                last_message = in.u8();
+            } else if (!last_message) {
+                throw std::runtime_error("Running status without previous message");
             }
-            assert(last_message >= 0x80 && last_message <= 0xEF);
-
-            event e;
-            e.time      = current_time;
-            e.command   = last_message;
-            e.data_size = (last_message>>4 == 0xC || last_message>>4 == 0x0D) ? 1 : 2;
-            for (int i = 0; i < e.data_size; ++i) {
-                auto x = in.get();
-                assert(x >= 0 && x <= 0x7F);
-                e.data[i] = static_cast<uint8_t>(x);
+            const uint8_t type = last_message >> 4;
+            in.skip(1);
+            if (type != 0xC && type != 0xD) {
+                const uint8_t velocity = in.u8();
+                if (type == 0x9 && velocity) info.notes++;
             }
+            info.channel_mask |= 1 << (last_message & 0xf);
+        }
+        info.events++;
+    }
+    info.length_ticks = std::max(info.length_ticks, current_time);
+}
+
+double ticks_to_seconds(uint32_t ticks, int division, std::vector<tempo_change>& tempo_map)
+{
+    if (division & 0x8000) {
+        // SMPTE: -frames per second in the upper byte, ticks per frame in the lower
+        const int fps = -static_cast<int8_t>(division >> 8);
+        const int ticks_per_frame = division & 0xff;
+        return fps && ticks_per_frame ? static_cast<double>(ticks) / (fps * ticks_per_frame) : 0.0;
+    }
+    if (!division) return 0.0;
+
+    std::stable_sort(tempo_map.begin(), tempo_map.end(), [](const tempo_change& l, const tempo_change& r) { return l.tick < r.tick; });
+    double   us = 0.0;
+    uint32_t tick = 0;
+    uint32_t us_per_quater_note = 500000;
+    for (const auto& t : tempo_map) {
+        if (t.tick >= ticks) break;
+        us += static_cast<double>(t.tick - tick) * us_per_quater_note / division;
+        tick = t.tick;
+        us_per_quater_note = t.us_per_quater_note;
+    }
+    us += static_cast<double>(ticks - tick) * us_per_quater_note / division;
+    return us * 1e-6;
+}
+
+file_info scan(const char* data, size_t size)
+{
+    auto begin = reinterpret_cast<const uint8_t*>(data);
+    byte_reader in{begin, begin + size};
+    if (in.be32() != header_chunk_type.repr()) {
+        throw std::runtime_error("Invalid MIDI header");
+    }
+    const uint32_t header_length = in.be32();
+    if (header_length < 6) {
+        throw std::runtime_error("Invalid MIDI header length " + std::to_string(header_length));
+    }
+
+    file_info info;
+    info.format   = in.be16();
+    info.tracks   = in.be16();
+    info.division = in.be16();
+    in.skip(header_length - 6);
 
-            t.events.push_back(e);
+    std::vector<tempo_change> tempo_map;
+    for (int track_number = 0; track_number < info.tracks && in.remaining(); ) {
+        const uint32_t type   = in.be32();
+        const uint32_t length = in.be32();
+        const size_t available = std::min<size_t>(length, in.remaining());
+        byte_reader chunk{in.pos(), in.pos() + available};
+        in.skip(available);
+        if (type != track_chunk_type.repr()) {
+            continue; // Unknown chunks must be ignored
         }
+        scan_track(chunk, info, tempo_map);
+        ++track_number;
     }
 
-    return t;
+    info.duration = ticks_to_seconds(info.length_ticks, info.division, tempo_map);
+    return info;
 }
 
+// Compiled song
+
+namespace {
+
+constexpr uint64_t snapshot_interval_us = 5000000;
+
+constexpr compiled::channel_state unset_channel_state{compiled::unset, compiled::unset, compiled::unset, compiled::unset, compiled::unset, {}};
+
+// The compiled format is used in place, which needs the host to have its byte order
+void check_little_endian_host()
+{
+    const uint16_t probe = 1;
+    unsigned char first;
+    memcpy(&first, &probe, 1);
+    if (first != 1) {
+        throw std::runtime_error("Compiled songs are little-endian and can't be used on this big-endian host");
+    }
+}
+
+uint64_t align8(uint64_t n)
+{
+    return (n + 7) & ~static_cast<uint64_t>(7);
+}
+
+uint64_t us_per_tick(uint32_t us_per_quater_note, int division)
+{
+    return std::max<uint64_t>(1, us_per_quater_note / division);
+}
+
+template<typename T>
+void check_section(uint64_t offset, uint32_t count, uint64_t size, const char* name)
+{
+    if (offset % 8 || offset > size || count > (size - offset) / sizeof(T)) {
+        throw std::runtime_error(std::string("Invalid compiled song ") + name + " section");
+    }
+}
+
+// Updates the snapshot channel state for a channel message
+void update_channel_state(compiled::channel_state& cs, const compiled::event& e)
+{
+    switch (e.command >> 4) {
+    case 0xB:
+        switch (static_cast<controller_type>(e.data[0])) {
+        case controller_type::modulation_wheel: cs.modulation_wheel = e.data[1]; break;
+        case controller_type::volume:           cs.volume = e.data[1]; break;
+        case controller_type::pan:              cs.pan = e.data[1]; break;
+        default: break;
+        }
+        break;
+    case 0xC:
+        cs.program = e.data[0];
+        break;
+    case 0xD:
+        cs.channel_pressure = e.data[0];
+        break;
+    }
+}
+
+} // unnamed namespace
+
+event to_event(const compiled::event& ce)
+{
+    event e;
+    e.time      = static_cast<int>(ce.tick);
+    e.command   = ce.command;
+    e.data_size = ce.data_size;
+    memcpy(e.data, ce.data, sizeof(e.data));
+    return e;
+}
+
+compiled_song::compiled_song() = default;
+
+compiled_song::~compiled_song() = default;
+
+std::shared_ptr<const compiled_song> compiled_song::compile(std::istream& in)
+{
+    check_little_endian_host();
+    const auto s = read_song(in);
+
+    // Merge the tracks, events of the same tick stay in the order the player would process them
+    std::vector<compiled::event> events;
+    for (int track_number = 0; track_number < s.num_tracks; ++track_number) {
+        const auto& t = s.tracks[track_number];
+        for (uint32_t i = 0; i < t.num_events; ++i) {
+            const auto& e = t.events[i];
+            compiled::event ce{};
+            ce.tick      = static_cast<uint32_t>(e.time);
+            ce.track     = static_cast<uint16_t>(track_number);
+            ce.command   = e.command;
+            ce.data_size = e.data_size;
+            memcpy(ce.data, e.data, sizeof(ce.data));
+            events.push_back(ce);
+        }
+    }
+    std::stable_sort(events.begin(), events.end(), [](const compiled::event& l, const compiled::event& r) { return l.tick < r.tick; });
+
+    compiled::header h{};
+    h.magic       = compiled::magic;
+    h.version     = compiled::version;
+    h.header_size = sizeof(compiled::header);
+    h.division    = s.division;
+    h.num_tracks  = s.num_tracks;
+    h.num_events  = static_cast<uint32_t>(events.size());
+
+    // Walk the stream once to build the tempo map, snapshots and metadata
+    std::vector<compiled::tempo_change> tempo_changes;
+    std::vector<compiled::snapshot>     snapshots;
+    compiled::snapshot state{};
+    state.us_per_quater_note = 500000;
+    for (auto& cs : state.channels) {
+        cs = unset_channel_state;
+    }
+    snapshots.push_back(state);
+    for (uint32_t i = 0; i < h.num_events; ++i) {
+        const auto& e = events[i];
+        if (e.tick != state.tick) {
+            state.time_us += (e.tick - state.tick) * us_per_tick(state.us_per_quater_note, h.division);
+            state.tick     = e.tick;
+            if (state.time_us >= snapshots.back().time_us + snapshot_interval_us) {
+                state.event_index = i;
+                snapshots.push_back(state);
+            }
+        }
+        if (e.command < 0x100) {
+            const int channel_index = e.command & 0xf;
+            h.channel_mask |= 1 << channel_index;
+            if (e.command >> 4 == 0x9 && e.data[1]) h.notes++;
+            update_channel_state(state.channels[channel_index], e);
+        } else if (e.command == 0xFF51 && e.data_size == 3) {
+            state.us_per_quater_note = (e.data[0]<<16) | (e.data[1]<<8) | e.data[2];
+            tempo_changes.push_back({e.tick, state.us_per_quater_note, state.time_us});
+        }
+    }
+    h.length_ticks      = state.tick;
+    h.duration          = state.time_us * 1e-6;
+    h.num_tempo_changes = static_cast<uint32_t>(tempo_changes.size());
+    h.num_snapshots     = static_cast<uint32_t>(snapshots.size());
+
+    h.events_offset        = align8(sizeof(h));
+    h.tempo_changes_offset = align8(h.events_offset + events.size() * sizeof(compiled::event));
+    h.snapshots_offset     = align8(h.tempo_changes_offset + tempo_changes.size() * sizeof(compiled::tempo_change));
+    h.file_size            = align8(h.snapshots_offset + snapshots.size() * sizeof(compiled::snapshot));
+
+    std::shared_ptr<compiled_song> res{new compiled_song};
+    res->image_.resize(static_cast<size_t>(h.file_size / sizeof(uint64_t)));
+    char* data = reinterpret_cast<char*>(res->image_.data());
+    memcpy(data, &h, sizeof(h));
+    if (!events.empty())        memcpy(data + h.events_offset, events.data(), events.size() * sizeof(compiled::event));
+    if (!tempo_changes.empty()) memcpy(data + h.tempo_changes_offset, tempo_changes.data(), tempo_changes.size() * sizeof(compiled::tempo_change));
+    memcpy(data + h.snapshots_offset, snapshots.data(), snapshots.size() * sizeof(compiled::snapshot));
+    res->data_ = data;
+    res->size_ = static_cast<size_t>(h.file_size);
+    return res;
+}
+
+size_t compiled_song::memory_usage() const
+{
+    // A loaded song is mapped, its pages belong to the page cache
+    return sizeof(*this) + image_.capacity() * sizeof(uint64_t);
+}
+
+std::shared_ptr<const compiled_song> compiled_song::load(const std::string& filename)
+{
+    std::shared_ptr<compiled_song> res{new compiled_song};
+    res->file_.reset(new mapped_file{filename});
+    res->data_ = res->file_->data();
+    res->size_ = res->file_->size();
+    res->validate();
+    return res;
+}
+
+void compiled_song::validate() const
+{
+    check_little_endian_host();
+    if (size_ < sizeof(compiled::header) || header().magic != compiled::magic) {
+        throw std::runtime_error("Not a compiled song");
+    }
+    const auto& h = header();
+    if (h.version != compiled::version || h.header_size != sizeof(compiled::header)) {
+        throw std::runtime_error("Unsupported compiled song version " + std::to_string(h.version));
+    }
+    if (h.file_size != size_) {
+        throw std::runtime_error("Truncated compiled song");
+    }
+    if (h.division <= 0 || h.num_snapshots == 0) {
+        throw std::runtime_error("Invalid compiled song header");
+    }
+    check_section<compiled::event>(h.events_offset, h.num_events, size_, "event");
+    check_section<compiled::tempo_change>(h.tempo_changes_offset, h.num_tempo_changes, size_, "tempo");
+    check_section<compiled::snapshot>(h.snapshots_offset, h.num_snapshots, size_, "snapshot");
+}
+
+void compiled_song::save(const std::string& filename) const
+{
+    std::ofstream out(filename, std::ofstream::binary);
+    out.write(data_, size_);
+    if (!out) {
+        throw std::runtime_error("Error writing " + filename);
+    }
+}
+
+bool is_compiled_song_filename(const std::string& filename)
+{
+    const std::string ext = ".splc";
+    return filename.size() >= ext.size() && filename.compare(filename.size() - ext.size(), ext.size(), ext) == 0;
+}
+
+// Player
+
+// Track of a lazily decoded file. The window holds the next decoded events and
+// is refilled from the decoder once it's been played.
+struct lazy_track {
+    static constexpr int window_size = 64;
+
+    byte_reader   chunk;    // Kept to start over
+    track_decoder decoder;
+    event         window[window_size];
+    int           pos   = 0;
+    int           count = 0;
+    bool          ended = false;
+
+    explicit lazy_track(byte_reader in) : chunk(in), decoder(in) {
+    }
+};
+
 class player::impl {
 public:
-    explicit impl(std::istream& in);
+    explicit impl(song s);
+    explicit impl(std::vector<char> data); // Decodes lazily
+    explicit impl(std::shared_ptr<const compiled_song> song);
 
     void advance_time(float seconds) {
         assert(seconds > 0.0f && seconds < 1.0f);
@@ -218,19 +680,65 @@ public:
         }
     }
     void tick();
+    bool refill(int track_number);
+    void process_event(const event& e, int track_number);
+    void seek(double seconds);
+    void rewind();
+    // Applies cs to the channel, resetting what's unset to the power-on state
+    void restore_channel(int index, const compiled::channel_state& cs);
 
     void set_channel(int index, channel& ch) {
         channels_[index] = &ch;
+        restore_channel(index, unset_channel_state);
+    }
+
+    bool finished() const {
+        if (song_) {
+            return song_pos_ >= song_->header().num_events;
+        }
+        if (lazy_tracks_) {
+            return std::all_of(lazy_tracks_, lazy_tracks_ + smf_.num_tracks, [](const lazy_track& t) { return t.ended && t.pos == t.count; });
+        }
+        for (int i = 0; i < smf_.num_tracks; ++i) {
+            if (track_pos_[i] < smf_.tracks[i].num_events) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    int current_tick() const {
+        return current_tick_;
+    }
+
+    float tempo() const {
+        return 60e6f / us_per_quater_note_;
+    }
+
+    void report_errors(std::ostream& out) const {
+        if (failed_track_ >= 0) {
+            out << "Track " << failed_track_ << ": " << error_ << ", ended it" << std::endl;
+        }
+    }
+
+    size_t memory_usage() const {
+        return sizeof(*this) + data_.capacity() + smf_.memory.reserved() + (song_ ? song_->memory_usage() : 0);
     }
 
 private:
-    std::vector<track> tracks_;
-    std::vector<int>   track_pos_;
+    song               smf_;                // Parsed tracks, unused when song_ is set
+    uint32_t*          track_pos_ = nullptr; // Next event by track, allocated from smf_.memory
+    std::vector<char>  data_;               // The file, when decoding lazily
+    lazy_track*        lazy_tracks_ = nullptr; // Allocated from smf_.memory, replace smf_.tracks when set
+    std::shared_ptr<const compiled_song> song_; // Merged event stream, replaces smf_ when set
+    uint32_t           song_pos_           = 0;
     int                division_           = 0; // delta divisions / quaternote
     int                current_tick_       = 0;
     int                us_to_next_tick_    = 0;
     int                us_per_quater_note_ = 500000; // 0.5s/quater-note = 1minute / 30quater-notes = 1minute / 120beats
     channel*           channels_[max_channels] = {};
+    int                failed_track_ = -1;  // First lazy track found corrupt, kept over rewinds...
+    char               error_[96] = {};     // ...and why, see report_errors
     
     // 120 BPM = 30 quater-notes / minute = 0.5 quater-notes / second
 
@@ -241,162 +749,308 @@ private:
     
 };
 
-player::impl::impl(std::istream& in)
+player::impl::impl(song s) : smf_(std::move(s))
 {
-    const auto midi_header = read_chunk_header(in);
-    if (midi_header.type != header_chunk_type || midi_header.length != 6) {
-        std::ostringstream oss;
-        oss << "Invalid MIDI header " << midi_header;
-        throw std::runtime_error(oss.str());
-    }
-    const uint16_t midi_format    = read_be_u16(in);
-    const int16_t  midi_tracks    = static_cast<int16_t>(read_be_u16(in));
-    const uint16_t midi_divisions = read_be_u16(in);
+    division_  = smf_.division;
+    track_pos_ = smf_.memory.allocate<uint32_t>(smf_.num_tracks);
+    std::fill(track_pos_, track_pos_ + smf_.num_tracks, 0u);
+}
 
-    if (midi_format != 1) {
-        throw std::runtime_error("Unsupported MIDI format " + std::to_string(midi_format));
+player::impl::impl(std::vector<char> data) : data_(std::move(data))
+{
+    // Only the chunk headers are read up front, the tracks are decoded as they're played
+    const auto begin = reinterpret_cast<const uint8_t*>(data_.data());
+    byte_reader in{begin, begin + data_.size()};
+    smf_ = read_song_header(in);
+    division_ = smf_.division;
+    smf_.memory = arena{arena::size_for<lazy_track>(smf_.num_tracks)};
+    lazy_tracks_ = smf_.memory.allocate<lazy_track>(smf_.num_tracks);
+    for_each_track(in, smf_.num_tracks, [&](int track_number, byte_reader chunk) { new (&lazy_tracks_[track_number]) lazy_track{chunk}; });
+    for (int track_number = 0; track_number < smf_.num_tracks; ++track_number) {
+        refill(track_number);
     }
+}
 
-    std::cout << "Format: " << midi_format << " Tracks: " << midi_tracks << " Divisions: " << midi_divisions << std::endl;
-
-    division_ = static_cast<int16_t>(midi_divisions); // If bit 15 of <division> is zero, the bits 14 thru 0 represent the number of delta time "ticks" which make up a quarter-note.
-    assert(division_ > 0.0f);
-
-    for (uint16_t track_number = 0; track_number < midi_tracks; ++track_number) {
-        tracks_.push_back(read_track(in));
-        track_pos_.push_back(0);
-    }
+player::impl::impl(std::shared_ptr<const compiled_song> song) : song_(std::move(song))
+{
+    const auto& h = song_->header();
+    std::cout << "Compiled song Tracks: " << h.num_tracks << " Divisions: " << h.division << " Events: " << h.num_events << std::endl;
+    division_ = h.division;
 }
 
 void player::impl::tick()
 {
-    for (int track_number = 0; track_number < tracks_.size(); ++track_number) {
+    if (song_) {
+        const auto  num_events = song_->header().num_events;
+        const auto* events     = song_->events();
+        while (song_pos_ < num_events && static_cast<int>(events[song_pos_].tick) == current_tick_) {
+            const auto& e = events[song_pos_++];
+            process_event(to_event(e), e.track);
+        }
+        ++current_tick_;
+        return;
+    }
+
+    if (lazy_tracks_) {
+        for (int track_number = 0; track_number < smf_.num_tracks; ++track_number) {
+            auto& t = lazy_tracks_[track_number];
+            while (t.pos < t.count || refill(track_number)) {
+                auto& e = t.window[t.pos];
+                assert(e.time >= current_tick_);
+                if (e.time > current_tick_) break;
+                ++t.pos;
+                process_event(e, track_number);
+            }
+        }
+        ++current_tick_;
+        return;
+    }
+
+    for (int track_number = 0; track_number < smf_.num_tracks; ++track_number) {
         auto& pos = track_pos_[track_number];
-        auto& track = tracks_[track_number];
-        while (pos < track.events.size()) {
+        auto& track = smf_.tracks[track_number];
+        while (pos < track.num_events) {
             auto& e = track.events[pos];
             if (e.time < current_tick_) assert(false);
             if (e.time > current_tick_) break;
             assert(e.time == current_tick_);
             ++pos;
+            process_event(e, track_number);
+        }
+    }
+    ++current_tick_;
+}
 
-            if (e.command < 0x100) {
-                const auto event_type    = e.command >> 4;
-                const auto channel_index = e.command & 0xf;
-                if (!channels_[channel_index]) {
-                    assert(false);
-                    continue;
-                }
-                auto& channel = *channels_[channel_index];
-
-                assert(event_type >= 8 && event_type <= 14);
-                switch (event_type) {
-                case 0x08: // Note off
-                    assert(e.data_size == 2);
-                    channel.note_off(convert_note(e.data[0]), e.data[1]);
-                    break;
-                case 0x09: // Note on
-                    assert(e.data_size == 2);
-                    channel.note_on(convert_note(e.data[0]), e.data[1]);
-                    break;
-                case 0x0A: // Key after-touch
-                    assert(e.data_size == 2);
-                    channel.polyphonic_key_pressure(convert_note(e.data[0]), e.data[1]);
-                    break;
-                case 0x0B: // Controller change
-                    assert(e.data_size == 2);
-                    if (e.data[0] < 120) {
-                        channel.controller_change(static_cast<controller_type>(e.data[0]), e.data[1]);
-                    } else if (e.data[0] == 120) {
-                        std::cout << "All sound off " << (int)e.data[1] << std::endl;
-                    } else if (e.data[0] == 121) {
-                        std::cout << "Reset all controllers " << (int)e.data[1] << std::endl;
-                    } else {
-                        std::cout << "Unsupported controller change " << (int)e.data[0] << " " << (int)e.data[1] << "\n";
-                        assert(false);
-                    }
-                    break;
-                case 0xC: // Program (patch) change
-                    assert(e.data_size == 1);
-                    channel.program_change(e.data[0]);
-                    break;
-                case 0xD: // Channel pressure (after-touch)
-                    assert(e.data_size == 1);
-                    assert(false);
-                    break;
-                case 0xE: // Pitch bend
-                    {
-                        assert(e.data_size == 2);
-                        constexpr int center = 0x2000;
-                        const int val = (e.data[0] << 7) | e.data[1];
-                        channel.pitch_bend(val < center ? val : center - val);
-                    }
-                    break;
-                default:
-                    std::cout << "Ignoring event " << event_type << std::endl;
-                    assert(false);
-                }
-                continue;
-            }
+// Decodes the next window of a lazy track, returns false if it has ended. A
+// track that turns out to be corrupt ends there, as the song is already playing.
+// Runs on the audio thread, so nothing is printed, the error is kept for report_errors.
+bool player::impl::refill(int track_number)
+{
+    auto& t = lazy_tracks_[track_number];
+    t.pos   = 0;
+    t.count = 0;
+    if (t.ended) return false;
+    try {
+        while (t.count < lazy_track::window_size && t.decoder.next(t.window[t.count], false)) {
+            ++t.count;
+        }
+    } catch (const std::runtime_error& e) {
+        if (failed_track_ < 0) {
+            failed_track_ = track_number;
+            strncpy(error_, e.what(), sizeof(error_) - 1);
+        }
+        t.ended = true;
+    }
+    if (t.count < lazy_track::window_size) {
+        t.ended = true;
+    }
+    return t.count > 0;
+}
 
-            // Meta event
-            assert(e.command>>8 == 0xff);
-            switch (e.command & 0xff) {
-            case 0x01: // FF 01 len text Text Event
-                std::cout << "Text " << std::string(e.data, e.data+e.data_size) << std::endl;
-                break;
-            case 0x02: // FF 02 len text Copyright Notice
-                std::cout << "Copyright " << std::string(e.data, e.data+e.data_size) << std::endl;
-                break;
-            case 0x03: // FF 03 len text Sequence/Track Name
-                std::cout << "Track name (" << track_number << ") " << std::string(e.data, e.data+e.data_size) << std::endl;
-                break;
-            case 0x20: // https://groups.google.com/forum/#!topic/comp.music.midi/_MIjgi-8xQQ
-            case 0x21:
-                assert(e.data_size == 1);
-                break;
-            case 0x2F: // FF 2F 00 End of Track
-                assert(e.data_size == 0);
-                std::cout << "End of track " << track_number << std::endl;
-                break;
-            case 0x51: // FF 51 03 tttttt Set Tempo (in microseconds per MIDI quarter-note)
-                {
-                    assert(e.data_size == 3);
-                    us_per_quater_note_ = (e.data[0]<<16) | (e.data[1]<<8) | e.data[2];
-                    std::cout << "Set tempo " << us_per_quater_note_ << " us/midi-quater-note" << std::endl;
-                }
-                break;
-            case 0x54: // FF 54 05 hr mn se fr ff SMPTE Offset
-                assert(e.data_size == 5);
-                std::cout << "Ignoring SMPTE Offset " << e << std::endl;
-                break;
-                break;
-            case 0x58: // FF 58 04 nn dd cc bb Time Signature
-                {
-                    // nn numerator
-                    // dd denominator, negative power of two: 2 represents a quarter-note, 3 represents an eighth-note, etc.
-                    // cc expresses the number of MIDI clocks in a metronome click
-                    // bb expresses the number of notated 32nd-notes in a MIDI quarter-note (24 MIDI clocks, 1 beat=6 MIDI clocks)
-                    assert(e.data_size == 4);
-                    std::cout << int(e.data[0]) << "/" << int(1 << e.data[1]) << " -- " << int(e.data[2]) << " clocks/click -- " << int(e.data[3]) << " 32nd notes in quater note" << std::endl;
-                }
-                break;
-            case 0x59: // FF 59 02 sf mi Key Signature
-                {
-                    assert(e.data_size == 2);
-                    std::cout << "Key Signature C + " << int(e.data[0]) << " sharps, " << (e.data[1] ? "minor" : "major") << std::endl;
-                }
-                break;
-            default:
-                std::cout << e << std::endl;
+void player::impl::process_event(const event& e, int track_number)
+{
+    if (e.command < 0x100) {
+        const auto event_type    = e.command >> 4;
+        const auto channel_index = e.command & 0xf;
+        if (!channels_[channel_index]) {
+            assert(false);
+            return;
+        }
+        auto& channel = *channels_[channel_index];
+
+        assert(event_type >= 8 && event_type <= 14);
+        switch (event_type) {
+        case 0x08: // Note off
+            assert(e.data_size == 2);
+            channel.note_off(convert_note(e.data[0]), e.data[1]);
+            break;
+        case 0x09: // Note on
+            assert(e.data_size == 2);
+            channel.note_on(convert_note(e.data[0]), e.data[1]);
+            break;
+        case 0x0A: // Key after-touch
+            assert(e.data_size == 2);
+            channel.polyphonic_key_pressure(convert_note(e.data[0]), e.data[1]);
+            break;
+        case 0x0B: // Controller change
+            assert(e.data_size == 2);
+            if (e.data[0] < 120 || e.data[0] == static_cast<uint8_t>(controller_type::all_sound_off) || e.data[0] == static_cast<uint8_t>(controller_type::all_notes_off)) {
+                channel.controller_change(static_cast<controller_type>(e.data[0]), e.data[1]);
+            } else if (e.data[0] == 121) {
+                std::cout << "Reset all controllers " << (int)e.data[1] << std::endl;
+            } else {
+                std::cout << "Unsupported controller change " << (int)e.data[0] << " " << (int)e.data[1] << "\n";
                 assert(false);
             }
+            break;
+        case 0xC: // Program (patch) change
+            assert(e.data_size == 1);
+            channel.program_change(e.data[0]);
+            break;
+        case 0xD: // Channel pressure (after-touch)
+            assert(e.data_size == 1);
+            channel.channel_pressure(e.data[0]);
+            break;
+        case 0xE: // Pitch bend
+            {
+                assert(e.data_size == 2);
+                constexpr int center = 0x2000;
+                const int val = (e.data[0] << 7) | e.data[1];
+                channel.pitch_bend(val < center ? val : center - val);
+            }
+            break;
+        default:
+            std::cout << "Ignoring event " << event_type << std::endl;
+            assert(false);
         }
+        return;
     }
-    ++current_tick_;
+
+    // Meta event
+    assert(e.command>>8 == 0xff);
+    switch (e.command & 0xff) {
+    case 0x01: // FF 01 len text Text Event
+        std::cout << "Text " << std::string(e.data, e.data+e.data_size) << std::endl;
+        break;
+    case 0x02: // FF 02 len text Copyright Notice
+        std::cout << "Copyright " << std::string(e.data, e.data+e.data_size) << std::endl;
+        break;
+    case 0x03: // FF 03 len text Sequence/Track Name
+        std::cout << "Track name (" << track_number << ") " << std::string(e.data, e.data+e.data_size) << std::endl;
+        break;
+    case 0x20: // https://groups.google.com/forum/#!topic/comp.music.midi/_MIjgi-8xQQ
+    case 0x21:
+        assert(e.data_size == 1);
+        break;
+    case 0x2F: // FF 2F 00 End of Track
+        assert(e.data_size == 0);
+        std::cout << "End of track " << track_number << std::endl;
+        break;
+    case 0x51: // FF 51 03 tttttt Set Tempo (in microseconds per MIDI quarter-note)
+        {
+            assert(e.data_size == 3);
+            us_per_quater_note_ = (e.data[0]<<16) | (e.data[1]<<8) | e.data[2];
+            std::cout << "Set tempo " << us_per_quater_note_ << " us/midi-quater-note" << std::endl;
+        }
+        break;
+    case 0x54: // FF 54 05 hr mn se fr ff SMPTE Offset
+        assert(e.data_size == 5);
+        std::cout << "Ignoring SMPTE Offset " << e << std::endl;
+        break;
+        break;
+    case 0x58: // FF 58 04 nn dd cc bb Time Signature
+        {
+            // nn numerator
+            // dd denominator, negative power of two: 2 represents a quarter-note, 3 represents an eighth-note, etc.
+            // cc expresses the number of MIDI clocks in a metronome click
+            // bb expresses the number of notated 32nd-notes in a MIDI quarter-note (24 MIDI clocks, 1 beat=6 MIDI clocks)
+            assert(e.data_size == 4);
+            std::cout << int(e.data[0]) << "/" << int(1 << e.data[1]) << " -- " << int(e.data[2]) << " clocks/click -- " << int(e.data[3]) << " 32nd notes in quater note" << std::endl;
+        }
+        break;
+    case 0x59: // FF 59 02 sf mi Key Signature
+        {
+            assert(e.data_size == 2);
+            std::cout << "Key Signature C + " << int(e.data[0]) << " sharps, " << (e.data[1] ? "minor" : "major") << std::endl;
+        }
+        break;
+    default:
+        std::cout << e << std::endl;
+        assert(false);
+    }
+}
+
+void player::impl::restore_channel(int index, const compiled::channel_state& cs)
+{
+    // General MIDI power-on state for what cs doesn't set
+    constexpr uint8_t default_program = 0, default_volume = 100, default_pan = 64;
+    auto ch = channels_[index];
+    if (!ch) return;
+    ch->program_change(cs.program != compiled::unset ? cs.program : default_program);
+    ch->controller_change(controller_type::volume, cs.volume != compiled::unset ? cs.volume : default_volume);
+    ch->controller_change(controller_type::pan, cs.pan != compiled::unset ? cs.pan : default_pan);
+    ch->controller_change(controller_type::modulation_wheel, cs.modulation_wheel != compiled::unset ? cs.modulation_wheel : 0);
+    ch->channel_pressure(cs.channel_pressure != compiled::unset ? cs.channel_pressure : 0);
+}
+
+void player::impl::seek(double seconds)
+{
+    if (!song_) {
+        throw std::runtime_error("Seeking is only supported for compiled songs");
+    }
+    const auto& h = song_->header();
+    const auto* events = song_->events();
+    const uint64_t target_us = seconds > 0.0 ? static_cast<uint64_t>(seconds * 1e6) : 0;
+
+    // Start from the last snapshot at or before the target, the first one is always at time 0
+    const auto* snapshots = song_->snapshots();
+    const auto* snap = std::upper_bound(snapshots, snapshots + h.num_snapshots, target_us, [](uint64_t t, const compiled::snapshot& s) { return t < s.time_us; }) - 1;
+    us_per_quater_note_ = snap->us_per_quater_note;
+    song_pos_           = snap->event_index;
+    for (int i = 0; i < max_channels; ++i) {
+        restore_channel(i, snap->channels[i]);
+    }
+
+    // Replay everything but notes up to the target
+    uint32_t tick    = snap->tick;
+    uint64_t time_us = snap->time_us;
+    while (time_us < target_us) {
+        for (; song_pos_ < h.num_events && events[song_pos_].tick == tick; ++song_pos_) {
+            const auto& e = events[song_pos_];
+            const int event_type = e.command >> 4;
+            if (e.command >= 0x100 || (event_type != 0x8 && event_type != 0x9 && event_type != 0xA)) {
+                process_event(to_event(e), e.track);
+            }
+        }
+        const uint64_t step = us_per_tick(us_per_quater_note_, division_);
+        uint64_t ticks = (target_us - time_us + step - 1) / step;
+        if (song_pos_ < h.num_events) {
+            ticks = std::min<uint64_t>(ticks, events[song_pos_].tick - tick);
+        }
+        tick    += static_cast<uint32_t>(ticks);
+        time_us += ticks * step;
+    }
+    current_tick_    = static_cast<int>(tick);
+    us_to_next_tick_ = static_cast<int>(time_us - target_us);
 }
 
-player::player(std::istream& in) : impl_(new impl(in))
+void player::impl::rewind()
+{
+    if (song_) {
+        seek(0.0);
+        return;
+    }
+    current_tick_       = 0;
+    us_to_next_tick_    = 0;
+    us_per_quater_note_ = 500000; // Until the song sets the tempo again
+    for (int i = 0; i < max_channels; ++i) {
+        restore_channel(i, unset_channel_state);
+    }
+    if (lazy_tracks_) {
+        // Decoding starts over in place, so this doesn't allocate
+        for (int track_number = 0; track_number < smf_.num_tracks; ++track_number) {
+            const auto chunk = lazy_tracks_[track_number].chunk;
+            new (&lazy_tracks_[track_number]) lazy_track{chunk};
+            refill(track_number);
+        }
+        return;
+    }
+    std::fill(track_pos_, track_pos_ + smf_.num_tracks, 0u);
+}
+
+player::player(std::istream& in) : impl_(new impl(read_song(in)))
+{
+}
+
+player::player(const char* data, size_t size) : impl_(new impl(read_song(data, size)))
+{
+}
+
+player::player(std::vector<char> data, decoding mode) : impl_(mode == decoding::lazy ? new impl(std::move(data)) : new impl(read_song(data.data(), data.size())))
+{
+}
+
+player::player(std::shared_ptr<const compiled_song> song) : impl_(new impl(std::move(song)))
 {
 }
 
@@ -412,4 +1066,39 @@ void player::advance_time(float seconds)
     impl_->advance_time(seconds);
 }
 
+bool player::finished() const
+{
+    return impl_->finished();
+}
+
+void player::report_errors(std::ostream& out) const
+{
+    impl_->report_errors(out);
+}
+
+size_t player::memory_usage() const
+{
+    return impl_->memory_usage();
+}
+
+int player::current_tick() const
+{
+    return impl_->current_tick();
+}
+
+float player::tempo() const
+{
+    return impl_->tempo();
+}
+
+void player::seek(double seconds)
+{
+    impl_->seek(seconds);
+}
+
+void player::rewind()
+{
+    impl_->rewind();
+}
+
 } } // namespace splay::midi
\ No newline at end of file
@@ -3,12 +3,18 @@
 
 #include <iosfwd>
 #include <memory>
+#include <string>
+#include <vector>
+#include <stddef.h>
 #include <stdint.h>
 #include "note.h"
 
+class mapped_file;
+
 namespace splay { namespace midi {
 
 constexpr int max_channels = 16;
+constexpr int drum_channel = 9; // General MIDI percussion (MIDI channel 10)
 
 // http://www.midi.org/techspecs/midimessages.php
 enum class controller_type : uint8_t {
@@ -22,29 +28,221 @@ enum class controller_type : uint8_t {
     effects3           = 0x5D, // Effects 3 Depth
     effects4           = 0x5E, // Effects 4 Depth
     effects5           = 0x5F, // Effects 5 Depth
-
+    all_sound_off      = 0x78, // All Sound Off (channel mode message)
+    all_notes_off      = 0x7B, // All Notes Off (channel mode message)
 };
 
 class channel {
 public:
-    virtual ~channel() = 0 {}
+    virtual ~channel() = 0;
 
     virtual void note_off(piano_key key, uint8_t velocity) = 0;
     virtual void note_on(piano_key key, uint8_t velocity) = 0;
     virtual void polyphonic_key_pressure(piano_key key, uint8_t pressure) = 0;
     virtual void controller_change(controller_type controller, uint8_t value) = 0;
     virtual void program_change(uint8_t program) = 0;
+    virtual void channel_pressure(uint8_t pressure) = 0;
     virtual void pitch_bend(int change) = 0;
 };
 
+inline channel::~channel() {
+}
+
+// Summary of a MIDI file gathered without building the event lists
+struct file_info {
+    int      format         = 0;
+    int      tracks         = 0;
+    int      division       = 0;    // Raw header division (ticks per quarter-note unless bit 15 is set)
+    uint64_t events         = 0;
+    uint64_t notes          = 0;    // Note-on events with non-zero velocity
+    int      tempo_changes  = 0;
+    uint16_t channel_mask   = 0;    // Bit n set if channel n is used
+    uint32_t length_ticks   = 0;
+    double   duration       = 0.0;  // Seconds, following the tempo map
+};
+
+// Scans a complete Standard MIDI File held in memory
+file_info scan(const char* data, size_t size);
+
+// Precompiled song format. A MIDI file is compiled once into the merged
+// absolute-time event stream, the tempo map, seek snapshots and metadata, stored
+// in a flat, versioned layout that is used directly from a memory mapping.
+//
+// All values are little-endian and the arrays are used in place, so compiled
+// songs can only be made and loaded on little-endian hosts (others refuse to,
+// rather than byte swap). The header is followed by the event,
+// tempo change and snapshot arrays at the offsets it records, each 8-byte aligned.
+// Event times are in ticks, wall clock times in microseconds following the
+// player's timing (a whole number of microseconds per tick).
+namespace compiled {
+
+constexpr uint32_t magic   = 0x434C5053; // 'SPLC'
+constexpr uint32_t version = 1;
+
+constexpr uint8_t unset = 0xff;
+
+struct header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t header_size;
+    int32_t  division;          // Ticks per quarter-note
+    uint32_t num_tracks;
+    uint32_t num_events;
+    uint32_t num_tempo_changes;
+    uint32_t num_snapshots;
+    uint64_t file_size;
+    uint64_t events_offset;
+    uint64_t tempo_changes_offset;
+    uint64_t snapshots_offset;
+    // Metadata
+    uint64_t notes;             // Note-on events with non-zero velocity
+    uint32_t length_ticks;
+    uint16_t channel_mask;      // Bit n set if channel n is used
+    uint16_t reserved;
+    double   duration;          // Seconds
+};
+
+// Events are sorted by tick, events of the same tick by track
+struct event {
+    uint32_t tick;
+    uint16_t track;
+    uint16_t command;           // Status byte of channel messages, 0xFF00 | type for meta events
+    uint8_t  data_size;
+    uint8_t  data[15];
+};
+
+struct tempo_change {
+    uint32_t tick;
+    uint32_t us_per_quater_note;
+    uint64_t time_us;
+};
+
+// Channel state set by non-note events, unset when no event has been seen yet
+struct channel_state {
+    uint8_t program;
+    uint8_t volume;
+    uint8_t pan;
+    uint8_t modulation_wheel;
+    uint8_t channel_pressure;
+    uint8_t reserved[3];
+};
+
+// Player state before the first event at tick, taken every few seconds
+struct snapshot {
+    uint32_t      tick;
+    uint32_t      event_index;
+    uint32_t      us_per_quater_note;
+    uint32_t      reserved;
+    uint64_t      time_us;
+    channel_state channels[max_channels];
+};
+
+static_assert(sizeof(header) == 88, "Compiled song layout changed");
+static_assert(sizeof(event) == 24, "Compiled song layout changed");
+static_assert(sizeof(tempo_change) == 16, "Compiled song layout changed");
+static_assert(sizeof(snapshot) == 152, "Compiled song layout changed");
+
+} // namespace compiled
+
+class compiled_song {
+public:
+    ~compiled_song();
+
+    // Parses a Standard MIDI File and builds the compiled image in memory
+    static std::shared_ptr<const compiled_song> compile(std::istream& in);
+
+    // Maps a compiled song file. Only the header is validated, nothing is parsed.
+    static std::shared_ptr<const compiled_song> load(const std::string& filename);
+
+    void save(const std::string& filename) const;
+
+    // Heap memory used, in bytes (a mapped file isn't counted)
+    size_t memory_usage() const;
+
+    const compiled::header& header() const {
+        return *reinterpret_cast<const compiled::header*>(data_);
+    }
+
+    const compiled::event* events() const {
+        return section<compiled::event>(header().events_offset);
+    }
+
+    const compiled::tempo_change* tempo_changes() const {
+        return section<compiled::tempo_change>(header().tempo_changes_offset);
+    }
+
+    const compiled::snapshot* snapshots() const {
+        return section<compiled::snapshot>(header().snapshots_offset);
+    }
+
+private:
+    compiled_song();
+
+    std::vector<uint64_t>        image_; // Backing storage when compiled in memory
+    std::unique_ptr<mapped_file> file_;  // Backing storage when loaded
+    const char*                  data_ = nullptr;
+    size_t                       size_ = 0;
+
+    void validate() const;
+
+    template<typename T>
+    const T* section(uint64_t offset) const {
+        return reinterpret_cast<const T*>(data_ + offset);
+    }
+};
+
+// Returns true if filename looks like a compiled song (by extension)
+bool is_compiled_song_filename(const std::string& filename);
+
+// How a player decodes a Standard MIDI File: all of it when created, or each
+// track a window of events at a time just ahead of playback. Lazy decoding
+// starts large files immediately, but errors past the first window end the
+// track instead of failing the load.
+enum class decoding {
+    eager,
+    lazy,
+};
+
 class player {
 public:
     explicit player(std::istream& in);
+    explicit player(const char* data, size_t size); // Standard MIDI File in memory
+    explicit player(std::vector<char> data, decoding mode);
+    explicit player(std::shared_ptr<const compiled_song> song);
     ~player();
 
+    // Puts ch in the General MIDI power-on state (see seek) and plays the events of
+    // channel index on it, so rewinding starts the song just like the first time
     void set_channel(int index, channel& ch);
     void advance_time(float seconds);
 
+    // True when all events of all tracks have been played
+    bool finished() const;
+
+    // Prints the first error found decoding a lazily decoded song, a corrupt track is
+    // ended there. The player records it while playing, so call this once it's handed
+    // to a thread that isn't rendering, e.g. when it's done.
+    void report_errors(std::ostream& out) const;
+
+    // Heap memory used by the song data and player state, in bytes
+    size_t memory_usage() const;
+
+    // Position in ticks (of the song's division) and the current tempo in quarter notes per minute
+    int current_tick() const;
+    float tempo() const;
+
+    // Jumps to seconds into a compiled song. Channel state (program, controllers)
+    // is restored from the nearest snapshot and the non-note events following it,
+    // what the song hasn't set by then is reset to the General MIDI power-on
+    // state (program 0, volume 100, pan 64, no modulation or pressure). Notes
+    // already sounding are left to the caller.
+    void seek(double seconds);
+
+    // Starts over from the beginning of the song, for any kind of song. Like seek,
+    // channels are reset to the power-on state and notes already sounding are
+    // left to the caller.
+    void rewind();
+
 private:
     class impl;
     std::unique_ptr<impl> impl_;
@@ -0,0 +1,118 @@
+#ifndef SPLAY_MODULATION_H
+#define SPLAY_MODULATION_H
+
+#include <cassert>
+#include <cmath>
+#include <vector>
+#include "constants.h"
+
+namespace splay {
+
+// Modulation is evaluated at control rate, i.e. once per block of (at most) block_size samples.
+// The destinations are then interpolated across the block by the voices.
+
+enum class mod_source { lfo1, modulation_wheel, channel_pressure, key_pressure };
+constexpr int mod_source_count = static_cast<int>(mod_source::key_pressure) + 1;
+
+enum class mod_destination { pitch, cutoff, amplitude };
+constexpr int mod_destination_count = static_cast<int>(mod_destination::amplitude) + 1;
+
+// Low frequency (sine) oscillator, output in [-1; 1]
+class lfo {
+public:
+    explicit lfo(float freq) : freq_(freq) {
+    }
+
+    // Returns the value at the start of the block and advances to the next block
+    float operator()(int count) {
+        const float val = sin(2.0f * pi * t_);
+        t_ += freq_ * count / samplerate;
+        t_ -= floor(t_);
+        return val;
+    }
+
+private:
+    float freq_;
+    float t_ = 0.0f;
+};
+
+struct mod_route {
+    mod_source      source;
+    mod_destination destination;
+    float           depth;      // Semitones for pitch, octaves for cutoff, gain for amplitude
+    mod_source      scale;      // The contribution is further scaled by this source...
+    bool            has_scale;  // ...if this is set
+};
+
+// Sum of all routes to each destination
+struct mod_values {
+    float pitch     = 0.0f; // Semitones
+    float cutoff    = 0.0f; // Octaves
+    float amplitude = 0.0f; // Added to unity gain
+
+    float pitch_scale() const {
+        return pow(2.0f, pitch / 12.0f);
+    }
+
+    float cutoff_scale() const {
+        return pow(2.0f, cutoff);
+    }
+
+    float gain() const {
+        return amplitude > -1.0f ? 1.0f + amplitude : 0.0f;
+    }
+};
+
+class modulation_matrix {
+public:
+    // Sets a controller source, value in [0; 1]
+    void source(mod_source s, float value) {
+        assert(s != mod_source::lfo1 && s != mod_source::key_pressure);
+        assert(value >= 0.0f && value <= 1.0f);
+        sources_[static_cast<int>(s)] = value;
+    }
+
+    // Must be called once at the start of each block before evaluating
+    void begin_block(int count) {
+        sources_[static_cast<int>(mod_source::lfo1)] = lfo1_(count);
+    }
+
+    mod_values evaluate(float key_pressure) const {
+        mod_values v;
+        for (const auto& r : routes_) {
+            const float c = contribution(r, key_pressure);
+            switch (r.destination) {
+            case mod_destination::pitch:     v.pitch     += c; break;
+            case mod_destination::cutoff:    v.cutoff    += c; break;
+            case mod_destination::amplitude: v.amplitude += c; break;
+            }
+        }
+        return v;
+    }
+
+private:
+    lfo                    lfo1_{5.5f};
+    float                  sources_[mod_source_count] = {};
+    // Vibrato by modulation wheel or aftertouch, brightness and loudness by aftertouch
+    std::vector<mod_route> routes_ = {
+        {mod_source::lfo1, mod_destination::pitch, 0.5f, mod_source::modulation_wheel, true},
+        {mod_source::lfo1, mod_destination::pitch, 0.5f, mod_source::channel_pressure, true},
+        {mod_source::channel_pressure, mod_destination::cutoff, 1.0f, mod_source::lfo1, false},
+        {mod_source::key_pressure, mod_destination::cutoff, 1.0f, mod_source::lfo1, false},
+        {mod_source::key_pressure, mod_destination::amplitude, 0.5f, mod_source::lfo1, false},
+    };
+
+    float value(mod_source s, float key_pressure) const {
+        return s == mod_source::key_pressure ? key_pressure : sources_[static_cast<int>(s)];
+    }
+
+    float contribution(const mod_route& r, float key_pressure) const {
+        float c = r.depth * value(r.source, key_pressure);
+        if (r.has_scale) c *= value(r.scale, key_pressure);
+        return c;
+    }
+};
+
+} // namespace splay
+
+#endif
@@ -0,0 +1,195 @@
+#include "overview.h"
+#include <algorithm>
+#include <istream>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <assert.h>
+#include <math.h>
+
+namespace splay {
+
+namespace {
+
+constexpr uint32_t overview_magic   = 0x564F5053; // 'SPOV'
+constexpr uint32_t overview_version = 1;
+
+const overview_bin empty_bin{1.0f, -1.0f, 0.0f};
+
+overview_bin combine(const overview_bin& a, const overview_bin& b)
+{
+    return { std::min(a.min, b.min), std::max(a.max, b.max), a.sum_squares + b.sum_squares };
+}
+
+template<typename T>
+void write_raw(std::ostream& out, const T& val)
+{
+    out.write(reinterpret_cast<const char*>(&val), sizeof(T));
+}
+
+template<typename T>
+T read_raw(std::istream& in)
+{
+    T val;
+    in.read(reinterpret_cast<char*>(&val), sizeof(T));
+    if (!in) throw std::runtime_error("Unexpected end of waveform overview");
+    return val;
+}
+
+} // unnamed namespace
+
+float overview_bin::rms(size_t samples) const
+{
+    return samples ? sqrt(sum_squares / samples) : 0.0f;
+}
+
+waveform_overview::waveform_overview(uint32_t samples_per_bin) : samples_per_bin_(samples_per_bin), partial_(empty_bin)
+{
+    assert(samples_per_bin > 0);
+}
+
+void waveform_overview::append(const short* samples, size_t count)
+{
+    for (size_t i = 0; i < count; ++i) {
+        const float s = samples[i] * (1.0f / 32768.0f);
+        partial_.min = std::min(partial_.min, s);
+        partial_.max = std::max(partial_.max, s);
+        partial_.sum_squares += s * s;
+        if (++partial_count_ == samples_per_bin_) {
+            add_bin(partial_);
+            partial_       = empty_bin;
+            partial_count_ = 0;
+        }
+    }
+}
+
+void waveform_overview::append_silence(size_t count)
+{
+    while (count) {
+        const size_t n = std::min<size_t>(count, samples_per_bin_ - partial_count_);
+        partial_.min = std::min(partial_.min, 0.0f);
+        partial_.max = std::max(partial_.max, 0.0f);
+        partial_count_ += static_cast<uint32_t>(n);
+        count -= n;
+        if (partial_count_ == samples_per_bin_) {
+            add_bin(partial_);
+            partial_       = empty_bin;
+            partial_count_ = 0;
+        }
+    }
+}
+
+void waveform_overview::add_bin(const overview_bin& b)
+{
+    // Whenever a level gets an even number of bins, the last two are combined into the next level
+    overview_bin carry = b;
+    for (size_t level = 0; ; ++level) {
+        if (level == levels_.size()) {
+            levels_.emplace_back();
+        }
+        auto& bins = levels_[level];
+        bins.push_back(carry);
+        if (bins.size() % 2) {
+            break;
+        }
+        carry = combine(bins[bins.size() - 2], bins[bins.size() - 1]);
+    }
+}
+
+void waveform_overview::query(uint64_t first, uint64_t last, int columns, overview_bin* out) const
+{
+    assert(first <= last && columns > 0);
+    last = std::min(last, sample_count());
+    if (first >= last) {
+        std::fill(out, out + columns, overview_bin{0.0f, 0.0f, 0.0f});
+        return;
+    }
+
+    // Use the coarsest level with at least one bin per column
+    const uint64_t samples_per_column = std::max<uint64_t>(1, (last - first) / columns);
+    size_t level = 0;
+    while (level + 1 < levels_.size() && bin_size(level + 1) <= samples_per_column) {
+        ++level;
+    }
+    for (int c = 0; c < columns; ++c) {
+        const uint64_t col_first = first + (last - first) * c / columns;
+        const uint64_t col_last  = std::max(col_first + 1, first + (last - first) * (c + 1) / columns);
+        uint64_t samples = 0;
+        auto res = summarize(level, col_first, col_last, samples);
+        if (res.min > res.max) {
+            out[c] = overview_bin{0.0f, 0.0f, 0.0f};
+            continue;
+        }
+        // Scale the sum of squares to the column width, so rms() can be used with (col_last - col_first)
+        res.sum_squares *= static_cast<float>(col_last - col_first) / samples;
+        out[c] = res;
+    }
+}
+
+overview_bin waveform_overview::summarize(size_t level, uint64_t first, uint64_t last, uint64_t& samples) const
+{
+    // Higher levels don't cover the last (odd) bins of the level below, so fall back to finer levels there
+    const auto& bins = levels_[level];
+    const uint64_t size    = bin_size(level);
+    const uint64_t covered = bins.size() * size;
+    overview_bin res = empty_bin;
+    for (uint64_t b = first / size, e = std::min<uint64_t>(bins.size(), (last + size - 1) / size); b < e; ++b) {
+        res = combine(res, bins[static_cast<size_t>(b)]);
+        samples += size;
+    }
+    if (last > covered && level > 0) {
+        res = combine(res, summarize(level - 1, std::max(first, covered), last, samples));
+    }
+    return res;
+}
+
+void waveform_overview::save(std::ostream& out) const
+{
+    write_raw(out, overview_magic);
+    write_raw(out, overview_version);
+    write_raw(out, samples_per_bin_);
+    write_raw(out, static_cast<uint32_t>(levels_.size()));
+    for (const auto& bins : levels_) {
+        write_raw(out, static_cast<uint64_t>(bins.size()));
+        out.write(reinterpret_cast<const char*>(bins.data()), bins.size() * sizeof(overview_bin));
+    }
+}
+
+waveform_overview waveform_overview::load(std::istream& in)
+{
+    if (read_raw<uint32_t>(in) != overview_magic) {
+        throw std::runtime_error("Not a waveform overview");
+    }
+    const auto version = read_raw<uint32_t>(in);
+    if (version != overview_version) {
+        throw std::runtime_error("Unsupported waveform overview version " + std::to_string(version));
+    }
+    const auto samples_per_bin = read_raw<uint32_t>(in);
+    const auto level_count     = read_raw<uint32_t>(in);
+    if (!samples_per_bin || level_count > 64) {
+        throw std::runtime_error("Invalid waveform overview");
+    }
+    waveform_overview res{samples_per_bin};
+    res.levels_.resize(level_count);
+    for (uint32_t level = 0; level < level_count; ++level) {
+        // Level 0 gives the sample count, every following level is half the one below, down to a single bin
+        const auto count = read_raw<uint64_t>(in);
+        const bool valid = level ? count == res.levels_[level - 1].size() / 2
+                                 : count && count <= UINT64_MAX / samples_per_bin && count <= SIZE_MAX / sizeof(overview_bin);
+        if (!valid || (level + 1 == level_count) != (count == 1)) {
+            throw std::runtime_error("Invalid waveform overview");
+        }
+        // Grown as read, so a truncated file can't make us allocate what it claims
+        auto& bins = res.levels_[level];
+        constexpr size_t chunk = 1 << 16;
+        while (bins.size() < count) {
+            const size_t n = static_cast<size_t>(std::min<uint64_t>(chunk, count - bins.size()));
+            bins.resize(bins.size() + n);
+            in.read(reinterpret_cast<char*>(bins.data() + bins.size() - n), n * sizeof(overview_bin));
+            if (!in) throw std::runtime_error("Unexpected end of waveform overview");
+        }
+    }
+    return res;
+}
+
+} // namespace splay
@@ -0,0 +1,57 @@
+#ifndef SPLAY_OVERVIEW_H
+#define SPLAY_OVERVIEW_H
+
+#include <iosfwd>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace splay {
+
+struct overview_bin {
+    float min;
+    float max;
+    float sum_squares;
+    float rms(size_t samples) const;
+};
+
+// Multi-resolution min/max/RMS summary of a (mono) signal. Level 0 summarises
+// samples_per_bin samples per bin, each following level halves the resolution.
+// Built incrementally while audio is rendered, so any range and zoom level can
+// be drawn in time proportional to the number of columns.
+class waveform_overview {
+public:
+    explicit waveform_overview(uint32_t samples_per_bin = 64);
+
+    void append(const short* samples, size_t count);
+
+    // Same as appending count zero samples
+    void append_silence(size_t count);
+
+    // Number of samples covered by complete level 0 bins
+    uint64_t sample_count() const {
+        return levels_.empty() ? 0 : levels_[0].size() * samples_per_bin_;
+    }
+
+    // Summarises samples [first; last) into columns bins (min, max, rms)
+    void query(uint64_t first, uint64_t last, int columns, overview_bin* out) const;
+
+    void save(std::ostream& out) const;
+    static waveform_overview load(std::istream& in);
+
+private:
+    uint32_t                               samples_per_bin_;
+    std::vector<std::vector<overview_bin>> levels_;
+    overview_bin                           partial_;
+    uint32_t                               partial_count_ = 0;
+
+    void add_bin(const overview_bin& b);
+    overview_bin summarize(size_t level, uint64_t first, uint64_t last, uint64_t& samples) const;
+    uint64_t bin_size(size_t level) const {
+        return static_cast<uint64_t>(samples_per_bin_) << level;
+    }
+};
+
+} // namespace splay
+
+#endif
@@ -0,0 +1,262 @@
+#include "pcm_ring.h"
+#include <algorithm>
+#include <new>
+#include <stdexcept>
+#include <string.h>
+#include <assert.h>
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+constexpr uint32_t header_size = sizeof(pcm_ring_header);
+
+// Named shared memory, created by the producer and opened by the consumer
+class shared_memory {
+public:
+    shared_memory(const std::string& name, size_t size, bool create) : name_(os_name(name)), create_(create) {
+#ifdef _WIN32
+        if (create) {
+            mapping_ = CreateFileMappingA(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, static_cast<DWORD>(static_cast<uint64_t>(size) >> 32), static_cast<DWORD>(size), name_.c_str());
+        } else {
+            mapping_ = OpenFileMappingA(FILE_MAP_READ | FILE_MAP_WRITE, FALSE, name_.c_str());
+        }
+        data_ = mapping_ ? MapViewOfFile(mapping_, FILE_MAP_READ | FILE_MAP_WRITE, 0, 0, size) : nullptr;
+        if (!data_) {
+            const auto err = GetLastError();
+            if (mapping_) CloseHandle(mapping_);
+            throw std::runtime_error("Mapping shared memory " + name_ + " failed: " + std::to_string(err));
+        }
+        if (!create) {
+            MEMORY_BASIC_INFORMATION info;
+            size = VirtualQuery(data_, &info, sizeof(info)) ? info.RegionSize : 0;
+        }
+#else
+        const int fd = create ? shm_open(name_.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644) : shm_open(name_.c_str(), O_RDWR, 0);
+        if (fd < 0) {
+            throw std::runtime_error("Could not open shared memory " + name_);
+        }
+        if (!create) {
+            struct stat st;
+            size = fstat(fd, &st) == 0 ? static_cast<size_t>(st.st_size) : 0;
+        } else if (ftruncate(fd, static_cast<off_t>(size)) != 0) {
+            size = 0;
+        }
+        data_ = size ? mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+        close(fd);
+        if (data_ == MAP_FAILED) {
+            if (create) shm_unlink(name_.c_str());
+            throw std::runtime_error("Mapping shared memory " + name_ + " failed");
+        }
+#endif
+        size_ = size;
+    }
+
+    ~shared_memory() {
+#ifdef _WIN32
+        UnmapViewOfFile(data_);
+        CloseHandle(mapping_);
+#else
+        munmap(data_, size_);
+        if (create_) shm_unlink(name_.c_str());
+#endif
+    }
+
+    shared_memory(const shared_memory&) = delete;
+    shared_memory& operator=(const shared_memory&) = delete;
+
+    void* data() const {
+        return data_;
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+private:
+    std::string name_;
+    bool        create_;
+#ifdef _WIN32
+    HANDLE      mapping_ = nullptr;
+#endif
+    void*       data_ = nullptr;
+    size_t      size_ = 0;
+
+    static std::string os_name(const std::string& name) {
+#ifdef _WIN32
+        return "Local\\" + name;
+#else
+        return name.empty() || name[0] != '/' ? "/" + name : name;
+#endif
+    }
+};
+
+size_t ring_size(uint32_t capacity, uint32_t channels)
+{
+    return header_size + static_cast<size_t>(capacity) * channels * sizeof(short);
+}
+
+} // unnamed namespace
+
+class pcm_ring_writer::impl {
+public:
+    impl(const std::string& name, unsigned sample_rate, int channels, uint32_t capacity)
+        : memory_(name, ring_size(capacity, channels), true)
+        , header_(new (memory_.data()) pcm_ring_header{}) {
+        assert(channels > 0);
+        if (!capacity || (capacity & (capacity - 1))) {
+            throw std::runtime_error("PCM ring capacity must be a power of two");
+        }
+        header_->header_size     = header_size;
+        header_->sample_rate     = sample_rate;
+        header_->channels        = static_cast<uint32_t>(channels);
+        header_->bits_per_sample = 16;
+        header_->capacity        = capacity;
+        header_->producer_active.store(1);
+        samples_ = reinterpret_cast<short*>(static_cast<char*>(memory_.data()) + header_size);
+        // Consumers check the magic last, so they never see a half initialized header
+        header_->version = pcm_ring_header::version_value;
+        std::atomic_thread_fence(std::memory_order_release);
+        header_->magic   = pcm_ring_header::magic_value;
+    }
+
+    ~impl() {
+        header_->producer_active.store(0, std::memory_order_release);
+    }
+
+    const pcm_ring_header& header() const {
+        return *header_;
+    }
+
+    size_t write(const short* frames, size_t count) {
+        const uint64_t capacity = header_->capacity;
+        const uint64_t write_pos = header_->write_pos.load(std::memory_order_relaxed);
+        const uint64_t read_pos  = header_->read_pos.load(std::memory_order_acquire);
+        const size_t n = static_cast<size_t>(std::min<uint64_t>(count, capacity - (write_pos - read_pos)));
+        const size_t channels = header_->channels;
+        // Copy in at most two parts, around the end of the ring
+        const size_t start = static_cast<size_t>(write_pos & (capacity - 1));
+        const size_t part1 = std::min<size_t>(n, static_cast<size_t>(capacity) - start);
+        memcpy(samples_ + start * channels, frames, part1 * channels * sizeof(short));
+        memcpy(samples_, frames + part1 * channels, (n - part1) * channels * sizeof(short));
+        header_->write_pos.store(write_pos + n, std::memory_order_release);
+        if (n < count) {
+            header_->overruns.fetch_add(count - n, std::memory_order_relaxed);
+        }
+        return n;
+    }
+
+private:
+    shared_memory    memory_;
+    pcm_ring_header* header_;
+    short*           samples_;
+};
+
+class pcm_ring_reader::impl {
+public:
+    explicit impl(const std::string& name) : memory_(name, 0, false), header_(static_cast<pcm_ring_header*>(memory_.data())) {
+        if (memory_.size() < header_size || header_->magic != pcm_ring_header::magic_value || header_->version != pcm_ring_header::version_value) {
+            throw std::runtime_error("Not a PCM ring: " + name);
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (memory_.size() < ring_size(header_->capacity, header_->channels)) {
+            throw std::runtime_error("Truncated PCM ring: " + name);
+        }
+        samples_ = reinterpret_cast<const short*>(static_cast<const char*>(memory_.data()) + header_->header_size);
+    }
+
+    const pcm_ring_header& header() const {
+        return *header_;
+    }
+
+    size_t available() const {
+        return static_cast<size_t>(header_->write_pos.load(std::memory_order_acquire) - header_->read_pos.load(std::memory_order_relaxed));
+    }
+
+    std::pair<const short*, size_t> peek(size_t max_frames) const {
+        const uint64_t capacity = header_->capacity;
+        const uint64_t read_pos = header_->read_pos.load(std::memory_order_relaxed);
+        const size_t start = static_cast<size_t>(read_pos & (capacity - 1));
+        const size_t n = std::min({max_frames, available(), static_cast<size_t>(capacity) - start});
+        return {samples_ + start * header_->channels, n};
+    }
+
+    void consume(size_t frames) {
+        assert(frames <= available());
+        header_->read_pos.fetch_add(frames, std::memory_order_release);
+    }
+
+    size_t read(short* out, size_t max_frames) {
+        size_t total = 0;
+        while (total < max_frames) {
+            const auto part = peek(max_frames - total);
+            if (!part.second) break;
+            memcpy(out + total * header_->channels, part.first, part.second * header_->channels * sizeof(short));
+            consume(part.second);
+            total += part.second;
+        }
+        if (total < max_frames) {
+            header_->underruns.fetch_add(1, std::memory_order_relaxed);
+        }
+        return total;
+    }
+
+private:
+    shared_memory    memory_;
+    pcm_ring_header* header_;
+    const short*     samples_ = nullptr;
+};
+
+pcm_ring_writer::pcm_ring_writer(const std::string& name, unsigned sample_rate, int channels, uint32_t capacity) : impl_(new impl(name, sample_rate, channels, capacity))
+{
+}
+
+pcm_ring_writer::~pcm_ring_writer() = default;
+
+const pcm_ring_header& pcm_ring_writer::header() const
+{
+    return impl_->header();
+}
+
+size_t pcm_ring_writer::write(const short* frames, size_t count)
+{
+    return impl_->write(frames, count);
+}
+
+pcm_ring_reader::pcm_ring_reader(const std::string& name) : impl_(new impl(name))
+{
+}
+
+pcm_ring_reader::~pcm_ring_reader() = default;
+
+const pcm_ring_header& pcm_ring_reader::header() const
+{
+    return impl_->header();
+}
+
+size_t pcm_ring_reader::available() const
+{
+    return impl_->available();
+}
+
+std::pair<const short*, size_t> pcm_ring_reader::peek(size_t max_frames) const
+{
+    return impl_->peek(max_frames);
+}
+
+void pcm_ring_reader::consume(size_t frames)
+{
+    impl_->consume(frames);
+}
+
+size_t pcm_ring_reader::read(short* out, size_t max_frames)
+{
+    return impl_->read(out, max_frames);
+}
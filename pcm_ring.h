@@ -0,0 +1,94 @@
+#ifndef PCM_RING_H_INCLUDED
+#define PCM_RING_H_INCLUDED
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <utility>
+#include <stddef.h>
+#include <stdint.h>
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "The ring cursors must be lock free to be shared between processes");
+
+// Layout of a PCM ring in shared memory (POSIX shm_open("/<name>"), on Windows
+// the file mapping "Local\<name>"). The header is followed by capacity frames
+// of interleaved signed 16-bit little-endian samples at offset header_size.
+//
+// Single producer, single consumer. Frame i (counting from the start of the
+// stream) is stored at ring index i % capacity. The producer writes frames and
+// then publishes them by advancing write_pos (release). The consumer reads
+// write_pos (acquire), uses the frames in place and releases them by advancing
+// read_pos. The producer never waits: frames that don't fit are dropped and
+// added to overruns.
+struct pcm_ring_header {
+    static constexpr uint32_t magic_value   = 0x52505053; // 'SPPR'
+    static constexpr uint32_t version_value = 1;
+
+    uint32_t magic;
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t sample_rate;
+    uint32_t channels;
+    uint32_t bits_per_sample;
+    uint32_t capacity;          // Frames, a power of two
+    uint32_t reserved;
+
+    // Written by the producer
+    alignas(64) std::atomic<uint64_t> write_pos;        // Frames written since the start
+    std::atomic<uint64_t>             overruns;         // Frames dropped because the ring was full
+    std::atomic<uint32_t>             producer_active;  // Cleared when the producer closes the ring
+
+    // Written by the consumer
+    alignas(64) std::atomic<uint64_t> read_pos;         // Frames consumed since the start
+    std::atomic<uint64_t>             underruns;        // Reads that found fewer frames than requested
+};
+static_assert(sizeof(pcm_ring_header) == 192, "pcm_ring_header layout is shared with other processes");
+
+// Producer side, creates (and on destruction removes) the shared memory
+class pcm_ring_writer {
+public:
+    explicit pcm_ring_writer(const std::string& name, unsigned sample_rate, int channels = 2, uint32_t capacity = 1 << 16);
+    ~pcm_ring_writer();
+
+    pcm_ring_writer(const pcm_ring_writer&) = delete;
+    pcm_ring_writer& operator=(const pcm_ring_writer&) = delete;
+
+    const pcm_ring_header& header() const;
+
+    // Copies count frames to the ring without blocking or allocating, returns the number of frames written
+    size_t write(const short* frames, size_t count);
+
+private:
+    class impl;
+    std::unique_ptr<impl> impl_;
+};
+
+// Consumer side of an existing ring
+class pcm_ring_reader {
+public:
+    explicit pcm_ring_reader(const std::string& name);
+    ~pcm_ring_reader();
+
+    pcm_ring_reader(const pcm_ring_reader&) = delete;
+    pcm_ring_reader& operator=(const pcm_ring_reader&) = delete;
+
+    const pcm_ring_header& header() const;
+
+    // Frames ready to be consumed
+    size_t available() const;
+
+    // Up to max_frames of the available frames that are contiguous in the ring, to be used in place
+    std::pair<const short*, size_t> peek(size_t max_frames) const;
+
+    // Releases frames obtained with peek
+    void consume(size_t frames);
+
+    // Copies up to max_frames frames to out, returns the number copied
+    size_t read(short* out, size_t max_frames);
+
+private:
+    class impl;
+    std::unique_ptr<impl> impl_;
+};
+
+#endif
@@ -0,0 +1,237 @@
+#include "percussion.h"
+#include <algorithm>
+#include <cmath>
+
+namespace splay {
+
+namespace {
+
+constexpr float silence_level = 0.0001f; // -80 dB
+constexpr float choke_time    = 0.005f;
+
+// Per sample multiplier fading from 1 to silence_level in length seconds
+float decay_multiplier(float length)
+{
+    return pow(silence_level, 1.0f / (length * samplerate));
+}
+
+constexpr auto lp = filter_type::lowpass;
+constexpr auto bp = filter_type::bandpass;
+constexpr auto hp = filter_type::highpass;
+
+constexpr int first_gm_drum = 35;
+
+//                                tone                                    noise
+//                                freq     end     sweep  decay  level      cutoff   decay  level choke
+const drum_sound gm_drums[] = {
+    /* 35 Acoustic Bass Drum */ {  60.0f,  40.0f, 0.05f, 0.50f, 1.0f, lp,   300.0f, 0.02f, 0.3f, 0 },
+    /* 36 Bass Drum 1        */ {  75.0f,  45.0f, 0.04f, 0.45f, 1.0f, lp,   500.0f, 0.02f, 0.3f, 0 },
+    /* 37 Side Stick         */ { 800.0f, 800.0f, 0.00f, 0.04f, 0.4f, bp,  2500.0f, 0.03f, 0.5f, 0 },
+    /* 38 Acoustic Snare     */ { 190.0f, 170.0f, 0.05f, 0.15f, 0.6f, bp,  3500.0f, 0.25f, 0.8f, 0 },
+    /* 39 Hand Clap          */ {   0.0f,   0.0f, 0.00f, 0.01f, 0.0f, bp,  1200.0f, 0.15f, 1.0f, 0 },
+    /* 40 Electric Snare     */ { 220.0f, 180.0f, 0.03f, 0.12f, 0.5f, hp,  2000.0f, 0.20f, 0.8f, 0 },
+    /* 41 Low Floor Tom      */ {  90.0f,  70.0f, 0.10f, 0.50f, 0.9f, lp,   800.0f, 0.05f, 0.2f, 0 },
+    /* 42 Closed Hi-Hat      */ {   0.0f,   0.0f, 0.00f, 0.01f, 0.0f, hp,  7000.0f, 0.06f, 0.6f, 1 },
+    /* 43 High Floor Tom     */ { 110.0f,  85.0f, 0.10f, 0.45f, 0.9f, lp,   900.0f, 0.05f, 0.2f, 0 },
+    /* 44 Pedal Hi-Hat       */ {   0.0f,   0.0f, 0.00f, 0.01f, 0.0f, hp,  6000.0f, 0.08f, 0.5f, 1 },
+    /* 45 Low Tom            */ { 130.0f, 100.0f, 0.10f, 0.40f, 0.9f, lp,  1000.0f, 0.05f, 0.2f, 0 },
+    /* 46 Open Hi-Hat        */ {   0.0f,   0.0f, 0.00f, 0.01f, 0.0f, hp,  7000.0f, 0.50f, 0.6f, 1 },
+    /* 47 Low-Mid Tom        */ { 150.0f, 120.0f, 0.10f, 0.40f, 0.9f, lp,  1100.0f, 0.05f, 0.2f, 0 },
+    /* 48 Hi-Mid Tom         */ { 175.0f, 140.0f, 0.10f, 0.35f, 0.9f, lp,  1200.0f, 0.05f, 0.2f, 0 },
+    /* 49 Crash Cymbal 1     */ {   0.0f,   0.0f, 0.00f, 0.01f, 0.0f, hp,  5000.0f, 1.50f, 0.7f, 0 },
+    /* 50 High Tom           */ { 200.0f, 160.0f, 0.10f, 0.35f, 0.9f, lp,  1300.0f, 0.05f, 0.2f, 0 },
+    /* 51 Ride Cymbal 1      */ {2500.0f,2500.0f, 0.00f, 0.80f, 0.1f, bp,  6000.0f, 1.20f, 0.4f, 0 },
+    /* 52 Chinese Cymbal     */ {   0.0f,   0.0f, 0.00f, 0.01f, 0.0f, hp,  3500.0f, 1.20f, 0.7f, 0 },
+    /* 53 Ride Bell          */ {2200.0f,2200.0f, 0.00f, 0.80f, 0.4f, hp,  6000.0f, 0.50f, 0.2f, 0 },
+    /* 54 Tambourine         */ {   0.0f,   0.0f, 0.00f, 0.01f, 0.0f, hp,  8000.0f, 0.20f, 0.6f, 0 },
+    /* 55 Splash Cymbal      */ {   0.0f,   0.0f, 0.00f, 0.01f, 0.0f, hp,  6000.0f, 0.60f, 0.6f, 0 },
+    /* 56 Cowbell            */ { 560.0f, 560.0f, 0.00f, 0.30f, 0.6f, bp,   800.0f, 0.05f, 0.1f, 0 },
+    /* 57 Crash Cymbal 2     */ {   0.0f,   0.0f, 0.00f, 0.01f, 0.0f, hp,  4500.0f, 1.60f, 0.7f, 0 },
+    /* 58 Vibraslap          */ {   0.0f,   0.0f, 0.00f, 0.01f, 0.0f, bp,  2500.0f, 0.80f, 0.4f, 0 },
+    /* 59 Ride Cymbal 2      */ {   0.0f,   0.0f, 0.00f, 0.01f, 0.0f, bp,  5500.0f, 1.20f, 0.4f, 0 },
+    /* 60 Hi Bongo           */ { 400.0f, 380.0f, 0.02f, 0.15f, 0.8f, bp,  2000.0f, 0.02f, 0.1f, 0 },
+    /* 61 Low Bongo          */ { 300.0f, 280.0f, 0.02f, 0.18f, 0.8f, bp,  1800.0f, 0.02f, 0.1f, 0 },
+    /* 62 Mute Hi Conga      */ { 330.0f, 310.0f, 0.02f, 0.10f, 0.8f, bp,  1500.0f, 0.02f, 0.1f, 0 },
+    /* 63 Open Hi Conga      */ { 330.0f, 310.0f, 0.02f, 0.30f, 0.8f, bp,  1500.0f, 0.02f, 0.1f, 0 },
+    /* 64 Low Conga          */ { 250.0f, 235.0f, 0.02f, 0.35f, 0.8f, bp,  1200.0f, 0.02f, 0.1f, 0 },
+    /* 65 High Timbale       */ { 450.0f, 430.0f, 0.02f, 0.30f, 0.6f, bp,  3000.0f, 0.10f, 0.2f, 0 },
+    /* 66 Low Timbale        */ { 350.0f, 330.0f, 0.02f, 0.35f, 0.6f, bp,  2500.0f, 0.10f, 0.2f, 0 },
+    /* 67 High Agogo         */ { 900.0f, 900.0f, 0.00f, 0.30f, 0.6f, bp,  1000.0f, 0.01f, 0.0f, 0 },
+    /* 68 Low Agogo          */ { 650.0f, 650.0f, 0.00f, 0.35f, 0.6f, bp,   700.0f, 0.01f, 0.0f, 0 },
+    /* 69 Cabasa             */ {   0.0f,   0.0f, 0.00f, 0.01f, 0.0f, hp,  6000.0f, 0.10f, 0.6f, 0 },
+    /* 70 Maracas            */ {   0.0f,   0.0f, 0.00f, 0.01f, 0.0f, hp,  8000.0f, 0.06f, 0.6f, 0 },
+    /* 71 Short Whistle      */ {2500.0f,2500.0f, 0.00f, 0.10f, 0.4f, bp,  2500.0f, 0.01f, 0.0f, 0 },
+    /* 72 Long Whistle       */ {2300.0f,2300.0f, 0.00f, 0.40f, 0.4f, bp,  2300.0f, 0.01f, 0.0f, 0 },
+    /* 73 Short Guiro        */ {   0.0f,   0.0f, 0.00f, 0.01f, 0.0f, bp,  3000.0f, 0.10f, 0.5f, 0 },
+    /* 74 Long Guiro         */ {   0.0f,   0.0f, 0.00f, 0.01f, 0.0f, bp,  3000.0f, 0.35f, 0.5f, 0 },
+    /* 75 Claves             */ {2500.0f,2500.0f, 0.00f, 0.06f, 0.6f, bp,  2500.0f, 0.01f, 0.0f, 0 },
+    /* 76 Hi Wood Block      */ {1800.0f,1800.0f, 0.00f, 0.06f, 0.6f, bp,  1800.0f, 0.01f, 0.0f, 0 },
+    /* 77 Low Wood Block     */ {1300.0f,1300.0f, 0.00f, 0.07f, 0.6f, bp,  1300.0f, 0.01f, 0.0f, 0 },
+    /* 78 Mute Cuica         */ { 700.0f, 600.0f, 0.03f, 0.10f, 0.5f, bp,   700.0f, 0.01f, 0.0f, 2 },
+    /* 79 Open Cuica         */ { 500.0f, 400.0f, 0.10f, 0.30f, 0.5f, bp,   500.0f, 0.01f, 0.0f, 2 },
+    /* 80 Mute Triangle      */ {4500.0f,4500.0f, 0.00f, 0.10f, 0.3f, bp,  4500.0f, 0.01f, 0.0f, 3 },
+    /* 81 Open Triangle      */ {4500.0f,4500.0f, 0.00f, 1.00f, 0.3f, bp,  4500.0f, 0.01f, 0.0f, 3 },
+};
+constexpr int gm_drum_count = static_cast<int>(sizeof(gm_drums) / sizeof(*gm_drums));
+static_assert(gm_drum_count == 81 - first_gm_drum + 1, "GM drum map must cover keys 35-81");
+
+const drum_sound unknown_drum = {   0.0f,   0.0f, 0.00f, 0.01f, 0.0f, bp,  2000.0f, 0.10f, 0.4f, 0 };
+
+} // unnamed namespace
+
+noise_generator::noise_generator(uint32_t seed)
+{
+    for (int l = 0; l < lanes; ++l) {
+        state_[l] = (seed ^ (0x6C078965u * (l + 1))) | 1; // Must not be zero
+    }
+}
+
+void noise_generator::generate(float* out, int count)
+{
+    for (int i = 0; i < count; i += lanes) {
+        float v[lanes];
+        for (int l = 0; l < lanes; ++l) {
+            uint32_t x = state_[l];
+            x ^= x << 13;
+            x ^= x >> 17;
+            x ^= x << 5;
+            state_[l] = x;
+            v[l] = static_cast<int32_t>(x) * (1.0f / 2147483648.0f);
+        }
+        for (int l = 0; l < lanes && i + l < count; ++l) {
+            out[i + l] = v[l];
+        }
+    }
+}
+
+const drum_sound& gm_drum_sound(int midi_key)
+{
+    const int index = midi_key - first_gm_drum;
+    return index >= 0 && index < gm_drum_count ? gm_drums[index] : unknown_drum;
+}
+
+void drum_voice::trigger(int midi_key, const drum_sound& sound, float velocity)
+{
+    sound_          = &sound;
+    key_            = midi_key;
+    samples_played_ = 0;
+    active_         = true;
+
+    re_          = 1.0f;
+    im_          = 0.0f;
+    freq_        = sound.tone_freq;
+    sweep_mul_   = sound.tone_sweep > 0.0f ? exp(-block_size / (sound.tone_sweep * samplerate)) : 0.0f;
+    tone_level_  = sound.tone_freq > 0.0f ? sound.tone_level * velocity : 0.0f;
+    tone_mul_    = decay_multiplier(sound.tone_decay);
+
+    noise_filter_ = biquad_filter{};
+    noise_filter_.filter(sound.noise_filter);
+    noise_filter_.cutoff_frequeny(sound.noise_cutoff);
+    noise_level_ = sound.noise_level * velocity;
+    noise_mul_   = decay_multiplier(sound.noise_decay);
+}
+
+void drum_voice::choke()
+{
+    tone_mul_  = std::min(tone_mul_, decay_multiplier(choke_time));
+    noise_mul_ = std::min(noise_mul_, decay_multiplier(choke_time));
+}
+
+void drum_voice::render(float* out, noise_generator& noise, int count)
+{
+    assert(count <= block_size);
+    if (!active_) {
+        return;
+    }
+    samples_played_ += count;
+
+    if (tone_level_ > silence_level) {
+        const float w = 2.0f * pi * freq_ / samplerate;
+        const float c = cos(w);
+        const float s = sin(w);
+        float re    = re_;
+        float im    = im_;
+        float level = tone_level_;
+        for (int i = 0; i < count; ++i) {
+            out[i] += im * level;
+            const float r = re * c - im * s;
+            im     = re * s + im * c;
+            re     = r;
+            level *= tone_mul_;
+        }
+        // Keep the phasor on the unit circle
+        const float norm = 1.0f / sqrt(re * re + im * im);
+        re_         = re * norm;
+        im_         = im * norm;
+        tone_level_ = level;
+        freq_       = sound_->tone_end_freq + (freq_ - sound_->tone_end_freq) * sweep_mul_;
+    }
+
+    if (noise_level_ > silence_level) {
+        float buf[block_size];
+        noise.generate(buf, count);
+        switch (sound_->noise_filter) {
+        case filter_type::lowpass:  add_noise<filter_type::lowpass>(out, buf, count);  break;
+        case filter_type::bandpass: add_noise<filter_type::bandpass>(out, buf, count); break;
+        case filter_type::highpass: add_noise<filter_type::highpass>(out, buf, count); break;
+        }
+    }
+
+    active_ = tone_level_ > silence_level || noise_level_ > silence_level;
+}
+
+template<filter_type Ft>
+void drum_voice::add_noise(float* out, const float* noise, int count)
+{
+    float buf[block_size];
+    std::copy(noise, noise + count, buf);
+    noise_filter_.process<Ft>(buf, count);
+    float level = noise_level_;
+    for (int i = 0; i < count; ++i) {
+        out[i] += buf[i] * level;
+        level  *= noise_mul_;
+    }
+    noise_level_ = level;
+}
+
+void percussion_engine::choke_all()
+{
+    for (auto& v : voices_) {
+        if (v.active()) v.choke();
+    }
+}
+
+void percussion_engine::note_on(int midi_key, uint8_t velocity)
+{
+    assert(velocity);
+    const auto& sound = gm_drum_sound(midi_key);
+    if (sound.choke_group) {
+        for (auto& v : voices_) {
+            if (v.active() && v.choke_group() == sound.choke_group) {
+                v.choke();
+            }
+        }
+    }
+
+    // Take a free voice, or the one that's been playing the longest
+    const auto first = voices_, last = voices_ + max_voices;
+    auto it = std::find_if(first, last, [](const drum_voice& v) { return !v.active(); });
+    if (it == last) {
+        it = std::max_element(first, last, [](const drum_voice& l, const drum_voice& r) { return l.samples_played() < r.samples_played(); });
+    }
+    it->trigger(midi_key, sound, velocity / 127.0f);
+}
+
+int percussion_engine::active_count() const
+{
+    return static_cast<int>(std::count_if(voices_, voices_ + max_voices, [](const drum_voice& v) { return v.active(); }));
+}
+
+void percussion_engine::render(float* out, int count)
+{
+    for (auto& v : voices_) {
+        v.render(out, noise_, count);
+    }
+}
+
+} // namespace splay
@@ -0,0 +1,116 @@
+#ifndef SPLAY_PERCUSSION_H
+#define SPLAY_PERCUSSION_H
+
+#include <stdint.h>
+#include "constants.h"
+#include "filter.h"
+
+namespace splay {
+
+// White noise from four interleaved xorshift32 generators. The lanes are
+// independent, so the inner loop is vectorized by the compiler.
+class noise_generator {
+public:
+    static constexpr int lanes = 4;
+
+    explicit noise_generator(uint32_t seed = 0x9E3779B9);
+
+    // Writes count samples in [-1; 1)
+    void generate(float* out, int count);
+
+private:
+    uint32_t state_[lanes];
+};
+
+// Synthesis parameters of one drum sound: a resonator (sine with an optional
+// downward pitch sweep) plus filtered noise, each with a fixed exponential decay.
+struct drum_sound {
+    float       tone_freq;      // Start frequency of the resonator, 0 for none
+    float       tone_end_freq;  // Frequency the resonator sweeps towards
+    float       tone_sweep;     // Seconds for the sweep to cover 1/e of the remaining distance
+    float       tone_decay;     // Seconds to fade out
+    float       tone_level;
+    filter_type noise_filter;
+    float       noise_cutoff;
+    float       noise_decay;    // Seconds to fade out
+    float       noise_level;    // 0 for none
+    int         choke_group;    // Sounds of the same (non-zero) group cut each other off
+};
+
+// General MIDI percussion key map (35 Acoustic Bass Drum ... 81 Open Triangle),
+// other keys get a generic short noise burst
+const drum_sound& gm_drum_sound(int midi_key);
+
+// One-shot drum voice. Plays until both components have decayed, note off is ignored.
+class drum_voice {
+public:
+    void trigger(int midi_key, const drum_sound& sound, float velocity);
+
+    // Cuts the voice off quickly (used for choke groups)
+    void choke();
+
+    bool active() const {
+        return active_;
+    }
+
+    int choke_group() const {
+        return sound_ ? sound_->choke_group : 0;
+    }
+
+    int key() const {
+        return key_;
+    }
+
+    int samples_played() const {
+        return samples_played_;
+    }
+
+    // Adds count (at most block_size) samples to out, retires the voice once it's silent
+    void render(float* out, noise_generator& noise, int count);
+
+private:
+    const drum_sound* sound_ = nullptr;
+    bool              active_ = false;
+    int               key_ = 0;
+    int               samples_played_ = 0;
+
+    // Resonator, a unit phasor rotated by the current frequency
+    float             re_ = 1.0f;
+    float             im_ = 0.0f;
+    float             freq_ = 0.0f;
+    float             sweep_mul_ = 1.0f;    // Per block
+    float             tone_level_ = 0.0f;
+    float             tone_mul_ = 1.0f;     // Per sample
+
+    biquad_filter     noise_filter_;
+    float             noise_level_ = 0.0f;
+    float             noise_mul_ = 1.0f;    // Per sample
+
+    template<filter_type Ft>
+    void add_noise(float* out, const float* noise, int count);
+};
+
+// Fixed set of drum voices, independent of the melodic voice pool.
+// Voices are retired as soon as they've decayed.
+class percussion_engine {
+public:
+    static constexpr int max_voices = 32;
+
+    void note_on(int midi_key, uint8_t velocity);
+
+    // Cuts off all sounding voices quickly, e.g. on all notes off
+    void choke_all();
+
+    int active_count() const;
+
+    // Adds count (at most block_size) samples to out
+    void render(float* out, int count);
+
+private:
+    drum_voice      voices_[max_voices];
+    noise_generator noise_;
+};
+
+} // namespace splay
+
+#endif
@@ -0,0 +1,143 @@
+#include "realtime.h"
+#include <iostream>
+#include <string.h>
+
+#ifdef _WIN32
+#include <Windows.h>
+#include <malloc.h>
+#else
+#include <alloca.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+size_t page_size()
+{
+#ifdef _WIN32
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    return si.dwPageSize;
+#else
+    return static_cast<size_t>(sysconf(_SC_PAGESIZE));
+#endif
+}
+
+// Grows the stack of the calling thread by size bytes and touches each page
+void prefault_stack(size_t size)
+{
+    if (!size) return;
+#ifdef _WIN32
+    auto stack = static_cast<volatile char*>(_alloca(size));
+#else
+    auto stack = static_cast<volatile char*>(alloca(size));
+#endif
+    const size_t step = page_size();
+    for (size_t i = 0; i < size; i += step) {
+        stack[i] = 0;
+    }
+}
+
+#ifndef _WIN32
+std::string errno_string(int err)
+{
+    return std::string(strerror(err)) + " (" + std::to_string(err) + ")";
+}
+#endif
+
+} // unnamed namespace
+
+std::vector<std::string> make_current_thread_realtime(const realtime_thread_config& config)
+{
+    std::vector<std::string> problems;
+
+#ifdef _WIN32
+    if (config.realtime_scheduling) {
+        if (!SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL)) {
+            problems.push_back("SetThreadPriority(THREAD_PRIORITY_TIME_CRITICAL) failed: " + std::to_string(GetLastError()));
+        }
+    } else {
+        SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_ABOVE_NORMAL);
+    }
+
+    if (!config.cpus.empty()) {
+        DWORD_PTR mask = 0;
+        for (int cpu : config.cpus) {
+            if (cpu >= 0 && cpu < static_cast<int>(sizeof(mask) * 8)) mask |= DWORD_PTR(1) << cpu;
+        }
+        if (!SetThreadAffinityMask(GetCurrentThread(), mask)) {
+            problems.push_back("SetThreadAffinityMask failed: " + std::to_string(GetLastError()));
+        }
+    }
+#else
+    if (config.realtime_scheduling) {
+        sched_param param{};
+        param.sched_priority = config.priority ? config.priority : sched_get_priority_max(SCHED_FIFO) - 10;
+        if (const int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param)) {
+            std::string msg = "SCHED_FIFO priority " + std::to_string(param.sched_priority) + " unavailable: " + errno_string(err);
+            if (err == EPERM) msg += " - raise RLIMIT_RTPRIO (ulimit -r) or grant CAP_SYS_NICE";
+            problems.push_back(msg);
+        }
+    }
+
+    if (!config.cpus.empty()) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int cpu : config.cpus) {
+            if (cpu >= 0 && cpu < CPU_SETSIZE) CPU_SET(cpu, &set);
+        }
+        if (const int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) {
+            problems.push_back("Pinning to CPUs failed: " + errno_string(err));
+        }
+    }
+#endif
+
+    prefault_stack(config.stack_prefault_size);
+
+    return problems;
+}
+
+std::vector<std::string> lock_process_memory()
+{
+    std::vector<std::string> problems;
+#ifdef _WIN32
+    problems.push_back("Locking all process memory is not supported on Windows, only prefaulted ranges are locked");
+#else
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+        const int err = errno;
+        std::string msg = "mlockall failed: " + errno_string(err);
+        if (err == EPERM || err == ENOMEM) msg += " - raise RLIMIT_MEMLOCK (ulimit -l) or grant CAP_IPC_LOCK";
+        problems.push_back(msg);
+    }
+#endif
+    return problems;
+}
+
+bool prefault_memory(void* p, size_t size)
+{
+    if (!p || !size) return true;
+
+    auto mem = static_cast<volatile char*>(p);
+    const size_t step = page_size();
+    for (size_t i = 0; i < size; i += step) {
+        mem[i] = mem[i];
+    }
+    mem[size - 1] = mem[size - 1];
+
+#ifdef _WIN32
+    return VirtualLock(p, size) != FALSE;
+#else
+    return mlock(p, size) == 0;
+#endif
+}
+
+void report_realtime_problems(const char* thread_name, const std::vector<std::string>& problems)
+{
+    for (const auto& p : problems) {
+        std::cout << "Realtime setup of " << thread_name << " thread: " << p << std::endl;
+    }
+}
@@ -0,0 +1,32 @@
+#ifndef REALTIME_H_INCLUDED
+#define REALTIME_H_INCLUDED
+
+#include <string>
+#include <vector>
+#include <stddef.h>
+
+struct realtime_thread_config {
+    bool             realtime_scheduling = true;        // SCHED_FIFO on Linux, time critical priority on Windows
+    int              priority            = 0;           // SCHED_FIFO priority, 0 picks a default
+    std::vector<int> cpus;                              // CPUs to pin the thread to, empty to let it float
+    size_t           stack_prefault_size = 256 * 1024;  // Bytes of stack to touch up front
+};
+
+// Applies config to the calling thread. Returns a description of each
+// setting that couldn't be applied, i.e. an empty vector on success.
+std::vector<std::string> make_current_thread_realtime(const realtime_thread_config& config);
+
+// Locks all current and future memory of the process (mlockall), once at startup
+// rather than per thread. Later allocations fail once RLIMIT_MEMLOCK is reached, so
+// it's opt-in. Returns the problems like make_current_thread_realtime; not supported
+// on Windows, where only prefault_memory ranges are locked.
+std::vector<std::string> lock_process_memory();
+
+// Touches every page in [p; p+size) and locks them if possible, so later
+// accesses (e.g. from the audio callback) won't page fault.
+bool prefault_memory(void* p, size_t size);
+
+// Prints the problems returned by make_current_thread_realtime (if any)
+void report_realtime_problems(const char* thread_name, const std::vector<std::string>& problems);
+
+#endif
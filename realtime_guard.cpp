@@ -0,0 +1,294 @@
+#include "realtime_guard.h"
+
+#ifdef SPLAY_RT_GUARD
+
+#include <atomic>
+#include <iostream>
+#include <new>
+#include <streambuf>
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef _WIN32
+#include <Windows.h>
+#include <DbgHelp.h>
+#pragma comment(lib, "dbghelp.lib")
+#elif defined(__GLIBC__)
+#include <execinfo.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+constexpr int max_scope_depth = 8;
+constexpr int max_frames      = 32;
+constexpr int max_sites       = 1024;  // Distinct call stacks remembered, later ones are only counted
+
+const char* const violation_names[] = { "heap allocation", "heap free", "mutex lock", "blocking call" };
+static_assert(sizeof(violation_names) / sizeof(*violation_names) == static_cast<size_t>(realtime_violation::count), "a name per violation kind");
+
+// Constant initialized, so touching it never allocates (not even from operator new before main)
+struct thread_state {
+    const char* scopes[max_scope_depth];
+    int         depth;      // Realtime while non-zero
+    bool        reporting;  // Allocations and locks of the report itself aren't checked
+};
+thread_local thread_state state;
+
+std::atomic<uint64_t> counts[static_cast<int>(realtime_violation::count)];
+std::atomic<uint64_t> sites[max_sites];   // Hashes of reported call stacks, 0 for unused
+std::atomic_flag      print_lock = ATOMIC_FLAG_INIT;
+
+int capture_stack(void** frames)
+{
+#ifdef _WIN32
+    return CaptureStackBackTrace(0, max_frames, frames, nullptr);
+#elif defined(__GLIBC__)
+    return backtrace(frames, max_frames);
+#else
+    (void)frames;
+    return 0;
+#endif
+}
+
+void print_stack(void* const* frames, int count)
+{
+#ifdef _WIN32
+    static bool initialized = false;
+    const HANDLE process = GetCurrentProcess();
+    if (!initialized) {
+        initialized = true;
+        SymSetOptions(SYMOPT_DEFERRED_LOADS | SYMOPT_LOAD_LINES | SYMOPT_UNDNAME);
+        SymInitialize(process, nullptr, TRUE);
+    }
+    alignas(SYMBOL_INFO) char buffer[sizeof(SYMBOL_INFO) + MAX_SYM_NAME];
+    auto symbol = reinterpret_cast<SYMBOL_INFO*>(buffer);
+    for (int i = 0; i < count; ++i) {
+        const auto address = reinterpret_cast<DWORD64>(frames[i]);
+        symbol->SizeOfStruct = sizeof(SYMBOL_INFO);
+        symbol->MaxNameLen   = MAX_SYM_NAME;
+        DWORD64 offset = 0;
+        if (!SymFromAddr(process, address, &offset, symbol)) {
+            fprintf(stderr, "  #%d 0x%llx\n", i, static_cast<unsigned long long>(address));
+            continue;
+        }
+        IMAGEHLP_LINE64 line{};
+        line.SizeOfStruct = sizeof(line);
+        DWORD displacement = 0;
+        if (SymGetLineFromAddr64(process, address, &displacement, &line)) {
+            fprintf(stderr, "  #%d %s (%s:%lu)\n", i, symbol->Name, line.FileName, line.LineNumber);
+        } else {
+            fprintf(stderr, "  #%d %s+0x%llx\n", i, symbol->Name, static_cast<unsigned long long>(offset));
+        }
+    }
+#elif defined(__GLIBC__)
+    backtrace_symbols_fd(frames, count, STDERR_FILENO); // Doesn't allocate
+#else
+    (void)frames;
+    (void)count;
+#endif
+}
+
+// True the first time a call stack is seen
+bool first_report(void* const* frames, int count)
+{
+    uint64_t hash = 14695981039346656037ull; // FNV-1a
+    for (int i = 0; i < count; ++i) {
+        hash = (hash ^ reinterpret_cast<uintptr_t>(frames[i])) * 1099511628211ull;
+    }
+    hash |= 1;
+    for (auto& site : sites) {
+        uint64_t expected = 0;
+        if (site.compare_exchange_strong(expected, hash) || expected == hash) {
+            return expected == 0;
+        }
+    }
+    return false;
+}
+
+void violation(realtime_violation kind, const char* what, size_t bytes = 0)
+{
+    auto& s = state;
+    if (!s.depth || s.reporting) return;
+    s.reporting = true;
+    counts[static_cast<int>(kind)].fetch_add(1, std::memory_order_relaxed);
+
+    void* frames[max_frames];
+    const int num_frames = capture_stack(frames);
+    if (first_report(frames, num_frames)) {
+        while (print_lock.test_and_set(std::memory_order_acquire)) {
+        }
+        fprintf(stderr, "Realtime guard: %s", violation_names[static_cast<int>(kind)]);
+        if (what) fprintf(stderr, " (%s)", what);
+        if (bytes) fprintf(stderr, " of %zu bytes", bytes);
+        fprintf(stderr, " in ");
+        for (int i = 0; i < s.depth && i < max_scope_depth; ++i) {
+            fprintf(stderr, "%s%s", i ? " > " : "", s.scopes[i]);
+        }
+        fprintf(stderr, "\n");
+        print_stack(frames, num_frames);
+        fflush(stderr);
+        print_lock.clear(std::memory_order_release);
+    }
+    s.reporting = false;
+}
+
+void* checked_allocate(size_t size)
+{
+    violation(realtime_violation::allocation, nullptr, size);
+    return malloc(size ? size : 1);
+}
+
+void checked_free(void* p)
+{
+    if (!p) return;
+    violation(realtime_violation::deallocation, nullptr);
+    free(p);
+}
+
+// Passes std::cout output on, checking each write
+class checked_streambuf : public std::streambuf {
+public:
+    explicit checked_streambuf(std::streambuf* target) : target_(target) {
+    }
+
+    std::streambuf* target() const {
+        return target_;
+    }
+
+protected:
+    int overflow(int c) override {
+        realtime_check_blocking_call("write to std::cout");
+        return c == traits_type::eof() ? traits_type::not_eof(c) : target_->sputc(traits_type::to_char_type(c));
+    }
+
+    std::streamsize xsputn(const char* s, std::streamsize n) override {
+        realtime_check_blocking_call("write to std::cout");
+        return target_->sputn(s, n);
+    }
+
+    int sync() override {
+        realtime_check_blocking_call("flush of std::cout");
+        return target_->pubsync();
+    }
+
+private:
+    std::streambuf* target_;
+};
+
+// Checks std::cout for the lifetime of the program and prints the totals at exit
+class guard_setup {
+public:
+    guard_setup() : cout_buf_(std::cout.rdbuf()) {
+        std::cout.rdbuf(&cout_buf_);
+    }
+
+    ~guard_setup() {
+        std::cout.rdbuf(cout_buf_.target());
+        uint64_t total = 0;
+        for (const auto& c : counts) {
+            total += c.load();
+        }
+        fprintf(stderr, "Realtime guard: %llu violations on realtime threads", static_cast<unsigned long long>(total));
+        for (int k = 0; k < static_cast<int>(realtime_violation::count); ++k) {
+            fprintf(stderr, "%s %llu %s", k ? "," : ":", static_cast<unsigned long long>(counts[k].load()), violation_names[k]);
+        }
+        fprintf(stderr, "\n");
+    }
+
+private:
+    checked_streambuf cout_buf_;
+};
+guard_setup setup;
+
+} // unnamed namespace
+
+realtime_scope::realtime_scope(const char* context, bool enabled) : enabled_(enabled)
+{
+    if (!enabled_) return;
+    auto& s = state;
+    if (s.depth < max_scope_depth) s.scopes[s.depth] = context;
+    ++s.depth;
+}
+
+realtime_scope::~realtime_scope()
+{
+    if (enabled_) --state.depth;
+}
+
+bool in_realtime_scope()
+{
+    return state.depth != 0;
+}
+
+void realtime_check_lock(const char* what)
+{
+    violation(realtime_violation::lock, what);
+}
+
+void realtime_check_blocking_call(const char* what)
+{
+    violation(realtime_violation::blocking_call, what);
+}
+
+uint64_t realtime_violation_count(realtime_violation kind)
+{
+    return counts[static_cast<int>(kind)].load();
+}
+
+// Replaces the global allocation functions. Over-aligned (std::align_val_t) allocations
+// keep the default implementation and aren't checked.
+
+void* operator new(size_t size)
+{
+    if (void* p = checked_allocate(size)) return p;
+    throw std::bad_alloc{};
+}
+
+void* operator new[](size_t size)
+{
+    if (void* p = checked_allocate(size)) return p;
+    throw std::bad_alloc{};
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept
+{
+    return checked_allocate(size);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept
+{
+    return checked_allocate(size);
+}
+
+void operator delete(void* p) noexcept
+{
+    checked_free(p);
+}
+
+void operator delete[](void* p) noexcept
+{
+    checked_free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+    checked_free(p);
+}
+
+void operator delete[](void* p, size_t) noexcept
+{
+    checked_free(p);
+}
+
+void operator delete(void* p, const std::nothrow_t&) noexcept
+{
+    checked_free(p);
+}
+
+void operator delete[](void* p, const std::nothrow_t&) noexcept
+{
+    checked_free(p);
+}
+
+#endif
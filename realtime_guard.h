@@ -0,0 +1,69 @@
+#ifndef REALTIME_GUARD_H_INCLUDED
+#define REALTIME_GUARD_H_INCLUDED
+
+#include <stdint.h>
+
+// Debug instrumentation for realtime threads, enabled by building with SPLAY_RT_GUARD.
+// While a thread is inside a realtime_scope every heap allocation and free, every
+// write to std::cout and every lock or blocking call marked with realtime_check_*
+// is reported to stderr with the scopes it happened in and a stack trace. Each
+// distinct call stack is reported once, totals are printed at exit. Without
+// SPLAY_RT_GUARD all of this compiles to nothing.
+
+enum class realtime_violation { allocation, deallocation, lock, blocking_call, count };
+
+#ifdef SPLAY_RT_GUARD
+
+// Marks the calling thread as realtime while in scope, e.g. for one render. Scopes
+// nest, context names the scope in reports. A disabled scope does nothing, so
+// threads helping a realtime thread can follow whether it's realtime.
+class realtime_scope {
+public:
+    explicit realtime_scope(const char* context, bool enabled = true);
+    ~realtime_scope();
+
+    realtime_scope(const realtime_scope&) = delete;
+    realtime_scope& operator=(const realtime_scope&) = delete;
+
+private:
+    bool enabled_;
+};
+
+// True if the calling thread is inside a realtime_scope
+bool in_realtime_scope();
+
+// Call just before locking a mutex (what names it) or making a call that may block
+void realtime_check_lock(const char* what);
+void realtime_check_blocking_call(const char* what);
+
+// Number of violations of a kind seen so far, reported or not
+uint64_t realtime_violation_count(realtime_violation kind);
+
+#else
+
+class realtime_scope {
+public:
+    explicit realtime_scope(const char*, bool = true) {
+    }
+
+    realtime_scope(const realtime_scope&) = delete;
+    realtime_scope& operator=(const realtime_scope&) = delete;
+};
+
+inline bool in_realtime_scope() {
+    return false;
+}
+
+inline void realtime_check_lock(const char*) {
+}
+
+inline void realtime_check_blocking_call(const char*) {
+}
+
+inline uint64_t realtime_violation_count(realtime_violation) {
+    return 0;
+}
+
+#endif
+
+#endif
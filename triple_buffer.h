@@ -0,0 +1,52 @@
+#ifndef TRIPLE_BUFFER_H_INCLUDED
+#define TRIPLE_BUFFER_H_INCLUDED
+
+#include <atomic>
+#include <stdint.h>
+
+// Hands the latest of a series of values from one writer thread to one reader
+// thread, neither of them ever waits. The writer fills its buffer and publishes
+// it, the reader picks up the last one published; values published between two
+// reads are skipped. The third buffer is the one in between, swapped atomically.
+template<typename T>
+class triple_buffer {
+public:
+    triple_buffer() = default;
+    triple_buffer(const triple_buffer&) = delete;
+    triple_buffer& operator=(const triple_buffer&) = delete;
+
+    // Writer: the buffer to fill, it still holds the value published from it last time
+    T& write_buffer() {
+        return buffers_[write_];
+    }
+
+    // Writer: makes the write buffer the latest value and gets a new one to write
+    void publish() {
+        write_ = middle_.exchange(static_cast<uint8_t>(write_ | fresh_bit), std::memory_order_acq_rel) & index_mask;
+    }
+
+    // Reader: takes the latest value if one was published since the last update, returns false otherwise
+    bool update() {
+        if (!(middle_.load(std::memory_order_relaxed) & fresh_bit)) {
+            return false;
+        }
+        read_ = middle_.exchange(read_, std::memory_order_acq_rel) & index_mask;
+        return true;
+    }
+
+    // Reader: the value taken by the last update
+    const T& read_buffer() const {
+        return buffers_[read_];
+    }
+
+private:
+    static constexpr uint8_t index_mask = 3;
+    static constexpr uint8_t fresh_bit  = 4; // Set in middle_ when it holds a value not yet read
+
+    T                    buffers_[3] = {};
+    alignas(64) std::atomic<uint8_t> middle_{1};
+    alignas(64) uint8_t  write_ = 0;    // Only used by the writer
+    alignas(64) uint8_t  read_  = 2;    // Only used by the reader
+};
+
+#endif
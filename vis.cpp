@@ -1,9 +1,13 @@
 #include "vis.h"
 #include "constants.h"
+#include "overview.h"
+#include "note.h"
 #include <assert.h>
 #include <complex>
 #include <vector>
 #include <algorithm>
+#include <fstream>
+#include <stdexcept>
 
 namespace splay {
 
@@ -163,22 +167,150 @@ double do_draw_spetrum_data(bitmap_window& bw, std::vector<std::complex<float>>&
     return max_freq;
 }
 
+// Constant-Q transform with one bin per piano key, using the method of
+// Brown & Puckette, "An efficient algorithm for the calculation of a constant Q transform":
+// The temporal kernels are transformed once up front and only their significant spectral
+// coefficients are kept, so each analysis is one FFT followed by a short sparse product.
+class constant_q_transform {
+public:
+    static constexpr int fft_log2 = 14;
+    static constexpr int fft_size = 1 << fft_log2;
+    static constexpr int num_bins = static_cast<int>(piano_key::C_8);
+
+    constant_q_transform() {
+        // With one bin per semitone each kernel must span Q periods
+        const float q = 1.0f / (note_difference_to_scale(1) - 1.0f);
+        std::vector<std::complex<float>> kernel(fft_size);
+        offsets_.push_back(0);
+        for (int k = 0; k < num_bins; ++k) {
+            const float freq = piano_key_to_freq(static_cast<piano_key>(k + 1));
+            // The lowest keys would need more than fft_size samples, they get a lower Q instead
+            const int len = std::min(fft_size, static_cast<int>(ceil(q * samplerate / freq)));
+            std::fill(kernel.begin(), kernel.end(), std::complex<float>{});
+            const int start = (fft_size - len) / 2;
+            for (int n = 0; n < len; ++n) {
+                const float w = 0.54f - 0.46f * cos(2.0f * pi * n / (len - 1)); // Hamming
+                kernel[start + n] = std::polar(w / len, 2.0f * pi * freq * n / samplerate);
+            }
+            fft(kernel, fft_log2);
+
+            float max_mag = 0.0f;
+            for (const auto& c : kernel) max_mag = std::max(max_mag, abs(c));
+            for (int j = 0; j < fft_size; ++j) {
+                if (abs(kernel[j]) >= sparsity_threshold * max_mag) {
+                    entries_.push_back({j, conj(kernel[j])});
+                }
+            }
+            offsets_.push_back(static_cast<int>(entries_.size()));
+        }
+    }
 
-void draw_waveform_data(bitmap_window& bw, const std::vector<short>& data)
+    // spectrum is the (forward, 1/n scaled) FFT of fft_size samples, out receives num_bins magnitudes
+    void operator()(const std::vector<std::complex<float>>& spectrum, std::vector<float>& out) const {
+        assert(spectrum.size() == fft_size);
+        out.resize(num_bins);
+        for (int k = 0; k < num_bins; ++k) {
+            std::complex<float> sum{};
+            for (int i = offsets_[k]; i < offsets_[k + 1]; ++i) {
+                sum += spectrum[entries_[i].bin] * entries_[i].coef;
+            }
+            out[k] = abs(sum) * fft_size;
+        }
+    }
+
+private:
+    static constexpr float sparsity_threshold = 0.01f;
+
+    struct entry {
+        int                 bin;
+        std::complex<float> coef;
+    };
+    std::vector<entry> entries_;
+    std::vector<int>   offsets_;   // Kernel k is entries_[offsets_[k]; offsets_[k+1])
+};
+
+double do_draw_constant_q_data(bitmap_window& bw, const constant_q_transform& cqt, std::vector<std::complex<float>>& f, std::vector<float>& spectrum)
 {
     const int w = bw.width();
     const int h = bw.height();
+
+    fft(f, constant_q_transform::fft_log2);
+    cqt(f, spectrum);
+
+    const auto index = std::max_element(spectrum.begin(), spectrum.end()) - spectrum.begin();
+    const auto max_freq = piano_key_to_freq(static_cast<piano_key>(index + 1));
+
+    constexpr float db_range = 60.0f;
     std::vector<unsigned> pixels(w * h, ~0U);
-    int lx = 0, ly = h/2;
     for (int i = 0; i < w; ++i) {
-        const auto samp = data[i * data.size() / w] / 32768.0;
-        assert(samp >= -1.0 && samp <= 1.0);
+        const auto mag = spectrum[i * spectrum.size() / w];
+        float samp = (20.0f * log10(mag + 1e-10f) + db_range) / db_range;
+        if (samp < 0) samp = 0;
+        if (samp > 1) samp = 1;
 
-        int y = int(samp * (h/2-1) + (h/2));
+        int y = int(samp * (h-1));
 
-        draw_line(&pixels[0], w, h, lx, ly, i, y, 0);
-        lx = i;
-        ly = y;
+        draw_line(&pixels[0], w, h, i, 0, i, y, 0);
+    }
+    bw.update_pixels(&pixels[0]);
+
+    return max_freq;
+}
+
+void draw_waveform_data(bitmap_window& bw, const std::vector<short>& data)
+{
+    const int w = bw.width();
+    const int h = bw.height();
+    std::vector<unsigned> pixels(w * h, ~0U);
+    auto to_y = [h](short s) { return int(s / 32768.0 * (h/2-1) + (h/2)); };
+    for (int i = 0; i < w && !data.empty(); ++i) {
+        // Draw the range of each column rather than a single sample to avoid aliasing
+        const auto first = data.begin() + i * data.size() / w;
+        const auto last  = std::max(first + 1, data.begin() + (i + 1) * data.size() / w);
+        const auto mm    = std::minmax_element(first, last);
+        draw_line(&pixels[0], w, h, i, to_y(*mm.first), i, to_y(*mm.second), 0);
+    }
+    bw.update_pixels(&pixels[0]);
+}
+
+void draw_waveform_overview(bitmap_window& bw, const waveform_overview& overview, uint64_t first, uint64_t last)
+{
+    const int w = bw.width();
+    const int h = bw.height();
+    std::vector<overview_bin> columns(w);
+    overview.query(first, last, w, &columns[0]);
+
+    const size_t samples_per_column = static_cast<size_t>(std::max<uint64_t>(1, (last - first) / w));
+    std::vector<unsigned> pixels(w * h, ~0U);
+    auto to_y = [h](float s) { return std::min(h-1, std::max(0, int(s * (h/2-1) + (h/2)))); };
+    for (int i = 0; i < w; ++i) {
+        const auto& c = columns[i];
+        draw_line(&pixels[0], w, h, i, to_y(c.min), i, to_y(c.max), 0);
+        const float rms = c.rms(samples_per_column);
+        draw_line(&pixels[0], w, h, i, to_y(-rms), i, to_y(rms), 0x808080);
+    }
+    bw.update_pixels(&pixels[0]);
+}
+
+void draw_level_meters(bitmap_window& bw, const float* peaks, const float* rms, int count)
+{
+    const int w = bw.width();
+    const int h = bw.height();
+    std::vector<unsigned> pixels(w * h, ~0U);
+    constexpr float floor_db = -60.0f;
+    auto to_y = [h](float level) {
+        const float db = level > 0.0f ? 20.0f * log10(level) : floor_db;
+        const float f = std::min(1.0f, std::max(0.0f, 1.0f - db / floor_db));
+        return h - 1 - static_cast<int>(f * (h - 1));
+    };
+    const int meter_width = std::max(2, w / count);
+    for (int m = 0; m < count && (m + 1) * meter_width <= w; ++m) {
+        const int x0 = m * meter_width;
+        const int x1 = x0 + meter_width - 1; // One pixel gap between the meters
+        for (int x = x0; x < x1; ++x) {
+            if (rms[m] > 0.0f) draw_line(&pixels[0], w, h, x, to_y(rms[m]), x, h - 1, 0x00A000);
+            if (peaks[m] > 0.0f) pixels[to_y(peaks[m]) * w + x] = peaks[m] >= 1.0f ? 0xFF0000 : 0;
+        }
     }
     bw.update_pixels(&pixels[0]);
 }
@@ -187,7 +319,29 @@ class spectrum_analyzer::impl {
 public:
     impl() {}
 
+    spectrum_mode mode() const {
+        return mode_;
+    }
+
+    void mode(spectrum_mode m) {
+        mode_ = m;
+        if (mode_ == spectrum_mode::constant_q && !cqt_) {
+            cqt_.reset(new constant_q_transform{});
+            history_.assign(constant_q_transform::fft_size, 0);
+        }
+    }
+
     double draw_spetrum_data(bitmap_window& bw, const std::vector<short>& data) {
+        if (mode_ == spectrum_mode::constant_q) {
+            // The low keys need a longer window than a single update provides
+            const size_t keep = history_.size() - std::min(history_.size(), data.size());
+            std::copy(history_.end() - keep, history_.end(), history_.begin());
+            std::copy(data.end() - (history_.size() - keep), data.end(), history_.begin() + keep);
+            temp_.resize(history_.size());
+            std::transform(begin(history_), end(history_), temp_.begin(), [](short s) { return s * (1.0f/32767.0f); });
+            return do_draw_constant_q_data(bw, *cqt_, temp_, spectrum_);
+        }
+
         temp_.resize(data.size());
         std::transform(begin(data), end(data), temp_.begin(), [](short s) { return s * (1.0f/32767.0f); });
         // Make pow2
@@ -202,8 +356,11 @@ public:
     }
 
 private:
-    std::vector<std::complex<float>> temp_;
-    std::vector<float>               spectrum_;
+    spectrum_mode                         mode_ = spectrum_mode::linear;
+    std::unique_ptr<constant_q_transform> cqt_;
+    std::vector<short>                    history_;
+    std::vector<std::complex<float>>      temp_;
+    std::vector<float>                    spectrum_;
 };
 
 
@@ -213,10 +370,214 @@ spectrum_analyzer::spectrum_analyzer() : impl_(new impl())
 
 spectrum_analyzer::~spectrum_analyzer() = default;
 
+spectrum_mode spectrum_analyzer::mode() const
+{
+    return impl_->mode();
+}
+
+void spectrum_analyzer::mode(spectrum_mode m)
+{
+    impl_->mode(m);
+}
+
 double spectrum_analyzer::draw_spetrum_data(bitmap_window& bw, const std::vector<short>& data)
 {
     return impl_->draw_spetrum_data(bw, data);
 }
 
+class spectrogram::impl {
+public:
+    impl(int width, int height, bool keep_history) : width_(width), height_(height), keep_history_(keep_history), ring_(width * height) {
+        assert(width > 0 && height > 0);
+        window_.resize(frame_size);
+        for (int i = 0; i < frame_size; ++i) {
+            window_[i] = 0.5f * (1.0f - cos(2.0f * pi * i / (frame_size - 1))); // Hann
+        }
+
+        // Map rows to bin ranges (excluding DC), each row shows the maximum of its bins
+        constexpr int bins = frame_size / 2;
+        row_bins_.resize(height + 1);
+        for (int r = 0; r <= height; ++r) {
+            row_bins_[r] = 1 + r * (bins - 1) / height;
+        }
+
+        // Black -> blue -> red -> yellow -> white
+        static const unsigned stops[] = { 0x000000, 0x0000A0, 0xC00000, 0xFFE000, 0xFFFFFF };
+        constexpr int num_stops = sizeof(stops) / sizeof(*stops);
+        for (int i = 0; i < color_levels; ++i) {
+            const float pos = float(i) * (num_stops - 1) / (color_levels - 1);
+            const int   s0  = std::min(num_stops - 2, int(pos));
+            const float t   = pos - s0;
+            unsigned c = 0;
+            for (int shift = 0; shift <= 16; shift += 8) {
+                const float a = float((stops[s0] >> shift) & 0xff), b = float((stops[s0 + 1] >> shift) & 0xff);
+                c |= unsigned(a + (b - a) * t + 0.5f) << shift;
+            }
+            colors_[i] = c;
+        }
+    }
+
+    void append(const short* data, size_t count) {
+        pending_.insert(pending_.end(), data, data + count);
+        silent_tail_ = 0;
+        add_columns();
+    }
+
+    void append_silence(size_t count) {
+        pending_.insert(pending_.end(), count, short{0});
+        silent_tail_ += count;
+        add_columns();
+    }
+
+    void draw(bitmap_window& bw) {
+        const int w = std::min(bw.width(), width_);
+        const int h = std::min(bw.height(), height_);
+        // Sized for the window on the first frame, the part the image doesn't cover stays black
+        const size_t size = static_cast<size_t>(bw.width()) * bw.height();
+        if (pixels_.size() != size) pixels_.assign(size, 0);
+        // The oldest column is at next_column_, so each row is copied in two parts around the wrap
+        const int start = (next_column_ + width_ - w) % width_;
+        const int part1 = std::min(w, width_ - start);
+        for (int y = 0; y < h; ++y) {
+            const unsigned* row = &ring_[y * width_];
+            unsigned* out = &pixels_[y * bw.width()];
+            std::copy(row + start, row + start + part1, out);
+            std::copy(row, row + (w - part1), out + part1);
+        }
+        bw.update_pixels(&pixels_[0]);
+    }
+
+    void save_bmp(const std::string& filename) const {
+        assert(keep_history_);
+        const int w = static_cast<int>(history_.size() / height_);
+        const int row_bytes = (w * 3 + 3) & ~3;
+        const uint32_t image_size = row_bytes * height_;
+
+        std::ofstream out(filename, std::ofstream::binary);
+        if (!out) throw std::runtime_error("Could not create " + filename);
+        auto put16 = [&out](unsigned v) { out.put(char(v & 0xff)); out.put(char((v >> 8) & 0xff)); };
+        auto put32 = [&put16](unsigned v) { put16(v & 0xffff); put16(v >> 16); };
+        out.write("BM", 2);
+        put32(14 + 40 + image_size);
+        put32(0);
+        put32(14 + 40);
+        put32(40);        // BITMAPINFOHEADER
+        put32(w);
+        put32(height_);   // Bottom-up, like the history
+        put16(1);
+        put16(24);
+        put32(0);         // BI_RGB
+        put32(image_size);
+        put32(2835);      // 72 DPI
+        put32(2835);
+        put32(0);
+        put32(0);
+
+        std::vector<char> row(row_bytes);
+        for (int y = 0; y < height_; ++y) {
+            for (int x = 0; x < w; ++x) {
+                const unsigned c = history_[x * height_ + y];
+                row[x * 3 + 0] = char(c & 0xff);
+                row[x * 3 + 1] = char((c >> 8) & 0xff);
+                row[x * 3 + 2] = char((c >> 16) & 0xff);
+            }
+            out.write(&row[0], row.size());
+        }
+        if (!out) throw std::runtime_error("Error writing " + filename);
+    }
+
+private:
+    static constexpr int   frame_log2   = 10;
+    static constexpr int   frame_size   = 1 << frame_log2;
+    static constexpr int   hop_size     = frame_size / 2;
+    static constexpr int   color_levels = 256;
+    static constexpr float db_range     = 90.0f;
+
+    int                              width_;
+    int                              height_;
+    bool                             keep_history_;
+    std::vector<unsigned>            ring_;        // Row-major width_ x height_ image, columns written circularly
+    int                              next_column_ = 0;
+    std::vector<unsigned>            history_;     // Column-major, one column of height_ per frame
+    std::vector<unsigned>            pixels_;      // What draw sends to the window
+    std::vector<short>               pending_;
+    size_t                           silent_tail_ = 0; // Number of zero samples at the end of pending_
+    std::vector<float>               window_;
+    std::vector<int>                 row_bins_;
+    unsigned                         colors_[color_levels];
+    std::vector<std::complex<float>> frame_;
+
+    void add_columns() {
+        size_t pos = 0;
+        for (; pos + frame_size <= pending_.size(); pos += hop_size) {
+            if (pos >= pending_.size() - silent_tail_) {
+                add_silent_column();
+            } else {
+                add_column(&pending_[pos]);
+            }
+        }
+        pending_.erase(pending_.begin(), pending_.begin() + pos);
+        silent_tail_ = std::min(silent_tail_, pending_.size());
+    }
+
+    // Same as add_column for a frame of zeros
+    void add_silent_column() {
+        const unsigned color = colors_[0];
+        for (int y = 0; y < height_; ++y) {
+            ring_[y * width_ + next_column_] = color;
+            if (keep_history_) history_.push_back(color);
+        }
+        next_column_ = (next_column_ + 1) % width_;
+    }
+
+    void add_column(const short* data) {
+        frame_.resize(frame_size);
+        for (int i = 0; i < frame_size; ++i) {
+            frame_[i] = data[i] * (window_[i] / 32768.0f);
+        }
+        fft(frame_, frame_log2);
+
+        for (int y = 0; y < height_; ++y) {
+            float mag = 0.0f;
+            for (int b = row_bins_[y], e = std::max(row_bins_[y] + 1, row_bins_[y + 1]); b < e; ++b) {
+                mag = std::max(mag, std::norm(frame_[b]));
+            }
+            // Power to dB relative to full scale, then to a color level
+            const float db = 10.0f * log10(mag + 1e-20f) + db_range;
+            const int level = std::min(color_levels - 1, std::max(0, int(db * (color_levels - 1) / db_range)));
+            const unsigned color = colors_[level];
+            ring_[y * width_ + next_column_] = color;
+            if (keep_history_) history_.push_back(color);
+        }
+        next_column_ = (next_column_ + 1) % width_;
+    }
+};
+
+spectrogram::spectrogram(int width, int height, bool keep_history) : impl_(new impl(width, height, keep_history))
+{
+}
+
+spectrogram::~spectrogram() = default;
+
+void spectrogram::append(const short* data, size_t count)
+{
+    impl_->append(data, count);
+}
+
+void spectrogram::append_silence(size_t count)
+{
+    impl_->append_silence(count);
+}
+
+void spectrogram::draw(bitmap_window& bw)
+{
+    impl_->draw(bw);
+}
+
+void spectrogram::save_bmp(const std::string& filename) const
+{
+    impl_->save_bmp(filename);
+}
+
 
 } // namespace splay
\ No newline at end of file
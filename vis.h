@@ -4,20 +4,60 @@
 #include "gui.h"
 #include <vector>
 #include <memory>
+#include <string>
+#include <stdint.h>
 
 namespace splay {
 
+enum class spectrum_mode {
+    linear,     // FFT bins spread linearly across the view
+    constant_q  // One bin per piano key
+};
+
 class spectrum_analyzer {
 public:
     spectrum_analyzer();
     ~spectrum_analyzer();
 
+    spectrum_mode mode() const;
+    void mode(spectrum_mode m);
+
     double draw_spetrum_data(bitmap_window& bw, const std::vector<short>& data);
 private:
     class impl;
     std::unique_ptr<impl> impl_;
 };
 
+// Scrolling spectrogram (waterfall) with one column per STFT frame
+class spectrogram {
+public:
+    // Shows the most recent width columns, if keep_history is set all columns are also kept for save_bmp
+    explicit spectrogram(int width, int height, bool keep_history = false);
+    ~spectrogram();
+
+    // Adds (mono) samples, producing a column for every completed frame
+    void append(const short* data, size_t count);
+
+    // Same as appending count zero samples, frames that are all silence skip the FFT
+    void append_silence(size_t count);
+
+    void draw(bitmap_window& bw);
+
+    // Writes all columns (requires keep_history) to a 24-bit BMP file
+    void save_bmp(const std::string& filename) const;
+private:
+    class impl;
+    std::unique_ptr<impl> impl_;
+};
+
 void draw_waveform_data(bitmap_window& bw, const std::vector<short>& data);
+
+class waveform_overview;
+// Draws samples [first; last) of the overview as min/max columns with the RMS level on top
+void draw_waveform_overview(bitmap_window& bw, const waveform_overview& overview, uint64_t first, uint64_t last);
+
+// Draws count level meters side by side from -60 dB to full scale, the RMS level as a bar
+// and the peak as a line (red when clipping). Levels are linear, 1 is full scale.
+void draw_level_meters(bitmap_window& bw, const float* peaks, const float* rms, int count);
 } // namespace splay
 #endif
\ No newline at end of file
@@ -13,10 +13,11 @@ using waveout = std::unique_ptr<HWAVEOUT__, decltype(&::waveOutClose)>;
 
 class wavedev::impl {
 public:
-    explicit impl(unsigned sample_rate, callback_t callback) 
+    explicit impl(unsigned sample_rate, callback_t callback, const realtime_thread_config& rt_config)
         : sample_rate_(sample_rate)
         , buffer_size_(2 * 4096)
         , callback_(callback)
+        , rt_config_(rt_config)
         , waveout_(create_waveout())
         , exiting_(false)
         , num_buffers_to_play_(2)
@@ -39,6 +40,7 @@ private:
     const unsigned              sample_rate_;
     const unsigned              buffer_size_;
     callback_t                  callback_;
+    realtime_thread_config      rt_config_;
     waveout                     waveout_;
     std::mutex                  mutex_;
     std::condition_variable     cv_;
@@ -92,7 +94,8 @@ private:
 
     void double_buffer_thread() {
         assert(waveout_.get());
-        SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_ABOVE_NORMAL);
+        report_realtime_problems("wavedev", make_current_thread_realtime(rt_config_));
+        prefault_memory(&data_[0], data_.size() * sizeof(short));
         for (;;) {
             int buffer;
             {
@@ -116,8 +119,8 @@ private:
     }
 };
 
-wavedev::wavedev(unsigned sample_rate, callback_t callback)
-    : impl_(new impl(sample_rate, callback))
+wavedev::wavedev(unsigned sample_rate, callback_t callback, const realtime_thread_config& rt_config)
+    : impl_(new impl(sample_rate, callback, rt_config))
 {
 }
 
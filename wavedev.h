@@ -3,12 +3,13 @@
 
 #include <memory>
 #include <functional>
+#include "realtime.h"
 
 class wavedev {
 public:
     using callback_t = std::function<void(short*, size_t)>;
 
-    explicit wavedev(unsigned sample_rate, callback_t callback);
+    explicit wavedev(unsigned sample_rate, callback_t callback, const realtime_thread_config& rt_config = realtime_thread_config{});
     ~wavedev();
 
     wavedev(const wavedev&) = delete;
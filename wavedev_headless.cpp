@@ -0,0 +1,35 @@
+#include "wavedev.h"
+#include "gui_headless.h"
+#include <vector>
+
+// Sound output of the headless build. There's no device: the headless gui's virtual
+// clock asks for each frame's audio (see headless::set_audio_renderer), so the callback
+// runs on the gui thread in step with the frames and the output is discarded after it.
+// The realtime config doesn't apply to the gui thread.
+class wavedev::impl {
+public:
+    explicit impl(unsigned sample_rate, callback_t callback) : callback_(callback) {
+        data_.reserve(2 * sample_rate / 10); // Frames of up to 100 ms without reallocating
+        headless::set_audio_renderer(sample_rate, [this](size_t count) { render(count); });
+    }
+
+    ~impl() {
+        headless::set_audio_renderer(0, nullptr);
+    }
+
+private:
+    callback_t         callback_;
+    std::vector<short> data_;
+
+    void render(size_t count) {
+        data_.resize(2 * count);
+        callback_(&data_[0], data_.size());
+    }
+};
+
+wavedev::wavedev(unsigned sample_rate, callback_t callback, const realtime_thread_config&)
+    : impl_(new impl(sample_rate, callback))
+{
+}
+
+wavedev::~wavedev() = default;
@@ -0,0 +1,87 @@
+#include "wavfile.h"
+#include <stdexcept>
+#include <assert.h>
+
+namespace splay {
+
+namespace {
+
+void write_u16(std::vector<char>& out, uint16_t val)
+{
+    out.push_back(static_cast<char>(val & 0xff));
+    out.push_back(static_cast<char>(val >> 8));
+}
+
+void write_u32(std::vector<char>& out, uint32_t val)
+{
+    write_u16(out, static_cast<uint16_t>(val & 0xffff));
+    write_u16(out, static_cast<uint16_t>(val >> 16));
+}
+
+void write_tag(std::vector<char>& out, const char* tag)
+{
+    out.insert(out.end(), tag, tag + 4);
+}
+
+constexpr uint64_t riff_size_offset = 4;
+constexpr uint64_t data_size_offset = 40;
+constexpr uint32_t header_size      = 44;
+
+} // unnamed namespace
+
+wav_writer::wav_writer(async_io& io, const std::string& filename, unsigned sample_rate, int channels) : out_(io, filename)
+{
+    constexpr uint16_t bits_per_sample = 16;
+    const uint16_t block_align = static_cast<uint16_t>(channels * bits_per_sample / 8);
+    std::vector<char> header;
+    write_tag(header, "RIFF");
+    write_u32(header, 0); // Filled in by close()
+    write_tag(header, "WAVE");
+    write_tag(header, "fmt ");
+    write_u32(header, 16);
+    write_u16(header, 1); // PCM
+    write_u16(header, static_cast<uint16_t>(channels));
+    write_u32(header, sample_rate);
+    write_u32(header, sample_rate * block_align);
+    write_u16(header, block_align);
+    write_u16(header, bits_per_sample);
+    write_tag(header, "data");
+    write_u32(header, 0); // Filled in by close()
+    assert(header.size() == header_size);
+    out_.write(header.data(), header.size());
+}
+
+wav_writer::~wav_writer()
+{
+    try {
+        close();
+    } catch (...) {
+    }
+}
+
+void wav_writer::write(const short* samples, size_t count)
+{
+    buffer_.resize(count * 2);
+    for (size_t i = 0; i < count; ++i) {
+        const auto s = static_cast<uint16_t>(samples[i]);
+        buffer_[2 * i + 0] = static_cast<char>(s & 0xff);
+        buffer_[2 * i + 1] = static_cast<char>(s >> 8);
+    }
+    out_.write(buffer_.data(), buffer_.size());
+    data_bytes_ += static_cast<uint32_t>(count * sizeof(short));
+}
+
+void wav_writer::close()
+{
+    if (closed_) return;
+    closed_ = true;
+    std::vector<char> size;
+    write_u32(size, header_size - 8 + data_bytes_);
+    out_.write_at(riff_size_offset, size.data(), size.size());
+    size.clear();
+    write_u32(size, data_bytes_);
+    out_.write_at(data_size_offset, size.data(), size.size());
+    out_.close();
+}
+
+} // namespace splay
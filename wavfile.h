@@ -0,0 +1,36 @@
+#ifndef SPLAY_WAVFILE_H
+#define SPLAY_WAVFILE_H
+
+#include <string>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+#include "async_io.h"
+
+namespace splay {
+
+// Writes 16-bit PCM RIFF/WAVE files, the file I/O runs asynchronously on io
+class wav_writer {
+public:
+    explicit wav_writer(async_io& io, const std::string& filename, unsigned sample_rate, int channels = 2);
+    ~wav_writer();
+
+    wav_writer(const wav_writer&) = delete;
+    wav_writer& operator=(const wav_writer&) = delete;
+
+    // Writes count (interleaved) samples
+    void write(const short* samples, size_t count);
+
+    // Fills in the sizes in the header, called by the destructor if not done before
+    void close();
+
+private:
+    async_file_writer out_;
+    bool              closed_     = false;
+    uint32_t          data_bytes_ = 0;
+    std::vector<char> buffer_;
+};
+
+} // namespace splay
+
+#endif
@@ -0,0 +1,193 @@
+#include "worker_pool.h"
+#include "realtime_guard.h"
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+#include <assert.h>
+
+#ifdef _WIN32
+#include <Windows.h>
+#pragma comment(lib, "Synchronization.lib")
+#elif defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+namespace {
+
+// Busy waits before yielding the CPU, or before an idle worker parks
+constexpr int spin_count = 256;
+
+// Waits a little, i is the number of earlier calls of this wait. Yielding lets the
+// thread being waited for run when there are more threads than CPUs.
+void relax(int i)
+{
+    if (i >= spin_count) {
+        std::this_thread::yield();
+        return;
+    }
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+    _mm_pause();
+#endif
+}
+
+// Blocks while word holds value (or until woken). May return spuriously.
+void park(std::atomic<uint32_t>& word, uint32_t value)
+{
+    static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "the address of the atomic is waited on");
+#ifdef _WIN32
+    WaitOnAddress(&word, &value, sizeof(value), INFINITE);
+#elif defined(__linux__)
+    syscall(SYS_futex, &word, FUTEX_WAIT_PRIVATE, value, nullptr, nullptr, 0);
+#else
+    (void)value;
+    std::this_thread::yield();
+#endif
+}
+
+// Wakes all threads parked on word. Never blocks.
+void unpark_all(std::atomic<uint32_t>& word)
+{
+#ifdef _WIN32
+    WakeByAddressAll(&word);
+#elif defined(__linux__)
+    syscall(SYS_futex, &word, FUTEX_WAKE_PRIVATE, INT32_MAX, nullptr, nullptr, 0);
+#else
+    (void)word;
+#endif
+}
+
+} // unnamed namespace
+
+class worker_pool::impl {
+public:
+    explicit impl(int num_threads, const realtime_thread_config& rt_config) : rt_config_(rt_config) {
+        assert(num_threads >= 1);
+        for (int i = 1; i < num_threads; ++i) {
+            threads_.emplace_back(&impl::worker_thread, this, i);
+        }
+    }
+
+    ~impl() {
+        exiting_.store(true, std::memory_order_relaxed);
+        publish(generation_.load(std::memory_order_relaxed) + 1);
+        for (auto& t : threads_) {
+            t.join();
+        }
+    }
+
+    int size() const {
+        return static_cast<int>(threads_.size()) + 1;
+    }
+
+    void run(int count, const std::function<void(int)>& job) {
+        if (threads_.empty() || count <= 1) {
+            for (int i = 0; i < count; ++i) {
+                job(i);
+            }
+            return;
+        }
+        const uint32_t generation = generation_.load(std::memory_order_relaxed) + 1;
+        job_.store(&job, std::memory_order_relaxed);
+        count_.store(count, std::memory_order_relaxed);
+        realtime_.store(in_realtime_scope(), std::memory_order_relaxed);
+        outstanding_.store(count, std::memory_order_relaxed);
+        unclaimed_.store(static_cast<uint64_t>(generation) << 32 | static_cast<uint32_t>(count), std::memory_order_release);
+        publish(generation);
+        work(generation);
+        // Only the jobs claimed by workers can still be running
+        for (int i = 0; outstanding_.load(std::memory_order_acquire); ++i) {
+            relax(i);
+        }
+    }
+
+private:
+    realtime_thread_config               rt_config_;
+    std::vector<std::thread>             threads_;
+    std::atomic<uint32_t>                generation_{0};  // Bumped for every run, workers park on it
+    std::atomic<int>                     sleepers_{0};    // Workers parked or about to park
+    std::atomic<bool>                    exiting_{false};
+    // Generation in the high half, number of jobs not yet claimed in the low half. Claiming checks
+    // both at once, so a worker late for a run can't claim a job of the next one.
+    std::atomic<uint64_t>                unclaimed_{0};
+    std::atomic<int>                     outstanding_{0}; // Jobs not yet finished
+    // Only read by whoever claimed a job of the current run, which the caller waits for
+    std::atomic<const std::function<void(int)>*> job_{nullptr};
+    std::atomic<int>                     count_{0};
+    std::atomic<bool>                    realtime_{false}; // Whether the caller of run is
+
+    void publish(uint32_t generation) {
+        generation_.store(generation, std::memory_order_seq_cst);
+        if (sleepers_.load(std::memory_order_seq_cst)) {
+            unpark_all(generation_);
+        }
+    }
+
+    // Waits for a generation other than seen and returns it
+    uint32_t wait_for_work(uint32_t seen) {
+        for (int i = 0; i < spin_count; ++i) {
+            const uint32_t g = generation_.load(std::memory_order_acquire);
+            if (g != seen) return g;
+            relax(i);
+        }
+        for (;;) {
+            sleepers_.fetch_add(1, std::memory_order_seq_cst);
+            uint32_t g = generation_.load(std::memory_order_seq_cst);
+            if (g == seen) {
+                park(generation_, seen);
+                g = generation_.load(std::memory_order_acquire);
+            }
+            sleepers_.fetch_sub(1, std::memory_order_relaxed);
+            if (g != seen) return g;
+        }
+    }
+
+    // Claims and runs jobs of the given run until none are left
+    void work(uint32_t generation) {
+        uint64_t u = unclaimed_.load(std::memory_order_acquire);
+        for (;;) {
+            if (static_cast<uint32_t>(u >> 32) != generation || !static_cast<uint32_t>(u)) return;
+            if (!unclaimed_.compare_exchange_weak(u, u - 1, std::memory_order_acquire, std::memory_order_acquire)) continue;
+            const int count = count_.load(std::memory_order_relaxed);
+            const int i = count - static_cast<int>(static_cast<uint32_t>(u));
+            {
+                realtime_scope rt{"worker_pool job", realtime_.load(std::memory_order_relaxed)};
+                (*job_.load(std::memory_order_relaxed))(i);
+            }
+            outstanding_.fetch_sub(1, std::memory_order_release);
+            u = unclaimed_.load(std::memory_order_acquire);
+        }
+    }
+
+    void worker_thread(int index) {
+        report_realtime_problems(("worker " + std::to_string(index)).c_str(), make_current_thread_realtime(rt_config_));
+        uint32_t seen = 0;
+        for (;;) {
+            seen = wait_for_work(seen);
+            if (exiting_.load(std::memory_order_relaxed)) return;
+            work(seen);
+        }
+    }
+};
+
+worker_pool::worker_pool(int num_threads, const realtime_thread_config& rt_config) : impl_(new impl{num_threads, rt_config})
+{
+}
+
+worker_pool::~worker_pool() = default;
+
+int worker_pool::size() const
+{
+    return impl_->size();
+}
+
+void worker_pool::run(int count, const std::function<void(int)>& job)
+{
+    impl_->run(count, job);
+}
@@ -0,0 +1,32 @@
+#ifndef WORKER_POOL_H_INCLUDED
+#define WORKER_POOL_H_INCLUDED
+
+#include <memory>
+#include <functional>
+#include "realtime.h"
+
+// Fixed set of threads for running independent pieces of work in parallel.
+// The calling thread takes part, so a pool of size 1 runs everything inline.
+// The worker threads are set up with rt_config when they start.
+class worker_pool {
+public:
+    explicit worker_pool(int num_threads, const realtime_thread_config& rt_config = realtime_thread_config{});
+    ~worker_pool();
+
+    worker_pool(const worker_pool&) = delete;
+    worker_pool& operator=(const worker_pool&) = delete;
+
+    int size() const;
+
+    // Calls job(i) for i in [0; count) spread over the threads, returns when all calls have returned.
+    // Doesn't lock or allocate, so it can be used from the audio thread: jobs are claimed through
+    // atomics and the caller spins until the jobs claimed by workers are done. Idle workers spin
+    // for a while and then park, waking them is a non-blocking futex/WaitOnAddress call.
+    void run(int count, const std::function<void(int)>& job);
+
+private:
+    class impl;
+    std::unique_ptr<impl> impl_;
+};
+
+#endif
@@ -0,0 +1,300 @@
+#include "workload.h"
+#include "midi.h"
+#include <algorithm>
+#include <ostream>
+#include <stdexcept>
+#include <assert.h>
+
+namespace splay { namespace midi {
+
+namespace {
+
+constexpr int      division           = 480;
+constexpr uint32_t default_us_per_qn  = 500000;
+constexpr int      lowest_key         = 36;
+constexpr int      highest_key        = 96;
+
+// Deterministic random numbers (xorshift32), the standard distributions differ between libraries
+class random_source {
+public:
+    explicit random_source(uint32_t seed) : state_(seed ? seed : 0x9E3779B9) {
+    }
+
+    uint32_t next() {
+        state_ ^= state_ << 13;
+        state_ ^= state_ >> 17;
+        state_ ^= state_ << 5;
+        return state_;
+    }
+
+    // [lo; hi]
+    int uniform(int lo, int hi) {
+        assert(lo <= hi);
+        return lo + static_cast<int>(next() % static_cast<uint32_t>(hi - lo + 1));
+    }
+
+    // [0; 1)
+    double unit() {
+        return (next() >> 8) * (1.0 / (1 << 24));
+    }
+
+private:
+    uint32_t state_;
+};
+
+struct tempo_segment {
+    double   start;     // Seconds
+    uint32_t tick;
+    uint32_t us_per_quater_note;
+};
+
+class tempo_map {
+public:
+    explicit tempo_map(const workload& w, random_source& rng) {
+        segments_.push_back({0.0, 0, default_us_per_qn});
+        if (w.tempo_changes <= 0.0f) return;
+        const double interval = 60.0 / w.tempo_changes;
+        for (double t = interval; t < w.duration; t += interval) {
+            const uint32_t bpm = static_cast<uint32_t>(rng.uniform(60, 240));
+            segments_.push_back({t, to_ticks(t), 60000000 / bpm});
+        }
+    }
+
+    const std::vector<tempo_segment>& segments() const {
+        return segments_;
+    }
+
+    uint32_t to_ticks(double seconds) const {
+        auto it = std::upper_bound(segments_.begin(), segments_.end(), seconds, [](double t, const tempo_segment& s) { return t < s.start; }) - 1;
+        return it->tick + static_cast<uint32_t>((seconds - it->start) * 1e6 / it->us_per_quater_note * division + 0.5);
+    }
+
+private:
+    std::vector<tempo_segment> segments_;
+};
+
+struct timed_event {
+    uint32_t             tick;
+    std::vector<uint8_t> bytes;
+};
+
+class track_builder {
+public:
+    void add(uint32_t tick, std::initializer_list<uint8_t> bytes) {
+        events_.push_back({tick, bytes});
+    }
+
+    void write(std::ostream& out) {
+        // Stable, so events of the same tick keep the order they were added in (e.g. note off before note on)
+        std::stable_sort(events_.begin(), events_.end(), [](const timed_event& l, const timed_event& r) { return l.tick < r.tick; });
+        std::vector<uint8_t> data;
+        uint32_t time = 0;
+        for (const auto& e : events_) {
+            put_var_num(data, e.tick - time);
+            time = e.tick;
+            data.insert(data.end(), e.bytes.begin(), e.bytes.end());
+        }
+        put_var_num(data, 0);
+        data.insert(data.end(), {0xFF, 0x2F, 0x00}); // End of track
+
+        out.write("MTrk", 4);
+        put_be(out, static_cast<uint32_t>(data.size()), 4);
+        out.write(reinterpret_cast<const char*>(data.data()), data.size());
+    }
+
+    static void put_be(std::ostream& out, uint32_t val, int bytes) {
+        for (int i = bytes - 1; i >= 0; --i) {
+            out.put(static_cast<char>((val >> (8 * i)) & 0xff));
+        }
+    }
+
+private:
+    std::vector<timed_event> events_;
+
+    static void put_var_num(std::vector<uint8_t>& out, uint32_t val) {
+        uint8_t buf[4];
+        int n = 0;
+        do {
+            buf[n++] = val & 0x7f;
+            val >>= 7;
+        } while (val && n < 4);
+        while (n--) {
+            out.push_back(static_cast<uint8_t>(buf[n] | (n ? 0x80 : 0)));
+        }
+    }
+};
+
+void add_notes(track_builder& track, const workload& w, const tempo_map& tempo, random_source& rng, int channel)
+{
+    struct sounding {
+        double end;
+        int    key;
+    };
+    std::vector<sounding> notes;
+
+    const auto note_off = [&](const sounding& n, double t) {
+        track.add(tempo.to_ticks(std::min(n.end, t)), {static_cast<uint8_t>(0x80 | channel), static_cast<uint8_t>(n.key), 0});
+    };
+
+    // Each note lasts long enough that polyphony notes overlap on average
+    const double interval = 1.0 / w.note_rate;
+    const double length   = w.polyphony * interval;
+    for (double t = interval * rng.unit(); t < w.duration; t += interval * (0.5 + rng.unit())) {
+        // Release notes that have ended (or cut the oldest when at the polyphony limit), then pick a key that isn't sounding
+        std::stable_sort(notes.begin(), notes.end(), [](const sounding& l, const sounding& r) { return l.end < r.end; });
+        while (!notes.empty() && (notes.front().end <= t || static_cast<int>(notes.size()) >= std::min(w.polyphony, highest_key - lowest_key))) {
+            note_off(notes.front(), t);
+            notes.erase(notes.begin());
+        }
+        int key;
+        do {
+            key = rng.uniform(lowest_key, highest_key);
+        } while (std::any_of(notes.begin(), notes.end(), [key](const sounding& n) { return n.key == key; }));
+        track.add(tempo.to_ticks(t), {static_cast<uint8_t>(0x90 | channel), static_cast<uint8_t>(key), static_cast<uint8_t>(rng.uniform(40, 127))});
+        notes.push_back({t + length * (0.5 + rng.unit()), key});
+    }
+    for (const auto& n : notes) {
+        note_off(n, w.duration);
+    }
+}
+
+void add_controllers(track_builder& track, const workload& w, const tempo_map& tempo, random_source& rng, int channel)
+{
+    const uint8_t status = static_cast<uint8_t>(channel);
+    const double interval = 1.0 / w.controller_rate;
+    for (double t = interval * rng.unit(); t < w.duration; t += interval * (0.5 + rng.unit())) {
+        const uint32_t tick  = tempo.to_ticks(t);
+        const uint8_t  value = static_cast<uint8_t>(rng.uniform(0, 127));
+        switch (rng.uniform(0, 4)) {
+        case 0: track.add(tick, {static_cast<uint8_t>(0xB0 | status), static_cast<uint8_t>(controller_type::volume), value}); break;
+        case 1: track.add(tick, {static_cast<uint8_t>(0xB0 | status), static_cast<uint8_t>(controller_type::pan), value}); break;
+        case 2: track.add(tick, {static_cast<uint8_t>(0xB0 | status), static_cast<uint8_t>(controller_type::modulation_wheel), value}); break;
+        case 3: track.add(tick, {static_cast<uint8_t>(0xD0 | status), value}); break;
+        case 4: track.add(tick, {static_cast<uint8_t>(0xE0 | status), static_cast<uint8_t>(rng.uniform(0, 127)), value}); break;
+        }
+    }
+}
+
+void add_drums(track_builder& track, const workload& w, const tempo_map& tempo, random_source& rng)
+{
+    const uint8_t on  = 0x90 | drum_channel;
+    const uint8_t off = 0x80 | drum_channel;
+    const double interval = 1.0 / w.drum_rate;
+    for (double t = 0.0; t < w.duration; t += interval) {
+        const uint8_t key = static_cast<uint8_t>(rng.uniform(35, 81));
+        track.add(tempo.to_ticks(t), {on, key, static_cast<uint8_t>(rng.uniform(40, 127))});
+        track.add(tempo.to_ticks(std::min(t + interval / 2, static_cast<double>(w.duration))), {off, key, 0});
+    }
+}
+
+} // unnamed namespace
+
+void write_workload(std::ostream& out, const workload& w)
+{
+    if (w.channels < 0 || w.channels > max_channels - 1 || w.polyphony < 1 || w.note_rate <= 0.0f || w.drum_rate < 0.0f ||
+        w.tempo_changes < 0.0f || w.controller_rate < 0.0f || w.duration <= 0.0f) {
+        throw std::runtime_error("Invalid workload parameters");
+    }
+
+    random_source rng{w.seed};
+    const tempo_map tempo{w, rng};
+    std::vector<track_builder> tracks(1);
+
+    // Conductor track: time signature and tempo map
+    tracks[0].add(0, {0xFF, 0x58, 0x04, 4, 2, 24, 8});
+    for (const auto& s : tempo.segments()) {
+        tracks[0].add(s.tick, {0xFF, 0x51, 0x03, static_cast<uint8_t>(s.us_per_quater_note >> 16), static_cast<uint8_t>(s.us_per_quater_note >> 8), static_cast<uint8_t>(s.us_per_quater_note)});
+    }
+
+    for (int i = 0; i < w.channels; ++i) {
+        const int channel = i < drum_channel ? i : i + 1;
+        tracks.emplace_back();
+        auto& track = tracks.back();
+        track.add(0, {static_cast<uint8_t>(0xC0 | channel), static_cast<uint8_t>(rng.uniform(0, 127))});
+        add_notes(track, w, tempo, rng, channel);
+        if (w.controller_rate > 0.0f) {
+            add_controllers(track, w, tempo, rng, channel);
+        }
+    }
+    if (w.drum_rate > 0.0f) {
+        tracks.emplace_back();
+        add_drums(tracks.back(), w, tempo, rng);
+    }
+
+    out.write("MThd", 4);
+    track_builder::put_be(out, 6, 4);
+    track_builder::put_be(out, 1, 2);
+    track_builder::put_be(out, static_cast<uint32_t>(tracks.size()), 2);
+    track_builder::put_be(out, division, 2);
+    for (auto& t : tracks) {
+        t.write(out);
+    }
+}
+
+std::vector<std::pair<std::string, workload>> workload_presets()
+{
+    std::vector<std::pair<std::string, workload>> presets;
+    workload w;
+    presets.emplace_back("baseline", w);
+
+    w = workload{};
+    w.channels  = 8;
+    w.polyphony = 16;
+    presets.emplace_back("dense_chords", w);
+
+    w = workload{};
+    w.polyphony = 2;
+    w.note_rate = 40.0f;
+    presets.emplace_back("fast_notes", w);
+
+    w = workload{};
+    w.tempo_changes = 600.0f;
+    presets.emplace_back("tempo_changes", w);
+
+    w = workload{};
+    w.channels        = 15;
+    w.polyphony       = 4;
+    w.note_rate       = 4.0f;
+    w.controller_rate = 200.0f;
+    presets.emplace_back("controllers", w);
+
+    w = workload{};
+    w.channels  = 2;
+    w.drum_rate = 20.0f;
+    presets.emplace_back("drums", w);
+
+    w = workload{};
+    w.channels        = 15;
+    w.polyphony       = 32;
+    w.note_rate       = 32.0f;
+    w.drum_rate       = 30.0f;
+    w.tempo_changes   = 120.0f;
+    w.controller_rate = 100.0f;
+    presets.emplace_back("worst_case", w);
+
+    return presets;
+}
+
+bool set_workload_parameter(workload& w, const std::string& assignment)
+{
+    const auto eq = assignment.find('=');
+    if (eq == std::string::npos) return false;
+    const auto name  = assignment.substr(0, eq);
+    const auto value = assignment.substr(eq + 1);
+    try {
+        if (name == "channels")             w.channels        = std::stoi(value);
+        else if (name == "polyphony")       w.polyphony       = std::stoi(value);
+        else if (name == "note_rate")       w.note_rate       = std::stof(value);
+        else if (name == "drum_rate")       w.drum_rate       = std::stof(value);
+        else if (name == "tempo_changes")   w.tempo_changes   = std::stof(value);
+        else if (name == "controller_rate") w.controller_rate = std::stof(value);
+        else if (name == "duration")        w.duration        = std::stof(value);
+        else if (name == "seed")            w.seed            = static_cast<uint32_t>(std::stoul(value));
+        else return false;
+    } catch (const std::exception&) {
+        return false;
+    }
+    return true;
+}
+
+} } // namespace splay::midi
@@ -0,0 +1,36 @@
+#ifndef SPLAY_WORKLOAD_H
+#define SPLAY_WORKLOAD_H
+
+#include <iosfwd>
+#include <string>
+#include <utility>
+#include <vector>
+#include <stdint.h>
+
+namespace splay { namespace midi {
+
+// Parameters of a synthetic MIDI workload. The same parameters (including
+// the seed) always produce the same file, on any platform.
+struct workload {
+    int      channels        = 4;       // Melodic channels, the drum channel is skipped
+    int      polyphony       = 8;       // Notes sounding at once on each channel
+    float    note_rate       = 8.0f;    // Note-ons per second on each channel
+    float    drum_rate       = 0.0f;    // Hits per second on the drum channel, 0 for none
+    float    tempo_changes   = 0.0f;    // Per minute
+    float    controller_rate = 0.0f;    // Controller, pressure and pitch bend events per second on each channel
+    float    duration        = 60.0f;   // Seconds
+    uint32_t seed            = 1;
+};
+
+// Writes the workload as a format 1 Standard MIDI File, one track per channel
+void write_workload(std::ostream& out, const workload& w);
+
+// Named workloads from typical songs to worst cases
+std::vector<std::pair<std::string, workload>> workload_presets();
+
+// Sets a parameter from "name=value" (names as in workload), returns false if it isn't valid
+bool set_workload_parameter(workload& w, const std::string& assignment);
+
+} } // namespace splay::midi
+
+#endif